@@ -0,0 +1,78 @@
+#include "ACPI.h"
+#include "Multiboot2.h"
+
+#include "Kernel/Memory/Vmm.h"
+
+#include "Libraries/libc/string.h"
+
+namespace BartOS
+{
+
+namespace ACPI
+{
+
+namespace
+{
+
+/*
+ *  @brief Get the RSDP copied into the boot info by the bootloader.
+ *
+ *  @return pointer to the RSDP, nullptr if the bootloader passed none.
+ */
+const acpi_rsdp *GetRsdp()
+{
+    //! The ACPI 2.0+ RSDP carries the XSDT address, prefer it.
+    const multiboot_tag_new_acpi * const pNewAcpiTag = GetMultiboot2Tag<multiboot_tag_new_acpi>(MULTIBOOT_TAG_TYPE_ACPI_NEW);
+    if (pNewAcpiTag)
+        return reinterpret_cast<const acpi_rsdp *>(&pNewAcpiTag->rsdp);
+
+    const multiboot_tag_old_acpi * const pOldAcpiTag = GetMultiboot2Tag<multiboot_tag_old_acpi>(MULTIBOOT_TAG_TYPE_ACPI_OLD);
+    if (pOldAcpiTag)
+        return reinterpret_cast<const acpi_rsdp *>(&pOldAcpiTag->rsdp);
+
+    return nullptr;
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalAddress FindTable(const char *pSignature)
+{
+    const acpi_rsdp * const pRsdp = GetRsdp();
+    if ((!pRsdp) || (0 != memcmp(pRsdp->signature, ACPI_SIG_RSDP, sizeof(pRsdp->signature))))
+        return PhysicalAddress(0);
+
+    //! The XSDT holds 64-bit table pointers, the RSDT 32-bit ones.
+    const bool isXsdt = (2 <= pRsdp->revision) && (0 != pRsdp->xsdt_address);
+    const PhysicalAddress rootTableAddress(isXsdt ? pRsdp->xsdt_address : pRsdp->rsdt_address);
+    const size_t entrySize = isXsdt ? sizeof(uint64_t) : sizeof(uint32_t);
+
+    acpi_table_header rootTableHeader;
+    ReadTable(&rootTableHeader, rootTableAddress, sizeof(rootTableHeader));
+
+    const size_t nEntries = (rootTableHeader.length - sizeof(acpi_table_header)) / entrySize;
+    for (size_t entryIndex = 0; entryIndex < nEntries; ++entryIndex)
+    {
+        uint64_t tableAddress = 0;
+        ReadTable(&tableAddress, PhysicalAddress(rootTableAddress.Get() + sizeof(acpi_table_header) + (entryIndex * entrySize)), entrySize);
+
+        acpi_table_header tableHeader;
+        ReadTable(&tableHeader, PhysicalAddress(tableAddress), sizeof(tableHeader));
+        if (0 == memcmp(tableHeader.signature, pSignature, sizeof(tableHeader.signature)))
+            return PhysicalAddress(tableAddress);
+    }
+
+    return PhysicalAddress(0);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void ReadTable(void *pBuffer, const PhysicalAddress &physicalAddress, const size_t nBytes)
+{
+    MM::Vmm::Get().CopyFromPhysical(pBuffer, physicalAddress, nBytes);
+}
+
+} // namespace ACPI
+
+} // namespace BartOS
@@ -0,0 +1,133 @@
+#ifndef ACPI_H
+#define ACPI_H
+
+#include "Kernel/BartOS.h"
+
+#include "Kernel/Memory/PhysicalAddress.h"
+
+namespace BartOS
+{
+
+/*  The signatures of the tables looked up by the kernel. */
+#define ACPI_SIG_RSDP                       "RSD PTR "
+#define ACPI_SIG_SRAT                       "SRAT"
+#define ACPI_SIG_SLIT                       "SLIT"
+
+/*  The SRAT subtable types. */
+#define ACPI_SRAT_TYPE_CPU_AFFINITY         0
+#define ACPI_SRAT_TYPE_MEMORY_AFFINITY      1
+#define ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY  2
+
+/*  The SRAT affinity flags. */
+#define ACPI_SRAT_ENABLED                   (1 << 0)
+#define ACPI_SRAT_MEM_HOT_PLUGGABLE         (1 << 1)
+#define ACPI_SRAT_MEM_NON_VOLATILE          (1 << 2)
+
+struct [[gnu::packed]] acpi_rsdp
+{
+    char     signature[8];
+    uint8_t  checksum;
+    char     oem_id[6];
+    uint8_t  revision;
+    uint32_t rsdt_address;
+    /*  ACPI 2.0+ only. */
+    uint32_t length;
+    uint64_t xsdt_address;
+    uint8_t  extended_checksum;
+    uint8_t  reserved[3];
+};
+
+struct [[gnu::packed]] acpi_table_header
+{
+    char     signature[4];
+    uint32_t length;
+    uint8_t  revision;
+    uint8_t  checksum;
+    char     oem_id[6];
+    char     oem_table_id[8];
+    uint32_t oem_revision;
+    uint32_t asl_compiler_id;
+    uint32_t asl_compiler_revision;
+};
+
+struct [[gnu::packed]] acpi_table_srat : public acpi_table_header
+{
+    uint32_t table_revision;
+    uint64_t reserved;
+};
+
+struct [[gnu::packed]] acpi_table_slit : public acpi_table_header
+{
+    uint64_t locality_count;
+    uint8_t  entry;
+};
+
+struct [[gnu::packed]] acpi_subtable_header
+{
+    uint8_t  type;
+    uint8_t  length;
+};
+
+struct [[gnu::packed]] acpi_srat_cpu_affinity : public acpi_subtable_header
+{
+    uint8_t  proximity_domain_lo;
+    uint8_t  apic_id;
+    uint32_t flags;
+    uint8_t  local_sapic_eid;
+    uint8_t  proximity_domain_hi[3];
+    uint32_t clock_domain;
+};
+
+struct [[gnu::packed]] acpi_srat_mem_affinity : public acpi_subtable_header
+{
+    uint32_t proximity_domain;
+    uint16_t reserved;
+    uint64_t base_address;
+    uint64_t length;
+    uint32_t reserved1;
+    uint32_t flags;
+    uint64_t reserved2;
+};
+
+struct [[gnu::packed]] acpi_srat_x2apic_cpu_affinity : public acpi_subtable_header
+{
+    uint16_t reserved;
+    uint32_t proximity_domain;
+    uint32_t apic_id;
+    uint32_t flags;
+    uint32_t clock_domain;
+    uint32_t reserved2;
+};
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+namespace ACPI
+{
+
+/*
+ *  @brief Find an ACPI table through the RSDP passed by the bootloader.
+ *  The XSDT is used when the firmware provides one, the RSDT otherwise. The tables are gone once the PMM
+ *  reclaims the boot memory.
+ *
+ *  @param pSignature the 4 character table signature.
+ *
+ *  @return the physical address of the table header, 0 if there is no such table.
+ */
+PhysicalAddress FindTable(const char *pSignature);
+
+/*
+ *  @brief Copy a part of an ACPI table.
+ *  The tables are outside of the kernel image, they are read through the temporary mapping.
+ *
+ *  @param pBuffer the buffer to copy to.
+ *  @param physicalAddress the physical address to copy from.
+ *  @param nBytes the amount of bytes to copy.
+ */
+void ReadTable(void *pBuffer, const PhysicalAddress &physicalAddress, const size_t nBytes);
+
+} // namespace ACPI
+
+} // namespace BartOS
+
+#endif // ACPI_H
@@ -3,6 +3,8 @@
 
 #include "Libraries/libc/stdio.h"
 
+#include "cpuid.h"
+
 namespace BartOS
 {
 
@@ -12,6 +14,61 @@ inline namespace x86_64
 namespace CPU
 {
 
+namespace
+{
+
+constexpr uint32_t CPUID_CACHE_PARAMETERS = 0x4;            ///< The Intel deterministic cache parameters leaf.
+constexpr uint32_t CPUID_AMD_CACHE_PARAMETERS = 0x8000001D; ///< The AMD cache topology leaf, same layout as the Intel one.
+constexpr uint32_t CPUID_EXTENDED_FEATURES = 0x80000001;    ///< The extended processor features leaf.
+constexpr uint32_t CPUID_EDX_PDPE1GB = (1U << 26);          ///< The 1 GiB pages feature bit.
+constexpr uint32_t CPUID_FEATURES = 0x1;                    ///< The processor features leaf.
+constexpr uint32_t CPUID_ECX_PCID = (1U << 17);             ///< The process context identifiers feature bit.
+constexpr uint32_t CPUID_STRUCTURED_FEATURES = 0x7;         ///< The structured extended features leaf.
+constexpr uint32_t CPUID_EBX_INVPCID = (1U << 10);          ///< The INVPCID instruction feature bit.
+constexpr uint32_t MAX_CACHE_SUBLEAVES = 16;                ///< The maximum number of caches described.
+constexpr uint32_t CACHE_TYPE_NULL = 0;                     ///< No more caches.
+constexpr uint32_t CACHE_TYPE_INSTRUCTION = 2;              ///< An instruction cache.
+
+/*
+ *  @brief Get the way size of the highest level data or unified cache described by a cache parameters leaf.
+ *
+ *  @param leaf the CPUID leaf.
+ *
+ *  @return the way size in bytes, 0 if the leaf describes no cache.
+ */
+size_t GetLastLevelWaySize(const uint32_t leaf)
+{
+    size_t waySize = 0;
+    uint32_t lastLevel = 0;
+
+    for (uint32_t subleaf = 0; subleaf < MAX_CACHE_SUBLEAVES; ++subleaf)
+    {
+        uint32_t eax, ebx, ecx, edx;
+        __cpuid_count(leaf, subleaf, eax, ebx, ecx, edx);
+
+        const uint32_t cacheType = eax & 0x1F;
+        if (CACHE_TYPE_NULL == cacheType)
+            break;
+
+        const uint32_t cacheLevel = (eax >> 5) & 0x7;
+        if ((CACHE_TYPE_INSTRUCTION == cacheType) || (cacheLevel < lastLevel))
+            continue;
+
+        const size_t lineSize = (ebx & 0xFFF) + 1;
+        const size_t nPartitions = ((ebx >> 12) & 0x3FF) + 1;
+        const size_t nSets = static_cast<size_t>(ecx) + 1;
+
+        lastLevel = cacheLevel;
+        waySize = lineSize * nPartitions * nSets;
+    }
+
+    return waySize;
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------------------------------------------
+
 RFLAGS GetRFLAGS()
 {
     uint64_t rflags;
@@ -157,7 +214,8 @@ void SetEFER(const uint32_t msrId, const uint64_t value)
 // ---------------------------------------------------------------------------------------------------------
 
 
-InterruptDisabler::InterruptDisabler()
+InterruptDisabler::InterruptDisabler() :
+    m_wereInterruptsEnabled(GetRFLAGS().Get<RFLAGS::InterruptEnableFlag>())
 {
     Cli();
 }
@@ -166,7 +224,17 @@ InterruptDisabler::InterruptDisabler()
 
 InterruptDisabler::~InterruptDisabler()
 {
-    Sti();
+    if (m_wereInterruptsEnabled)
+        Sti();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+size_t GetCpuIndex()
+{
+    //! Only the bootstrap processor is running.
+    return 0;
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -193,9 +261,24 @@ void Hlt()
 
 // ---------------------------------------------------------------------------------------------------------
 
+void Pause()
+{
+    asm __volatile__("pause" : : : "memory");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryBarrier()
+{
+    asm __volatile__("mfence" : : : "memory");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 void Invlpg(const Address_t virtualAddress)
 {
-    __asm__ __volatile__("invlpg (%%eax)" : : "a" (virtualAddress));
+    //! The full 64 bit register, a 32 bit address size would truncate higher half addresses.
+    __asm__ __volatile__("invlpg (%[address])" : : [address] "r" (virtualAddress) : "memory");
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -205,6 +288,91 @@ void Invlpg(const VirtualAddress virtualAddress)
     Invlpg(virtualAddress.Get());
 }
 
+// ---------------------------------------------------------------------------------------------------------
+
+void Invpcid(const InvpcidType invpcidType, const uint16_t pcid, const Address_t virtualAddress)
+{
+    const uint64_t descriptor[2] = { pcid, virtualAddress };
+    __asm__ __volatile__("invpcid %[descriptor], %[type]" : : [descriptor] "m" (descriptor), [type] "r" (static_cast<uint64_t>(invpcidType))
+                         : "memory");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+uint64_t ReadTsc()
+{
+    uint32_t low;
+    uint32_t high;
+    __asm__ __volatile__("rdtsc" : "=a" (low), "=d" (high));
+
+    return (static_cast<uint64_t>(high) << 32) | low;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t GetCacheWaySize()
+{
+    if (CPUID_CACHE_PARAMETERS <= __get_cpuid_max(0, nullptr))
+    {
+        const size_t waySize = GetLastLevelWaySize(CPUID_CACHE_PARAMETERS);
+        if (0 != waySize)
+            return waySize;
+    }
+
+    if (CPUID_AMD_CACHE_PARAMETERS <= __get_cpuid_max(0x80000000, nullptr))
+        return GetLastLevelWaySize(CPUID_AMD_CACHE_PARAMETERS);
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool IsGigabytePageSupported()
+{
+    if (CPUID_EXTENDED_FEATURES > __get_cpuid_max(0x80000000, nullptr))
+        return false;
+
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid(CPUID_EXTENDED_FEATURES, eax, ebx, ecx, edx);
+
+    return (0 != (edx & CPUID_EDX_PDPE1GB));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool IsPcidSupported()
+{
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid(CPUID_FEATURES, eax, ebx, ecx, edx);
+
+    return (0 != (ecx & CPUID_ECX_PCID));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool IsInvpcidSupported()
+{
+    if (CPUID_STRUCTURED_FEATURES > __get_cpuid_max(0, nullptr))
+        return false;
+
+    uint32_t eax, ebx, ecx, edx;
+    __cpuid_count(CPUID_STRUCTURED_FEATURES, 0, eax, ebx, ecx, edx);
+
+    return (0 != (ebx & CPUID_EBX_INVPCID));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void ZeroNonTemporal(void * const pDestination, const size_t size)
+{
+    uint64_t * const pQwords = static_cast<uint64_t *>(pDestination);
+    for (size_t qword = 0; qword < (size / sizeof(uint64_t)); ++qword)
+        __asm__ __volatile__("movnti %[zero], %[destination]" : [destination] "=m" (pQwords[qword]) : [zero] "r" (0UL));
+
+    //! Non-temporal stores are weakly ordered, fence them before the memory is handed out.
+    __asm__ __volatile__("sfence" : : : "memory");
+}
+
 } // namespace CPU
 
 } // namespace x86
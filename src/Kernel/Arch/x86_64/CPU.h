@@ -118,8 +118,9 @@ void *GetCR2();
 class CR3 : public Bitmap<64>
 {
 public:
-    typedef BitField<CR3, 12>       Reserved;           ///< Reserved.
-    typedef BitField<Reserved, 52>  PhysicalAddress;    ///< The page aligned physical address of the PML4.
+    typedef BitField<CR3, 12>               PCID;               ///< The process context identifier with CR4.PCIDE set, the PML4 cache flags otherwise.
+    typedef BitField<PCID, 51>              PhysicalAddress;    ///< The page aligned physical address of the PML4.
+    typedef BitField<PhysicalAddress, 1>    NoFlush;            ///< Keep the TLB entries of the PCID on write with CR4.PCIDE set, always read as 0.
 };
 static_assert(sizeof(CR3) == 8);
 
@@ -163,13 +164,15 @@ public:
     typedef BitField<UMIP, 1>                       LA57;                       ///< Enabled 5 level paging.
     typedef BitField<LA57, 1>                       VMXE;                       ///< Virtual machine extensions enable.
     typedef BitField<VMXE, 1>                       SMXE;                       ///< Safer mode extensions enable.
-    typedef BitField<SMXE, 1>                       FSGSBASE;                   ///< Enables the instructions RDFSBASE, RDGSBASE, WRFSBASE and WRGSBASE.
+    typedef BitField<SMXE, 1>                       Reserved;                   ///< Reserved.
+    typedef BitField<Reserved, 1>                   FSGSBASE;                   ///< Enables the instructions RDFSBASE, RDGSBASE, WRFSBASE and WRGSBASE.
     typedef BitField<FSGSBASE, 1>                   PCIDE;                      ///< PCID enable.
     typedef BitField<PCIDE, 1>                      OSXSAVE;                    ///< XSAVE and Processor Extended States Enable.
-    typedef BitField<OSXSAVE, 1>                    SMEP;                       ///< Supervisor mode execution prevention enable.
+    typedef BitField<OSXSAVE, 1>                    Reserved2;                  ///< Reserved.
+    typedef BitField<Reserved2, 1>                  SMEP;                       ///< Supervisor mode execution prevention enable.
     typedef BitField<SMEP, 1>                       SMAP;                       ///< Supervisor mode access prevention enable.
     typedef BitField<SMAP, 1>                       PKE;                        ///< Protection key enable.
-    typedef BitField<PKE, 42>                       Reserved;                   ///< Reserved.
+    typedef BitField<PKE, 41>                       Reserved3;                  ///< Reserved.
 };
 static_assert(sizeof(CR4) == 8);
 
@@ -236,6 +239,7 @@ void SetEFER(const uint32_t msrId, const uint64_t value);
 
 /*
  *  @brief Disable interrupts for the lifetime of this object.
+ *  Interrupts are only enabled again if they were enabled on construction, so the object can be nested.
  */
 class InterruptDisabler
 {
@@ -245,11 +249,26 @@ public:
 
     //! Destructor
     ~InterruptDisabler();
+
+private:
+    bool m_wereInterruptsEnabled;   ///< Whether interrupts were enabled on construction.
 };
 
 // ---------------------------------------------------------------------------------------------------------
 // ---------------------------------------------------------------------------------------------------------
 
+constexpr size_t MAX_CPUS = 16;     ///< The maximum number of CPUs supported.
+
+/*
+ *  @brief Get the index of the executing CPU.
+ * 
+ *  @return the CPU index.
+ */
+size_t GetCpuIndex();
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
 //! Disable interrupts.
 void Cli();
 
@@ -259,12 +278,76 @@ void Sti();
 //! Halt the CPU.
 void Hlt();
 
+//! Hint a spin-wait loop to the CPU.
+void Pause();
+
+//! Order all the earlier loads and stores before the later ones, for memory shared with devices.
+void MemoryBarrier();
+
 //! Invalidate the page in the TLB;
 void Invlpg(const Address_t virtualAddress);
 
 //! Invalidate the page in the TLB;
 void Invlpg(const VirtualAddress virtualAddress);
 
+//! The INVPCID invalidation types.
+enum InvpcidType : uint64_t
+{
+    INVPCID_ADDRESS     = 0,    ///< The non global translation of an address in a PCID.
+    INVPCID_CONTEXT     = 1,    ///< The non global translations of a PCID.
+    INVPCID_ALL_GLOBAL  = 2,    ///< All the translations of all the PCIDs, global ones included.
+    INVPCID_ALL         = 3     ///< The non global translations of all the PCIDs.
+};
+
+/*
+ *  @brief Invalidate translations in the TLB and the paging structure caches, including the ones of other PCIDs.
+ * 
+ *  @param invpcidType the invalidation type.
+ *  @param pcid the PCID, ignored by the all contexts types.
+ *  @param virtualAddress the address, only used by INVPCID_ADDRESS.
+ */
+void Invpcid(const InvpcidType invpcidType, const uint16_t pcid, const Address_t virtualAddress);
+
+//! Read the time stamp counter.
+uint64_t ReadTsc();
+
+/*
+ *  @brief Get the way size of the last level data cache from the CPUID cache parameters.
+ *  Memory which is a way size apart maps to the same cache set.
+ * 
+ *  @return the way size in bytes, 0 if the CPU doesn't report its cache parameters.
+ */
+size_t GetCacheWaySize();
+
+/*
+ *  @brief Whether the CPU supports 1 GiB pages, from the CPUID extended features.
+ * 
+ *  @return whether level 3 page table entries can map 1 GiB pages.
+ */
+bool IsGigabytePageSupported();
+
+/*
+ *  @brief Whether the CPU supports process context identifiers, from the CPUID features.
+ * 
+ *  @return whether CR4.PCIDE can be set.
+ */
+bool IsPcidSupported();
+
+/*
+ *  @brief Whether the CPU supports the INVPCID instruction, from the CPUID structured extended features.
+ * 
+ *  @return whether Invpcid can be used.
+ */
+bool IsInvpcidSupported();
+
+/*
+ *  @brief Zero memory with non-temporal stores which bypass the cache.
+ * 
+ *  @param pDestination pointer to the memory, 8 byte aligned.
+ *  @param size the size of the memory, a multiple of 8 bytes.
+ */
+void ZeroNonTemporal(void * const pDestination, const size_t size);
+
 } // namespace CPU
 
 } // namespace x86
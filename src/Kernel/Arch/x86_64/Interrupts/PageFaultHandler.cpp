@@ -24,9 +24,6 @@ StatusCode PageFaultHandler::Handle(const InterruptContext &interruptContext) co
     const VirtualAddress vAddrFault(CPU::GetCR2());
     const Flags &pageFaultFlags(reinterpret_cast<const Flags &>(interruptContext.m_errorCode));
 
-    kprintf("Page Fault Address: %p\n", vAddrFault.Get());
-    kprintf("Instruction Address: %p\n", interruptContext.m_rip);
-
     MM::VMArea *pVMArea   = nullptr;
     MM::AddressSpace *pAddressSpace = nullptr;
 
@@ -54,6 +51,13 @@ StatusCode PageFaultHandler::Handle(const InterruptContext &interruptContext) co
     {
         // Get user Address Space.
     }
+
+    //! A write to a merged page breaks the sharing, the mapping gets a private copy and the write is retried.
+    if (isProtectionFault && isWrite && pAddressSpace && (STATUS_CODE_SUCCESS == m_vmm.BreakMergedPage(*pAddressSpace, vAddrFault)))
+        return STATUS_CODE_SUCCESS;
+
+    kprintf("Page Fault Address: %p\n", vAddrFault.Get());
+    kprintf("Instruction Address: %p\n", interruptContext.m_rip);
     
     ASSERT(pVMArea && pAddressSpace);
 
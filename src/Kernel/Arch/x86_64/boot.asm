@@ -22,10 +22,11 @@ p3_table:
     times (510) dq 0
     dq p2_table - KERNEL_VIRTUAL_BASE + 0b11
 
+; The kernel pages are global, the bit is ignored until PGE is set.
 align 4096
 p2_table:
-    dq 0x0000000000000000 + 0x83
-    dq 0x0000000000200000 + 0x83
+    dq 0x0000000000000000 + 0x183
+    dq 0x0000000000200000 + 0x183
     times (509) dq 0
     dq p1_temp_map_table - KERNEL_VIRTUAL_BASE + 0b11
 
@@ -106,6 +107,12 @@ long_mode_start:
     mov rax, p4_table - KERNEL_VIRTUAL_BASE
     mov cr3, rax
 
+    ; enable global pages in cr4, now that the identity mapping is gone.
+    ; the kernel pages survive the following cr3 reloads.
+    mov rax, cr4
+    or rax, 1 << 7
+    mov cr4, rax
+
     ; reload the gdt with virtual address.
     mov rax, gdt64.addr
     mov rbx, KERNEL_VIRTUAL_BASE
@@ -0,0 +1,92 @@
+#include "VirtQueue.h"
+
+#include "Kernel/Arch/x86_64/CPU.h"
+#include "Kernel/Memory/VirtualAddress.h"
+
+#include "Libraries/libc/string.h"
+
+namespace BartOS
+{
+
+// ---------------------------------------------------------------------------------------------------------
+
+VirtQueue::VirtQueue() :
+    m_pDescriptors(nullptr),
+    m_pAvailable(nullptr),
+    m_pUsed(nullptr),
+    m_ioBase(0),
+    m_queueIndex(0),
+    m_queueSize(0),
+    m_lastUsedIndex(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode VirtQueue::Initialize(const uint16_t ioBase, const uint16_t queueIndex)
+{
+    out_word(ioBase + VIRTIO_PCI_QUEUE_SEL, queueIndex);
+
+    const uint16_t queueSize = in_word(ioBase + VIRTIO_PCI_QUEUE_NUM);
+    if (0 == queueSize)
+        return STATUS_CODE_NOT_PRESENT;
+
+    if (queueSize > MAX_QUEUE_SIZE)
+        return STATUS_CODE_FAILURE;
+
+    m_ioBase = ioBase;
+    m_queueIndex = queueIndex;
+    m_queueSize = queueSize;
+    m_lastUsedIndex = 0;
+
+    //! The legacy layout: the descriptor table, the available ring right behind it and the used ring on the next boundary.
+    memset(m_rings, 0, sizeof(m_rings));
+    const size_t availableEnd = (sizeof(vring_desc) * queueSize) + sizeof(vring_avail) + (sizeof(uint16_t) * (queueSize + 1));
+    m_pDescriptors = reinterpret_cast<vring_desc *>(m_rings);
+    m_pAvailable = reinterpret_cast<vring_avail *>(m_rings + (sizeof(vring_desc) * queueSize));
+    m_pUsed = reinterpret_cast<vring_used *>(m_rings + ALIGN_TO_NEXT_BOUNDARY((availableEnd), (VIRTIO_PCI_VRING_ALIGN)));
+
+    //! Completions are polled for.
+    m_pAvailable->flags = VRING_AVAIL_F_NO_INTERRUPT;
+
+    const PhysicalAddress ringsAddress = PhysicalAddress::Create(VirtualAddress(m_rings));
+    out_long(ioBase + VIRTIO_PCI_QUEUE_PFN, ringsAddress.Get() >> VIRTIO_PCI_QUEUE_ADDR_SHIFT);
+
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+uint32_t VirtQueue::Transfer(const Buffer *pBuffers, const size_t nBuffers)
+{
+    ASSERT((0 < nBuffers) && (nBuffers <= m_queueSize));
+
+    for (size_t bufferIndex = 0; bufferIndex < nBuffers; ++bufferIndex)
+    {
+        vring_desc &descriptor = m_pDescriptors[bufferIndex];
+        descriptor.addr = pBuffers[bufferIndex].m_address.Get();
+        descriptor.len = pBuffers[bufferIndex].m_length;
+        descriptor.flags = (pBuffers[bufferIndex].m_isWritable ? VRING_DESC_F_WRITE : 0) |
+                           (((bufferIndex + 1) < nBuffers) ? VRING_DESC_F_NEXT : 0);
+        descriptor.next = bufferIndex + 1;
+    }
+
+    //! The descriptors have to be visible before the chain is published, and the chain before the device is notified.
+    m_pAvailable->ring[m_pAvailable->idx % m_queueSize] = 0;
+    CPU::MemoryBarrier();
+    ++m_pAvailable->idx;
+    CPU::MemoryBarrier();
+
+    out_word(m_ioBase + VIRTIO_PCI_QUEUE_NOTIFY, m_queueIndex);
+
+    while (m_pUsed->idx == m_lastUsedIndex)
+        CPU::Pause();
+
+    CPU::MemoryBarrier();
+    const uint32_t nWrittenBytes = m_pUsed->ring[m_lastUsedIndex % m_queueSize].len;
+    ++m_lastUsedIndex;
+
+    return nWrittenBytes;
+}
+
+} // namespace BartOS
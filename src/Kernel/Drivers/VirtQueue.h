@@ -0,0 +1,187 @@
+#ifndef VIRT_QUEUE_H
+#define VIRT_QUEUE_H
+
+#include "Kernel/BartOS.h"
+
+#include "Kernel/Memory/PhysicalAddress.h"
+
+namespace BartOS
+{
+
+/*  The vendor id of the virtio PCI devices. */
+#define VIRTIO_PCI_VENDOR_ID            0x1AF4
+
+/*  The legacy virtio PCI registers, relative to the I/O BAR. */
+#define VIRTIO_PCI_HOST_FEATURES        0x00
+#define VIRTIO_PCI_GUEST_FEATURES       0x04
+#define VIRTIO_PCI_QUEUE_PFN            0x08
+#define VIRTIO_PCI_QUEUE_NUM            0x0C
+#define VIRTIO_PCI_QUEUE_SEL            0x0E
+#define VIRTIO_PCI_QUEUE_NOTIFY         0x10
+#define VIRTIO_PCI_STATUS               0x12
+#define VIRTIO_PCI_ISR                  0x13
+#define VIRTIO_PCI_CONFIG               0x14
+
+/*  The queue address is passed as a 4 KiB frame number. */
+#define VIRTIO_PCI_QUEUE_ADDR_SHIFT     12
+#define VIRTIO_PCI_VRING_ALIGN          4096
+
+/*  The device status bits. */
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE     (1 << 0)
+#define VIRTIO_CONFIG_S_DRIVER          (1 << 1)
+#define VIRTIO_CONFIG_S_DRIVER_OK       (1 << 2)
+#define VIRTIO_CONFIG_S_FAILED          (1 << 7)
+
+/*  The descriptor flags. */
+#define VRING_DESC_F_NEXT               (1 << 0)
+#define VRING_DESC_F_WRITE              (1 << 1)
+
+/*  The available ring flags. */
+#define VRING_AVAIL_F_NO_INTERRUPT      (1 << 0)
+
+struct [[gnu::packed]] vring_desc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t flags;
+    uint16_t next;
+};
+
+struct [[gnu::packed]] vring_avail
+{
+    uint16_t flags;
+    uint16_t idx;
+    uint16_t ring[];
+};
+
+struct [[gnu::packed]] vring_used_elem
+{
+    uint32_t id;
+    uint32_t len;
+};
+
+struct [[gnu::packed]] vring_used
+{
+    uint16_t flags;
+    uint16_t idx;
+    vring_used_elem ring[];
+};
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+/*
+ *  @brief A split virtqueue of a legacy virtio PCI device.
+ *
+ *  The rings live in the object, which drivers keep in the kernel image, so they are physically contiguous and
+ *  their physical address is known without a mapping. The device interrupts are suppressed, a request is submitted
+ *  and its completion polled for before the next one, so every request starts at descriptor 0.
+ */
+class VirtQueue
+{
+public:
+    static constexpr size_t MAX_QUEUE_SIZE = 256;       ///< The largest queue size the rings have room for.
+
+    /*
+     *  @brief A physically contiguous buffer of a request.
+     */
+    class Buffer
+    {
+    public:
+        //! Constructor
+        Buffer();
+
+        /*
+         *  @brief Constructor
+         *
+         *  @param physicalAddress the physical address of the buffer.
+         *  @param length the length of the buffer in bytes.
+         *  @param isWritable whether the device writes the buffer, otherwise it reads it.
+         */
+        Buffer(const PhysicalAddress &physicalAddress, const uint32_t length, const bool isWritable);
+
+        PhysicalAddress m_address;      ///< The physical address of the buffer.
+        uint32_t        m_length;       ///< The length of the buffer in bytes.
+        bool            m_isWritable;   ///< Whether the device writes the buffer.
+    };
+
+    //! Constructor
+    VirtQueue();
+
+    /*
+     *  @brief Set up a queue of the device.
+     *  The queue size is chosen by a legacy device, it can't be shrunk to fit the rings.
+     *
+     *  @param ioBase the I/O BAR of the device.
+     *  @param queueIndex the index of the queue.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_NOT_PRESENT the device has no such queue.
+     *  @retval STATUS_CODE_FAILURE the queue is larger than MAX_QUEUE_SIZE.
+     */
+    StatusCode Initialize(const uint16_t ioBase, const uint16_t queueIndex);
+
+    /*
+     *  @brief Get the queue size.
+     *
+     *  @return the number of descriptors, 0 if the queue isn't set up.
+     */
+    uint16_t GetSize() const;
+
+    /*
+     *  @brief Submit a request and wait for the device to use it.
+     *
+     *  @param pBuffers the buffers of the request, chained in order.
+     *  @param nBuffers the number of buffers, at most the queue size.
+     *
+     *  @return the number of bytes the device wrote to the writable buffers.
+     */
+    uint32_t Transfer(const Buffer *pBuffers, const size_t nBuffers);
+
+private:
+    //! The size of the rings of the largest queue, the used ring starts on a new page.
+    static constexpr size_t RING_SIZE = ALIGN_TO_NEXT_BOUNDARY(((sizeof(vring_desc) * MAX_QUEUE_SIZE) + sizeof(vring_avail) +
+                                                                (sizeof(uint16_t) * (MAX_QUEUE_SIZE + 1))), (VIRTIO_PCI_VRING_ALIGN)) +
+                                        ALIGN_TO_NEXT_BOUNDARY((sizeof(vring_used) + (sizeof(vring_used_elem) * MAX_QUEUE_SIZE) +
+                                                                sizeof(uint16_t)), (VIRTIO_PCI_VRING_ALIGN));
+
+    alignas(VIRTIO_PCI_VRING_ALIGN) uint8_t m_rings[RING_SIZE];    ///< The descriptor table, the available ring and the used ring.
+    vring_desc          *m_pDescriptors;    ///< The descriptor table.
+    vring_avail         *m_pAvailable;      ///< The available ring.
+    volatile vring_used *m_pUsed;           ///< The used ring.
+    uint16_t            m_ioBase;           ///< The I/O BAR of the device.
+    uint16_t            m_queueIndex;       ///< The index of the queue.
+    uint16_t            m_queueSize;        ///< The number of descriptors.
+    uint16_t            m_lastUsedIndex;    ///< The used ring index of the last completed request.
+};
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline VirtQueue::Buffer::Buffer() :
+    m_address(0),
+    m_length(0),
+    m_isWritable(false)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline VirtQueue::Buffer::Buffer(const PhysicalAddress &physicalAddress, const uint32_t length, const bool isWritable) :
+    m_address(physicalAddress),
+    m_length(length),
+    m_isWritable(isWritable)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint16_t VirtQueue::GetSize() const
+{
+    return m_queueSize;
+}
+
+} // namespace BartOS
+
+#endif // VIRT_QUEUE_H
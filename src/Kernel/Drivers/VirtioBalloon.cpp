@@ -0,0 +1,223 @@
+#include "VirtioBalloon.h"
+
+#include "Kernel/Arch/x86_64/CPU.h"
+#include "Kernel/Memory/Pmm.h"
+#include "Kernel/Memory/VirtualAddress.h"
+#include "Kernel/PCI.h"
+
+namespace BartOS
+{
+
+// ---------------------------------------------------------------------------------------------------------
+
+VirtioBalloon::VirtioBalloon() :
+    m_ioBase(0),
+    m_isReporting(false),
+    m_isDeflateOnOom(false),
+    m_nPages(0),
+    m_nReportedPages(0),
+    m_nextPollTsc(0),
+    m_nextReportTsc(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void VirtioBalloon::Initialize()
+{
+    PCI::Location location;
+    if (!PCI::FindDevice(VIRTIO_PCI_VENDOR_ID, VIRTIO_BALLOON_PCI_DEVICE_ID, location))
+    {
+        kprintf("[BALLOON] No virtio-balloon device\n");
+        return;
+    }
+
+    const uint32_t bar0 = PCI::ReadConfig32(location, PCI_BAR0);
+    if (0 == (bar0 & PCI_BAR_IO))
+    {
+        kprintf("[BALLOON] The virtio-balloon device has no legacy interface\n");
+        return;
+    }
+
+    const uint16_t ioBase = bar0 & PCI_BAR_IO_MASK;
+    PCI::WriteConfig16(location, PCI_COMMAND, PCI::ReadConfig16(location, PCI_COMMAND) | PCI_COMMAND_IO | PCI_COMMAND_BUS_MASTER);
+
+    //! Reset the device and take it over.
+    out_byte(ioBase + VIRTIO_PCI_STATUS, 0);
+    out_byte(ioBase + VIRTIO_PCI_STATUS, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+
+    //! Every offered queue is laid out by the device, so the stats queue is accepted to keep the reporting queue where
+    //! the device expects it. The stats queue itself is never set up.
+    const uint32_t hostFeatures = in_long(ioBase + VIRTIO_PCI_HOST_FEATURES);
+    const uint32_t guestFeatures = hostFeatures & ((1U << VIRTIO_BALLOON_F_MUST_TELL_HOST) | (1U << VIRTIO_BALLOON_F_STATS_VQ) |
+                                                   (1U << VIRTIO_BALLOON_F_DEFLATE_ON_OOM) | (1U << VIRTIO_BALLOON_F_REPORTING));
+    out_long(ioBase + VIRTIO_PCI_GUEST_FEATURES, guestFeatures);
+
+    StatusCode statusCode = m_inflateQueue.Initialize(ioBase, VIRTIO_BALLOON_VQ_INFLATE);
+    if (STATUS_CODE_SUCCESS == statusCode)
+        statusCode = m_deflateQueue.Initialize(ioBase, VIRTIO_BALLOON_VQ_DEFLATE);
+
+    if ((STATUS_CODE_SUCCESS == statusCode) && (guestFeatures & (1U << VIRTIO_BALLOON_F_REPORTING)))
+    {
+        const uint16_t reportingQueueIndex = VIRTIO_BALLOON_VQ_DEFLATE + 1 + ((hostFeatures >> VIRTIO_BALLOON_F_STATS_VQ) & 1) +
+                                             ((hostFeatures >> VIRTIO_BALLOON_F_FREE_PAGE_HINT) & 1);
+        statusCode = m_reportingQueue.Initialize(ioBase, reportingQueueIndex);
+        m_isReporting = (STATUS_CODE_SUCCESS == statusCode);
+    }
+
+    if (STATUS_CODE_SUCCESS != statusCode)
+    {
+        out_byte(ioBase + VIRTIO_PCI_STATUS, VIRTIO_CONFIG_S_FAILED);
+        kprintf("[BALLOON] Failed to set up the virtio-balloon queues, status code=%u - %s\n", statusCode, StatusCodeToString(statusCode));
+        return;
+    }
+
+    out_byte(ioBase + VIRTIO_PCI_STATUS, VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER | VIRTIO_CONFIG_S_DRIVER_OK);
+    m_ioBase = ioBase;
+    WriteConfig(VIRTIO_BALLOON_CONFIG_ACTUAL, 0);
+
+    m_isDeflateOnOom = (0 != (guestFeatures & (1U << VIRTIO_BALLOON_F_DEFLATE_ON_OOM)));
+    if (m_isDeflateOnOom)
+        MM::Pmm::Get().RegisterShrinker(*this);
+
+    kprintf("[BALLOON] virtio-balloon at %u:%u.%u io=%p, free page reporting %s, deflate on OOM %s\n", location.m_bus,
+            location.m_device, location.m_function, ioBase, m_isReporting ? "on" : "off", m_isDeflateOnOom ? "on" : "off");
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void VirtioBalloon::Poll()
+{
+    const uint64_t tsc = CPU::ReadTsc();
+    if ((0 == m_ioBase) || (tsc < m_nextPollTsc))
+        return;
+
+    //! Every register access traps to the host, so the balloon size isn't read on every pass of the idle loop.
+    const size_t nTargetPages = ReadConfig(VIRTIO_BALLOON_CONFIG_NUM_PAGES);
+    if (nTargetPages > m_nPages)
+        Inflate(nTargetPages - m_nPages);
+    else if (nTargetPages < m_nPages)
+        Deflate(m_nPages - nTargetPages);
+    else
+        m_nextPollTsc = tsc + POLL_INTERVAL;
+
+    if (m_isReporting && (tsc >= m_nextReportTsc))
+    {
+        ReportFreePages();
+        m_nextReportTsc = tsc + REPORTING_INTERVAL;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t VirtioBalloon::CountObjects()
+{
+    return m_nPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t VirtioBalloon::ScanObjects(const size_t nObjects)
+{
+    //! The host keeps asking for its target size, the balloon inflates again once the PMM has memory to spare.
+    const size_t nStartPages = m_nPages;
+    while ((0 < m_nPages) && ((nStartPages - m_nPages) < nObjects))
+        Deflate(nObjects - (nStartPages - m_nPages));
+
+    return nStartPages - m_nPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void VirtioBalloon::Inflate(const size_t nPages)
+{
+    //! Reclaim deflates the balloon from the allocation path, the batch buffers are owned with interrupts off.
+    CPU::InterruptDisabler interruptDisabler;
+
+    const size_t nInflated = MM::Pmm::Get().InflateBalloon((nPages < PFNS_PER_REQUEST) ? nPages : PFNS_PER_REQUEST, m_pPages);
+    if (0 == nInflated)
+    {
+        //! Out of memory, try again later.
+        m_nextPollTsc = CPU::ReadTsc() + POLL_INTERVAL;
+        return;
+    }
+
+    SendPfns(m_inflateQueue, nInflated);
+
+    m_nPages += nInflated;
+    WriteConfig(VIRTIO_BALLOON_CONFIG_ACTUAL, m_nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void VirtioBalloon::Deflate(const size_t nPages)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    const size_t nDeflated = MM::Pmm::Get().DeflateBalloon((nPages < PFNS_PER_REQUEST) ? nPages : PFNS_PER_REQUEST, m_pPages);
+
+    //! The host is told before the pages are used again.
+    SendPfns(m_deflateQueue, nDeflated);
+    MM::Pmm::Get().ReturnPages(m_pPages, nDeflated);
+
+    m_nPages -= nDeflated;
+    WriteConfig(VIRTIO_BALLOON_CONFIG_ACTUAL, m_nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void VirtioBalloon::SendPfns(VirtQueue &virtQueue, const size_t nPages)
+{
+    for (size_t pageIndex = 0; pageIndex < nPages; ++pageIndex)
+        m_pfns[pageIndex] = m_pPages[pageIndex]->GetPfn();
+
+    const VirtQueue::Buffer buffer(PhysicalAddress::Create(VirtualAddress(m_pfns)), nPages * sizeof(m_pfns[0]), false);
+    virtQueue.Transfer(&buffer, 1);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void VirtioBalloon::ReportFreePages()
+{
+    MM::Pmm &pmm = MM::Pmm::Get();
+    const size_t nMaxBlocks = (REPORTING_CAPACITY < m_reportingQueue.GetSize()) ? REPORTING_CAPACITY : m_reportingQueue.GetSize();
+
+    //! Reported blocks are skipped by the next round, so this ends once every large free block was reported.
+    size_t nReportedPages = 0;
+    size_t nBlocks = 0;
+    while (0 != (nBlocks = pmm.TakeUnreportedBlocks(REPORTING_ORDER, m_pReportedBlocks, nMaxBlocks)))
+    {
+        for (size_t blockIndex = 0; blockIndex < nBlocks; ++blockIndex)
+        {
+            const MM::PhysicalPage * const pBlock = m_pReportedBlocks[blockIndex];
+            m_reportBuffers[blockIndex] = VirtQueue::Buffer(pBlock->GetAddress(), PAGE_SIZE << pBlock->GetOrder(), true);
+            nReportedPages += (1UL << pBlock->GetOrder());
+        }
+
+        m_reportingQueue.Transfer(m_reportBuffers, nBlocks);
+        pmm.PutBackReportedBlocks(m_pReportedBlocks, nBlocks, true);
+    }
+
+    if (0 != nReportedPages)
+    {
+        m_nReportedPages += nReportedPages;
+        kprintf("[BALLOON] Reported %lu MiB of free memory, %lu MiB in total\n", (nReportedPages * PAGE_SIZE) / MiB,
+                (m_nReportedPages * PAGE_SIZE) / MiB);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+uint32_t VirtioBalloon::ReadConfig(const uint8_t offset) const
+{
+    return in_long(m_ioBase + VIRTIO_PCI_CONFIG + offset);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void VirtioBalloon::WriteConfig(const uint8_t offset, const uint32_t value)
+{
+    out_long(m_ioBase + VIRTIO_PCI_CONFIG + offset, value);
+}
+
+} // namespace BartOS
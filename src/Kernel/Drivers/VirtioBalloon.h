@@ -0,0 +1,147 @@
+#ifndef VIRTIO_BALLOON_H
+#define VIRTIO_BALLOON_H
+
+#include "Kernel/BartOS.h"
+#include "Libraries/Misc/Singleton.h"
+
+#include "Kernel/Memory/PhysicalPage.h"
+#include "Kernel/Memory/Shrinker.h"
+
+#include "VirtQueue.h"
+
+namespace BartOS
+{
+
+/*  The device id of the transitional virtio-balloon PCI device. */
+#define VIRTIO_BALLOON_PCI_DEVICE_ID        0x1002
+
+/*  The virtio-balloon feature bits. */
+#define VIRTIO_BALLOON_F_MUST_TELL_HOST     0
+#define VIRTIO_BALLOON_F_STATS_VQ           1
+#define VIRTIO_BALLOON_F_DEFLATE_ON_OOM     2
+#define VIRTIO_BALLOON_F_FREE_PAGE_HINT     3
+#define VIRTIO_BALLOON_F_PAGE_POISON        4
+#define VIRTIO_BALLOON_F_REPORTING          5
+
+/*  The virtio-balloon config registers, relative to VIRTIO_PCI_CONFIG. */
+#define VIRTIO_BALLOON_CONFIG_NUM_PAGES     0x0
+#define VIRTIO_BALLOON_CONFIG_ACTUAL        0x4
+
+/*  The virtio-balloon queues. */
+#define VIRTIO_BALLOON_VQ_INFLATE           0
+#define VIRTIO_BALLOON_VQ_DEFLATE           1
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+/*
+ *  @brief The virtio-balloon driver singleton.
+ *
+ *  The host sets the number of 4 KiB pages it wants the balloon to hold. The balloon inflates by allocating pages
+ *  from the PMM and handing their frame numbers to the host, and deflates by taking the frame numbers back before
+ *  the pages are returned to the PMM. With free page reporting the large free blocks of the PMM are handed to the
+ *  host as well, which discards them until the guest touches them again.
+ *
+ *  With deflate on OOM the balloon is a shrinker, reclaim deflates it when the guest runs short of memory. The PMM
+ *  only inflates it again from memory above the high watermarks.
+ *
+ *  The driver polls the device from the idle loop, the legacy virtio PCI interface is used.
+ */
+class VirtioBalloon : public Singleton<VirtioBalloon>, public MM::Shrinker
+{
+public:
+    //! Find and set up the balloon device, the driver stays idle without one.
+    void Initialize();
+
+    //! Follow the balloon size set by the host and report free memory, called from the idle loop.
+    void Poll();
+
+    /*
+     *  @brief Count the pages reclaim may take back from the balloon.
+     *
+     *  @return the number of pages in the balloon.
+     */
+    virtual size_t CountObjects() override;
+
+    /*
+     *  @brief Deflate the balloon for reclaim.
+     *
+     *  @param nObjects the number of pages.
+     *
+     *  @return the number of pages given back.
+     */
+    virtual size_t ScanObjects(const size_t nObjects) override;
+
+private:
+    static constexpr size_t PFNS_PER_REQUEST = 256;             ///< The number of pages inflated or deflated per request.
+    static constexpr size_t REPORTING_ORDER = 9;                ///< The smallest buddy order reported, 2 MiB.
+    static constexpr size_t REPORTING_CAPACITY = 32;            ///< The maximum number of blocks per report.
+    static constexpr uint64_t POLL_INTERVAL = (1UL << 28);      ///< The TSC cycles between two reads of the balloon size.
+    static constexpr uint64_t REPORTING_INTERVAL = (1UL << 32); ///< The TSC cycles between two free page reports.
+
+    //! Constructor
+    VirtioBalloon();
+
+    /*
+     *  @brief Inflate the balloon by a batch of pages.
+     *
+     *  @param nPages the amount of pages wanted.
+     */
+    void Inflate(const size_t nPages);
+
+    /*
+     *  @brief Deflate the balloon by a batch of pages.
+     *
+     *  @param nPages the amount of pages wanted.
+     */
+    void Deflate(const size_t nPages);
+
+    /*
+     *  @brief Send the frame numbers of the batch of pages to a queue.
+     *
+     *  @param virtQueue the inflate or deflate queue.
+     *  @param nPages the amount of pages.
+     */
+    void SendPfns(VirtQueue &virtQueue, const size_t nPages);
+
+    //! Report the free blocks which weren't reported yet to the host.
+    void ReportFreePages();
+
+    /*
+     *  @brief Read a config register of the device.
+     *
+     *  @param offset the register offset.
+     *
+     *  @return the register value.
+     */
+    uint32_t ReadConfig(const uint8_t offset) const;
+
+    /*
+     *  @brief Write a config register of the device.
+     *
+     *  @param offset the register offset.
+     *  @param value the value.
+     */
+    void WriteConfig(const uint8_t offset, const uint32_t value);
+
+    VirtQueue               m_inflateQueue;                             ///< The queue of the inflated pages.
+    VirtQueue               m_deflateQueue;                             ///< The queue of the deflated pages.
+    VirtQueue               m_reportingQueue;                           ///< The queue of the reported free blocks.
+    uint32_t                m_pfns[PFNS_PER_REQUEST];                   ///< The frame numbers of the batch of pages.
+    const MM::PhysicalPage  *m_pPages[PFNS_PER_REQUEST];                ///< The batch of pages.
+    const MM::PhysicalPage  *m_pReportedBlocks[REPORTING_CAPACITY];     ///< The head pages of the reported free blocks.
+    VirtQueue::Buffer       m_reportBuffers[REPORTING_CAPACITY];        ///< The buffers of the reported free blocks.
+    uint16_t                m_ioBase;                                   ///< The I/O BAR of the device, 0 without a device.
+    bool                    m_isReporting;                              ///< Whether free page reporting was negotiated.
+    bool                    m_isDeflateOnOom;                           ///< Whether the balloon may deflate under memory pressure.
+    size_t                  m_nPages;                                   ///< The number of pages in the balloon.
+    size_t                  m_nReportedPages;                           ///< The number of free pages reported so far.
+    uint64_t                m_nextPollTsc;                              ///< The TSC of the next read of the balloon size.
+    uint64_t                m_nextReportTsc;                            ///< The TSC of the next free page report.
+
+    friend class Singleton<VirtioBalloon>;
+};
+
+} // namespace BartOS
+
+#endif // VIRTIO_BALLOON_H
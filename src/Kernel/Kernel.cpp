@@ -3,8 +3,11 @@
 
 #include "Kernel/Arch/x86_64/GDT.h"
 #include "Kernel/Arch/x86_64/CPU.h"
+#include "Kernel/Memory/NumaTopology.h"
 #include "Kernel/Memory/Pmm.h"
 #include "Kernel/Memory/Vmm.h"
+#include "Kernel/Memory/MemoryBenchmark.h"
+#include "Kernel/Drivers/VirtioBalloon.h"
 
 #include "Multiboot2.h"
 
@@ -53,6 +56,8 @@ const BartOS::MyMultiboot2Header g_myMultiboot2Header __attribute__ ((section ("
 extern "C" [[noreturn]] void kernel_main(uint32_t magic, const boot_info *pBootInfo)
 {
     using namespace BartOS;
+    const uint64_t entryTsc = x86_64::CPU::ReadTsc();
+
     if (MULTIBOOT2_BOOTLOADER_MAGIC != magic)
     {
         kprintf("Multiboot2 header doesn't match the magic number. %x != %x", MULTIBOOT2_BOOTLOADER_MAGIC, magic);
@@ -73,6 +78,9 @@ extern "C" [[noreturn]] void kernel_main(uint32_t magic, const boot_info *pBootI
     // Init kmalloc eternal.
     init_kmalloc_eternal();
 
+    //! The memory regions are assigned to nodes as the PMM adds them.
+    MM::NumaTopology::Get().Initialize();
+
     StatusCode statusCode = MM::Pmm::Get().Initialize(GetMultiboot2Tag<multiboot_tag_mmap>(MULTIBOOT_TAG_TYPE_MMAP));
     if (STATUS_CODE_SUCCESS != statusCode)
     {
@@ -82,9 +90,38 @@ extern "C" [[noreturn]] void kernel_main(uint32_t magic, const boot_info *pBootI
 
     MM::Vmm::Get().Initialize();
 
+    //! Nothing reads the boot info, the ACPI tables or the kmalloc eternal arena from here on.
+    MM::Pmm::Get().ReclaimBootMemory();
+
+    VirtioBalloon::Get().Initialize();
+
+#ifdef MEMORY_BENCHMARK
+    MM::MemoryBenchmark::Run();
+#endif
+
+    //! Interrupt handlers may allocate as soon as interrupts are enabled, the reserves can't wait for the idle loop.
+    const size_t nAtomicPages = MM::Pmm::Get().RefillAtomicReserves();
+    kprintf("[PMM] Atomic reserves: %lu KiB\n", (nAtomicPages * PAGE_SIZE) / KiB);
+
     x86_64::CPU::Sti();
+    kprintf("[KERNEL] Interrupts enabled %lu TSC cycles after kernel entry\n", x86_64::CPU::ReadTsc() - entryTsc);
+
+    //! Finish the deferred memmap initialization while idle.
+    while (MM::Pmm::Get().InitializeDeferredMemmap());
+    kprintf("[PMM] Memmap initialized %lu TSC cycles after kernel entry\n", x86_64::CPU::ReadTsc() - entryTsc);
 
-    while (true);
+    //! Reclaim below the low watermarks, keep the pre-zeroed page pools and the atomic reserves topped up, compact memory
+    //! after contiguous allocation failures, merge identical pages and follow the balloon while idle.
+    while (true)
+    {
+        MM::Pmm::Get().ReclaimBackground();
+        MM::Pmm::Get().RefillZeroedPages();
+        MM::Pmm::Get().RefillAtomicReserves();
+        MM::Vmm::Get().GetKernelHeap().RefillAtomicReserves();
+        MM::Pmm::Get().CompactMemoryBackground();
+        MM::Pmm::Get().MergePagesBackground();
+        VirtioBalloon::Get().Poll();
+    }
 }
 
 } // namespace BartOS
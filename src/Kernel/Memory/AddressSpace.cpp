@@ -10,7 +10,9 @@ namespace MM
 {
 
 AddressSpace::AddressSpace() :
-    m_pPageTable(nullptr)
+    m_pPageTable(nullptr),
+    m_pcidGeneration(0),
+    m_pcid(0)
 {
 }
 
@@ -18,7 +20,9 @@ AddressSpace::AddressSpace() :
 
 AddressSpace::AddressSpace(MM::PageTable * const pPageTable) :
     m_pPageTable(pPageTable),
-    m_addressBreak(0)
+    m_addressBreak(0),
+    m_pcidGeneration(0),
+    m_pcid(0)
 {
 }
 
@@ -63,9 +63,12 @@ protected:
 
     MM::PageTable   *m_pPageTable;       ///< Pointer to the P4 Page Table object.
     Address_t       m_addressBreak;     ///< Where does the address break.
+    uint64_t        m_pcidGeneration;   ///< The PCID generation the PCID was assigned in, 0 if the address space has none.
+    uint16_t        m_pcid;             ///< The PCID tagging the TLB entries of the address space, only valid in its generation.
 
     friend class VMArea;
     friend class MM::Vmm;
+    friend class TlbGather;
 };
 
 // ---------------------------------------------------------------------------------------------------------
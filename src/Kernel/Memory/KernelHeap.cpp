@@ -23,30 +23,33 @@ void KernelHeap::Initialize()
     m_slab1024.Initialize(2 * KiB, kmalloc_eternal_tag());
     m_slab2048.Initialize(1 * KiB, kmalloc_eternal_tag());
     m_slab4096.Initialize(16 * KiB, kmalloc_eternal_tag());
+
+    //! Interrupt handlers may allocate as soon as interrupts are enabled, the reserves can't wait for the idle loop.
+    RefillAtomicReserves();
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
-void *KernelHeap::Allocate(const size_t nBytes)
+void *KernelHeap::Allocate(const size_t nBytes, const AllocationFlags allocationFlags)
 {
     if (nBytes <= m_slab16.m_slabSize)
-        return m_slab16.Allocate();
+        return m_slab16.Allocate(allocationFlags);
     else if (nBytes <= m_slab32.m_slabSize)
-        return m_slab32.Allocate();
+        return m_slab32.Allocate(allocationFlags);
     else if (nBytes <= m_slab64.m_slabSize)
-        return m_slab64.Allocate();
+        return m_slab64.Allocate(allocationFlags);
     else if (nBytes <= m_slab128.m_slabSize)
-        return m_slab128.Allocate();
+        return m_slab128.Allocate(allocationFlags);
     else if (nBytes <= m_slab256.m_slabSize)
-        return m_slab256.Allocate();
+        return m_slab256.Allocate(allocationFlags);
     else if (nBytes <= m_slab512.m_slabSize)
-        return m_slab512.Allocate();
+        return m_slab512.Allocate(allocationFlags);
     else if (nBytes <= m_slab1024.m_slabSize)
-        return m_slab1024.Allocate();
+        return m_slab1024.Allocate(allocationFlags);
     else if (nBytes <= m_slab2048.m_slabSize)
-        return m_slab2048.Allocate();
+        return m_slab2048.Allocate(allocationFlags);
     else if (nBytes <= m_slab4096.m_slabSize)
-        return m_slab4096.Allocate();
+        return m_slab4096.Allocate(allocationFlags);
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -74,6 +77,21 @@ void KernelHeap::Free(void *pBuffer)
 
 }
 
+// ---------------------------------------------------------------------------------------------------------
+
+void KernelHeap::RefillAtomicReserves()
+{
+    m_slab16.RefillAtomicReserve();
+    m_slab32.RefillAtomicReserve();
+    m_slab64.RefillAtomicReserve();
+    m_slab128.RefillAtomicReserve();
+    m_slab256.RefillAtomicReserve();
+    m_slab512.RefillAtomicReserve();
+    m_slab1024.RefillAtomicReserve();
+    m_slab2048.RefillAtomicReserve();
+    m_slab4096.RefillAtomicReserve();
+}
+
 } // namespace MM
 
 } // namespace BartOS
\ No newline at end of file
@@ -27,10 +27,11 @@ public:
      *  @brief Allocate a buffer.
      * 
      *  @param nBytes the amount of bytes to allocate.
+     *  @param allocationFlags the allocation flags, ALLOC_ATOMIC allows taking from the atomic reserves.
      * 
      *  @return pointer to the allocated buffer.
      */
-    void *Allocate(const size_t nBytes);
+    void *Allocate(const size_t nBytes, const AllocationFlags allocationFlags = ALLOC_NO_FLAGS);
 
     /*
      *  @brief Free a buffer.
@@ -39,6 +40,9 @@ public:
      */
     void Free(void *pBuffer);
 
+    //! Top up the atomic reserves of the slab allocators, called from the idle loop.
+    void RefillAtomicReserves();
+
 private:
     SlabAllocator<16>       m_slab16;           ///< The 16 byte slab allocator.
     SlabAllocator<32>       m_slab32;           ///< The 32 byte slab allocator.
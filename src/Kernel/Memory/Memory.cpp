@@ -45,12 +45,13 @@ void *kmalloc_eternal(const size_t size)
     pEternalMallocPointer += size;
     pEternalMallocPointer = reinterpret_cast<uint8_t *>(ALIGN_TO_NEXT_BOUNDARY((Address_t)pEternalMallocPointer, ALIGNMENT_BYTES));
 
-    //! Make sure every page for the allocation is mapped.
-    for (uint8_t *pAllocation = pAlloc; pAllocation < (pAlloc + size); pAllocation += PAGE_2M)
+    //! Make sure every page for the allocation is mapped, starting from the page containing the first byte.
+    uint8_t * const pFirstPage = reinterpret_cast<uint8_t *>(ALIGN(reinterpret_cast<Address_t>(pAlloc), PAGE_SIZE_2M));
+    for (uint8_t *pAllocation = pFirstPage; pAllocation < (pAlloc + size); pAllocation += PAGE_2M)
     {
         uint8_t *pMappingMemory = pAllocation;
         //! HACK: Overflow guard.
-        if (pAllocation < pAlloc)
+        if (pAllocation < pFirstPage)
             break;
 
         MM::Vmm::Get().EnsureKernelMapped(PhysicalAddress::Create(VirtualAddress(pMappingMemory)).PageAddress(PAGE_2M),
@@ -142,6 +143,13 @@ void *kmalloc(size_t size)
 
 // ---------------------------------------------------------------------------------------------------------
 
+void *kmalloc_atomic(size_t size)
+{
+    return BartOS::MM::Vmm::Get().GetKernelHeap().Allocate(size, BartOS::ALLOC_ATOMIC);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 void kfree(void *ptr)
 {
     return BartOS::MM::Vmm::Get().GetKernelHeap().Free(ptr);
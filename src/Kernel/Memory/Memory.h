@@ -46,6 +46,19 @@ enum PageFlags : uint16_t
     SWAPPED_OUT         = 1 << 9
 };
 
+//! The physical page allocation flags.
+enum AllocationFlags : uint16_t
+{
+    ALLOC_NO_FLAGS      = 0 << 0,
+    ALLOC_COLD          = 1 << 0,   ///< The page is about to be overwritten, prefer a page which isn't cache hot.
+    ALLOC_DMA           = 1 << 1,   ///< The memory must be below 16 MiB, for ISA DMA.
+    ALLOC_DMA32         = 1 << 2,   ///< The memory must be below 4 GiB, for 32-bit DMA.
+    ALLOC_ZEROED        = 1 << 3,   ///< The memory must be zeroed, served from the pre-zeroed pages when possible.
+    ALLOC_COLORED       = 1 << 4,   ///< Consecutive pages get consecutive cache colors, so they spread over the cache sets.
+    ALLOC_MOVABLE       = 1 << 5,   ///< The page is mapped movable, it may be lent from the CMA region.
+    ALLOC_ATOMIC        = 1 << 6    ///< The caller can't reclaim or wait, e.g. an interrupt handler. May dip into the atomic reserve.
+};
+
 //! The page table levels.
 enum PageTableLevel
 {
@@ -64,6 +77,8 @@ extern "C" Address_t __kernel_virtual_end[];
 extern "C" Address_t __kernel_physical_end[];
 
 #define TEMP_MAP_ADDR 0xFFFFFFFFFFE00000
+#define DIRECT_MAP_ADDR 0xFFFF800000000000      ///< The start of the direct map of physical memory, the bottom of the higher half.
+#define MAX_DIRECT_MAP_SIZE (64UL * 1024 * GiB) ///< The direct map spans physical memory up to 64 TiB.
 
 // ---------------------------------------------------------------------------------------------------------
 // ---------------------------------------------------------------------------------------------------------
@@ -195,6 +210,7 @@ void operator delete[](void *ptr);
 void operator delete(void *ptr, size_t size);
 
 void *kmalloc(size_t size);
+void *kmalloc_atomic(size_t size);
 void kfree(void *ptr);
 
 #endif // MEMORY_H
\ No newline at end of file
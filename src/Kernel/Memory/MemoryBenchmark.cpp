@@ -0,0 +1,215 @@
+#include "MemoryBenchmark.h"
+
+#include "Kernel/Arch/x86_64/CPU.h"
+
+#include "Pmm.h"
+#include "Vmm.h"
+
+namespace BartOS
+{
+
+namespace MM
+{
+
+namespace
+{
+
+const size_t BENCHMARK_ORDERS[] = { 0, 2, 4, 6, 9 };   ///< The buddy orders benchmarked.
+const size_t BENCHMARK_ITERATIONS = 32;                 ///< The number of ranges allocated per run.
+const size_t BENCHMARK_BATCH_SIZES[] = { 8, 64, 512, 2048 };    ///< The page batch sizes benchmarked.
+const size_t MAX_BENCHMARK_BATCH_SIZE = 2048;                   ///< The largest page batch size.
+const size_t BENCHMARK_WALKS = 65536;                           ///< The number of page table walks per run.
+
+const PhysicalPage *g_pBenchmarkPages[MAX_BENCHMARK_BATCH_SIZE];    ///< The pages allocated by the batch benchmark.
+size_t g_nColorPages[MemoryPool::MAX_PAGE_COLORS];                  ///< The pages per color of the coloring benchmark.
+
+} // namespace
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryBenchmark::Run()
+{
+    kprintf("[BENCHMARK] Running memory benchmarks, results in TSC cycles.\n");
+
+    //! Don't let the deferred memmap initialization skew the results.
+    while (Pmm::Get().InitializeDeferredMemmap());
+
+    BenchmarkContiguousAllocation();
+    BenchmarkBatchAllocation();
+    BenchmarkPageColoring();
+    BenchmarkPageWalks();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryBenchmark::BenchmarkContiguousAllocation()
+{
+    MemoryPool &memoryPool = Pmm::Get().m_memoryPool;
+    MemoryPool::PhysicalRange physicalRanges[BENCHMARK_ITERATIONS];
+
+    for (const size_t order : BENCHMARK_ORDERS)
+    {
+        const size_t nPages = (1UL << order);
+
+        //! Buddy allocator.
+        uint64_t start = CPU::ReadTsc();
+        for (MemoryPool::PhysicalRange &physicalRange : physicalRanges)
+            physicalRange = memoryPool.AllocateRange(nPages, ALLOC_NO_FLAGS);
+        const uint64_t buddyAllocCycles = CPU::ReadTsc() - start;
+
+        start = CPU::ReadTsc();
+        for (MemoryPool::PhysicalRange &physicalRange : physicalRanges)
+            physicalRange.ReturnToPool();
+        const uint64_t buddyFreeCycles = CPU::ReadTsc() - start;
+
+        //! Linear scan.
+        start = CPU::ReadTsc();
+        for (MemoryPool::PhysicalRange &physicalRange : physicalRanges)
+            physicalRange = memoryPool.AllocateRangeScan(nPages, MemoryPool::ZONE_NORMAL);
+        const uint64_t scanAllocCycles = CPU::ReadTsc() - start;
+
+        start = CPU::ReadTsc();
+        for (MemoryPool::PhysicalRange &physicalRange : physicalRanges)
+            physicalRange.ReturnToPool();
+        const uint64_t scanFreeCycles = CPU::ReadTsc() - start;
+
+        kprintf("[BENCHMARK] order=%lu buddy alloc=%lu free=%lu, scan alloc=%lu free=%lu (per range)\n", order,
+                buddyAllocCycles / BENCHMARK_ITERATIONS, buddyFreeCycles / BENCHMARK_ITERATIONS,
+                scanAllocCycles / BENCHMARK_ITERATIONS, scanFreeCycles / BENCHMARK_ITERATIONS);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryBenchmark::BenchmarkBatchAllocation()
+{
+    Pmm &pmm = Pmm::Get();
+
+    for (const size_t nPages : BENCHMARK_BATCH_SIZES)
+    {
+        //! Single page calls.
+        uint64_t start = CPU::ReadTsc();
+        for (const PhysicalPage *&pPhysicalPage : Range(g_pBenchmarkPages, nPages))
+            pPhysicalPage = pmm.AllocatePage();
+        const uint64_t singleAllocCycles = CPU::ReadTsc() - start;
+
+        start = CPU::ReadTsc();
+        for (const PhysicalPage *pPhysicalPage : Range(g_pBenchmarkPages, nPages))
+            pmm.ReturnPage(pPhysicalPage);
+        const uint64_t singleFreeCycles = CPU::ReadTsc() - start;
+
+        //! Batched calls.
+        start = CPU::ReadTsc();
+        const size_t nAllocated = pmm.AllocatePages(nPages, g_pBenchmarkPages);
+        const uint64_t batchAllocCycles = CPU::ReadTsc() - start;
+
+        start = CPU::ReadTsc();
+        pmm.ReturnPages(g_pBenchmarkPages, nAllocated);
+        const uint64_t batchFreeCycles = CPU::ReadTsc() - start;
+
+        kprintf("[BENCHMARK] batch=%lu single alloc=%lu free=%lu, batched alloc=%lu free=%lu (per page)\n", nPages,
+                singleAllocCycles / nPages, singleFreeCycles / nPages, batchAllocCycles / nPages, batchFreeCycles / nPages);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryBenchmark::BenchmarkPageColoring()
+{
+    Pmm &pmm = Pmm::Get();
+    const MemoryPool &memoryPool = pmm.m_memoryPool;
+    const size_t nColors = memoryPool.m_nPageColors;
+    if (1 == nColors)
+    {
+        kprintf("[BENCHMARK] Page coloring disabled, no cache parameters\n");
+        return;
+    }
+
+    //! A buffer twice the size of a cache way, every color should hold 2 of its pages.
+    const size_t nPages = 2 * nColors;
+    const AllocationFlags allocationFlags[] = { ALLOC_NO_FLAGS, ALLOC_COLORED };
+
+    for (const AllocationFlags allocationFlag : allocationFlags)
+    {
+        //! Fragment the free lists first, the way a long running system would.
+        const size_t nScattered = pmm.AllocatePages(nPages, g_pBenchmarkPages);
+        for (size_t pageIndex = 0; pageIndex < nScattered; pageIndex += 2)
+            pmm.ReturnPage(g_pBenchmarkPages[pageIndex]);
+
+        for (size_t pageIndex = 1; pageIndex < nScattered; pageIndex += 2)
+            g_pBenchmarkPages[pageIndex / 2] = g_pBenchmarkPages[pageIndex];
+
+        const size_t nKept = nScattered / 2;
+        const PhysicalPage **ppPages = g_pBenchmarkPages + nKept;
+
+        const uint64_t start = CPU::ReadTsc();
+        const size_t nAllocated = pmm.AllocatePages(nPages, ppPages, allocationFlag);
+        const uint64_t allocCycles = CPU::ReadTsc() - start;
+
+        for (size_t &nColorPages : g_nColorPages)
+            nColorPages = 0;
+
+        for (const PhysicalPage *pPhysicalPage : Range(ppPages, nAllocated))
+            ++g_nColorPages[memoryPool.PageToPfn(pPhysicalPage) & (nColors - 1)];
+
+        //! Variance in 1/100 pages squared, kprintf has no floating point.
+        size_t maxColorPages = 0;
+        size_t squaredDeviations = 0;
+        for (const size_t nColorPages : Range(g_nColorPages, nColors))
+        {
+            const int64_t deviation = (static_cast<int64_t>(nColorPages * nColors) - static_cast<int64_t>(nAllocated));
+            squaredDeviations += static_cast<size_t>(deviation * deviation);
+            if (nColorPages > maxColorPages)
+                maxColorPages = nColorPages;
+        }
+
+        kprintf("[BENCHMARK] %s pages=%lu colors=%lu variance=%lu/100 max per color=%lu alloc=%lu (per page)\n",
+                (ALLOC_COLORED == allocationFlag) ? "colored" : "uncolored", nAllocated, nColors,
+                (100 * squaredDeviations) / (nColors * nColors * nColors), maxColorPages, nAllocated ? (allocCycles / nAllocated) : 0);
+
+        pmm.ReturnPages(ppPages, nAllocated);
+        pmm.ReturnPages(g_pBenchmarkPages, nKept);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryBenchmark::BenchmarkPageWalks()
+{
+    Vmm &vmm = Vmm::Get();
+    const bool isDirectMapped = Vmm::m_isDirectMapped;
+    if (!isDirectMapped)
+    {
+        kprintf("[BENCHMARK] Page walks skipped, no direct map\n");
+        return;
+    }
+
+    //! Walk the pages of the kernel image, the temporary mapping is shared.
+    CPU::InterruptDisabler interruptDisabler;
+
+    const Address_t kernelStart = reinterpret_cast<Address_t>(__kernel_virtual_start);
+    const size_t nKernelPages = (reinterpret_cast<Address_t>(__kernel_virtual_end) - kernelStart) / PAGE_SIZE;
+    const bool isDirectMappedModes[] = { false, true };
+
+    for (const bool isDirectMappedMode : isDirectMappedModes)
+    {
+        Vmm::m_isDirectMapped = isDirectMappedMode;
+
+        size_t nMapped = 0;
+        const uint64_t start = CPU::ReadTsc();
+        for (size_t walk = 0; walk < BENCHMARK_WALKS; ++walk)
+            nMapped += vmm.IsKernelAddressMapped(VirtualAddress(kernelStart + ((walk % nKernelPages) * PAGE_SIZE))) ? 1 : 0;
+        const uint64_t walkCycles = CPU::ReadTsc() - start;
+
+        //! Walks per second are the walks per million cycles times the TSC frequency in MHz.
+        kprintf("[BENCHMARK] %s walks=%lu mapped=%lu cycles=%lu (per walk), walks=%lu (per million cycles)\n",
+                isDirectMappedMode ? "direct map" : "temporary mapping", BENCHMARK_WALKS, nMapped, walkCycles / BENCHMARK_WALKS,
+                walkCycles ? ((BENCHMARK_WALKS * 1000000) / walkCycles) : 0);
+    }
+
+    Vmm::m_isDirectMapped = isDirectMapped;
+}
+
+} // namespace MM
+
+} // namespace BartOS
@@ -0,0 +1,46 @@
+#ifndef MEMORY_BENCHMARK_H
+#define MEMORY_BENCHMARK_H
+
+#include "Kernel/BartOS.h"
+
+namespace BartOS
+{
+
+namespace MM
+{
+
+/*
+ *  @brief Boot time self-benchmarks of the memory managers.
+ *  Run from kernel_main when built with MEMORY_BENCHMARK defined (make DIRECTIVES=-DMEMORY_BENCHMARK).
+ */
+class MemoryBenchmark
+{
+public:
+    //! Run all the memory benchmarks.
+    static void Run();
+
+private:
+    //! Compare the buddy allocator against the linear pool scan for contiguous allocations of several orders.
+    static void BenchmarkContiguousAllocation();
+
+    //! Compare batched page allocation and free against a loop of single page calls for several batch sizes.
+    static void BenchmarkBatchAllocation();
+
+    /*
+     *  @brief Compare the spread of a buffer over the cache colors with and without colored allocation.
+     *  The variance is of the number of pages per color, 0 when the buffer covers every color evenly.
+     */
+    static void BenchmarkPageColoring();
+
+    /*
+     *  @brief Compare page table walks through the temporary mapping against walks through the direct map.
+     *  Every level of a walk through the temporary mapping rewrites a slot of it and invalidates the TLB entry.
+     */
+    static void BenchmarkPageWalks();
+};
+
+} // namespace MM
+
+} // namespace BartOS
+
+#endif // MEMORY_BENCHMARK_H
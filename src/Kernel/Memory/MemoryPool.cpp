@@ -13,121 +13,2153 @@ namespace BartOS
 namespace MM
 {
 
+//! The order and the region index are packed into the page flags.
+static_assert(MemoryPool::MAX_ORDER <= (1 << 4), "The buddy order does not fit the page flags");
+static_assert(MemoryPool::MAX_MEMORY_REGIONS <= (1 << 5), "The memory region index does not fit the page flags");
+
+//! Regions are split at the node boundaries, every node range may add a region.
+static_assert(NumaTopology::MAX_MEMORY_RANGES <= MemoryPool::MAX_MEMORY_REGIONS, "The node ranges may not fit the memory regions");
+
+//! Buddy blocks never span zones, so a block and its buddy are always on the free lists of the same zone.
+static_assert(0 == (MemoryPool::ZONE_DMA_END_PFN % (1UL << (MemoryPool::MAX_ORDER - 1))), "ZONE_DMA must end on a block boundary");
+static_assert(0 == (MemoryPool::ZONE_DMA32_END_PFN % (1UL << (MemoryPool::MAX_ORDER - 1))), "ZONE_DMA32 must end on a block boundary");
+
+// ---------------------------------------------------------------------------------------------------------
+
 MemoryPool::MemoryPool() :
     m_pPool(nullptr),
-    m_poolSize(0)
+    m_poolSize(0),
+    m_nPages(0),
+    m_pSectionMemmaps(nullptr),
+    m_pMemmapSections(nullptr),
+    m_nSections(0),
+    m_nPresentSections(0),
+    m_pInitializedMemmaps(nullptr),
+    m_nInitializedSections(0),
+    m_nNodes(1),
+    m_nPageColors(1),
+    m_compactionOrder(MAX_ORDER),
+    m_isReclaimPending(false),
+    m_pMergeCandidates(),
+    m_mergeBatch(0),
+    m_mergeScanIndex(0),
+    m_mergeScanSavedPages(0),
+    m_nextMergeTsc(0),
+    m_cmaStartPfn(0),
+    m_cmaEndPfn(0),
+    m_nMemoryRegions(0)
+{
+    for (size_t &nextPageColor : m_nextPageColors)
+        nextPageColor = 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::AddMemoryRegion(const MemoryRegion &memoryRegion)
+{
+    //! Only whole pages are usable.
+    Address_t startAddress = ALIGN_TO_NEXT_BOUNDARY(memoryRegion.m_addr.Get(), PAGE_SIZE);
+    const Address_t endAddress = ALIGN((memoryRegion.m_addr.Get() + memoryRegion.m_size), (PAGE_SIZE));
+
+    //! Split the region at the node boundaries so that every region is on a single node.
+    while (startAddress < endAddress)
+    {
+        ASSERT(m_nMemoryRegions < MAX_MEMORY_REGIONS);
+
+        Address_t nodeEndAddress = 0;
+        const uint8_t node = NumaTopology::Get().GetMemoryNode(PhysicalAddress(startAddress), nodeEndAddress);
+        const Address_t regionEndAddress = (nodeEndAddress < endAddress) ? ALIGN_TO_NEXT_BOUNDARY((nodeEndAddress), (PAGE_SIZE)) : endAddress;
+
+        MemoryRegion &region = m_memoryRegions[m_nMemoryRegions++];
+        region = memoryRegion;
+        region.m_addr = PhysicalAddress(startAddress);
+        region.m_size = regionEndAddress - startAddress;
+        region.m_pPages = nullptr;
+        region.m_nPages = region.m_size / PAGE_SIZE;
+        region.m_node = node;
+
+        startAddress += region.m_size;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::Initialize()
+{
+    //! Size the section table to span the highest usable page.
+    size_t endPfn = 0;
+    for (const MemoryRegion &region : Range(m_memoryRegions, m_nMemoryRegions))
+    {
+        const size_t regionEndPfn = (region.m_addr.Get() + region.m_size) / PAGE_SIZE;
+        if (regionEndPfn > endPfn)
+            endPfn = regionEndPfn;
+    }
+
+    m_nNodes = NumaTopology::Get().GetNodeCount();
+
+    //! The colors are the pages of a way of the last level cache, rounded down to a power of 2.
+    const size_t nWayPages = CPU::GetCacheWaySize() / PAGE_SIZE;
+    while (((m_nPageColors << 1) <= nWayPages) && ((m_nPageColors << 1) <= MAX_PAGE_COLORS))
+        m_nPageColors <<= 1;
+    m_nSections = ALIGN_TO_NEXT_BOUNDARY(endPfn, PAGES_PER_SECTION) >> SECTION_SHIFT;
+    m_pSectionMemmaps = static_cast<PhysicalPage **>(kmalloc_eternal(m_nSections * sizeof(PhysicalPage *)));
+    m_pMemmapSections = static_cast<uint32_t *>(kmalloc_eternal(m_nSections * sizeof(uint32_t)));
+    m_pInitializedMemmaps = static_cast<bool *>(kmalloc_eternal(m_nSections * sizeof(bool)));
+
+    for (size_t section = 0; section < m_nSections; ++section)
+    {
+        m_pSectionMemmaps[section] = nullptr;
+        m_pInitializedMemmaps[section] = false;
+        if (IsSectionPresent(section, MAX_NODES))
+            m_pMemmapSections[m_nPresentSections++] = section;
+    }
+
+    //! The memmap is allocated last so that the pool is the end of the kernel image.
+    m_poolSize = m_nPresentSections * PAGES_PER_SECTION;
+    m_pPool = static_cast<PhysicalPage *>(kmalloc_eternal(m_poolSize * sizeof(PhysicalPage)));
+
+    for (size_t memmapBlock = 0; memmapBlock < m_nPresentSections; ++memmapBlock)
+        m_pSectionMemmaps[m_pMemmapSections[memmapBlock]] = m_pPool + (memmapBlock * PAGES_PER_SECTION);
+
+    //! Every usable page is accounted for up front, the pages reach the buddy allocator section by section.
+    for (size_t regionIndex = 0; regionIndex < m_nMemoryRegions; ++regionIndex)
+    {
+        MemoryRegion &region = m_memoryRegions[regionIndex];
+        const size_t pfn = ALIGN_TO_NEXT_BOUNDARY(region.m_addr.Get(), PAGE_SIZE) / PAGE_SIZE;
+        region.m_pPages = PfnToPage(pfn);
+
+        m_nPages += region.m_nPages;
+        AccountPageRun(regionIndex, pfn, &PageCounters::m_nPages, region.m_nPages);
+        AccountPageRun(regionIndex, pfn, &PageCounters::m_nDeferredPages, region.m_nPages);
+
+        Node &node = m_nodes[region.m_node];
+        if (pfn < node.m_startPfn)
+            node.m_startPfn = pfn;
+
+        if ((pfn + region.m_nPages) > node.m_endPfn)
+            node.m_endPfn = pfn + region.m_nPages;
+    }
+
+    //! The rest of the memmap is initialized on demand or from the idle loop.
+    while ((m_nInitializedSections < BOOT_MEMMAP_SECTIONS) && InitializeDeferredSection(MAX_NODES, MAX_ZONES));
+
+    ReserveKernelPages();
+
+    SetWatermarks();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::ReserveKernelPages()
+{
+    //! The kernel address space claims the same range as its own once the VMM is up, the pages reserved here are
+    //! skipped by its reservation and its unused tail is released from there.
+    const Address_t breakAddress = PhysicalAddress::Create(VirtualAddress(reinterpret_cast<Address_t>(get_kmalloc_eternal_ptr()))).Get();
+    const size_t nPages = ALIGN_TO_NEXT_BOUNDARY((breakAddress), (PAGE_2M)) / PAGE_SIZE;
+
+    InitializeSections(0, nPages);
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    PhysicalPage * const pPhysicalPage = const_cast<PhysicalPage *>(FindPhysicalPage(PhysicalAddress(0)));
+    if (pPhysicalPage)
+        ReservePageRun(pPhysicalPage, nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::InitializeDeferredSection(const uint8_t node, const ZoneType zoneType)
+{
+    //! Keeping interrupts off while a memmap block is claimed and initialized is enough to own it.
+    CPU::InterruptDisabler interruptDisabler;
+
+    if (m_nInitializedSections >= m_nPresentSections)
+        return false;
+
+    for (size_t memmapBlock = 0; memmapBlock < m_nPresentSections; ++memmapBlock)
+    {
+        if (m_pInitializedMemmaps[memmapBlock])
+            continue;
+
+        const size_t sectionStartPfn = (m_pMemmapSections[memmapBlock] << SECTION_SHIFT);
+        if ((MAX_ZONES != zoneType) &&
+            ((sectionStartPfn >= GetZoneEndPfn(zoneType)) || ((sectionStartPfn + PAGES_PER_SECTION) <= GetZoneStartPfn(zoneType))))
+            continue;
+
+        if ((MAX_NODES != node) && (!IsSectionPresent(m_pMemmapSections[memmapBlock], node)))
+            continue;
+
+        InitializeMemmapBlock(memmapBlock);
+
+        return true;
+    }
+
+    return false;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::InitializeSections(const size_t pfn, const size_t nPages)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    const size_t firstSection = (pfn >> SECTION_SHIFT);
+    const size_t lastSection = ((pfn + nPages - 1) >> SECTION_SHIFT);
+
+    for (size_t memmapBlock = 0; memmapBlock < m_nPresentSections; ++memmapBlock)
+    {
+        const size_t section = m_pMemmapSections[memmapBlock];
+        if ((!m_pInitializedMemmaps[memmapBlock]) && (section >= firstSection) && (section <= lastSection))
+            InitializeMemmapBlock(memmapBlock);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::InitializeMemmapBlock(const size_t memmapBlock)
+{
+    m_pInitializedMemmaps[memmapBlock] = true;
+    ++m_nInitializedSections;
+
+    const size_t section = m_pMemmapSections[memmapBlock];
+    const size_t sectionStartPfn = (section << SECTION_SHIFT);
+    const size_t sectionEndPfn = sectionStartPfn + PAGES_PER_SECTION;
+
+    // Placement new to reinitialize, pages start out reserved.
+    for (PhysicalPage &physicalPage : Range(m_pSectionMemmaps[section], PAGES_PER_SECTION))
+        new (&physicalPage) PhysicalPage();
+
+    //! Hand the usable pages of every region in the section to the buddy allocator.
+    for (size_t regionIndex = 0; regionIndex < m_nMemoryRegions; ++regionIndex)
+    {
+        const MemoryRegion &region = m_memoryRegions[regionIndex];
+        const size_t regionStartPfn = PageToPfn(region.m_pPages);
+        const size_t startPfn = (regionStartPfn > sectionStartPfn) ? regionStartPfn : sectionStartPfn;
+        const size_t endPfn = ((regionStartPfn + region.m_nPages) < sectionEndPfn) ? (regionStartPfn + region.m_nPages) : sectionEndPfn;
+        if (startPfn >= endPfn)
+            continue;
+
+        const size_t nPages = endPfn - startPfn;
+        PhysicalPage * const pPhysicalPage = PfnToPage(startPfn);
+        for (PhysicalPage &physicalPage : Range(pPhysicalPage, nPages))
+        {
+            physicalPage.SetReserved(region.m_isReclaimable);
+            physicalPage.SetRegion(regionIndex);
+        }
+
+        AccountPageRun(regionIndex, startPfn, &PageCounters::m_nDeferredPages, -static_cast<int64_t>(nPages));
+
+        //! The pages of a reclaimable region stay reserved until they are released.
+        if (region.m_isReclaimable)
+            AccountPageRun(regionIndex, startPfn, &PageCounters::m_nReservedPages, nPages);
+        else
+            FreePageRun(pPhysicalPage, nPages);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::IsSectionPresent(const size_t section, const uint8_t node) const
+{
+    const size_t sectionStartPfn = (section << SECTION_SHIFT);
+    const size_t sectionEndPfn = sectionStartPfn + PAGES_PER_SECTION;
+
+    for (const MemoryRegion &region : Range(m_memoryRegions, m_nMemoryRegions))
+    {
+        if ((MAX_NODES != node) && (region.m_node != node))
+            continue;
+
+        const size_t firstPfn = ALIGN_TO_NEXT_BOUNDARY(region.m_addr.Get(), PAGE_SIZE) / PAGE_SIZE;
+        if ((firstPfn < sectionEndPfn) && ((firstPfn + region.m_nPages) > sectionStartPfn))
+            return true;
+    }
+
+    return false;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::SetWatermarks()
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    for (Node &node : Range(m_nodes, m_nNodes))
+    {
+        for (Zone &zone : node.m_zones)
+        {
+            //! The reserved pages never come back, the watermarks scale with the pages the zone manages.
+            const size_t nMinPages = (zone.m_counters.m_nPages - zone.m_counters.m_nReservedPages) >> WATERMARK_MIN_SHIFT;
+            zone.m_watermarks[WATERMARK_MIN] = nMinPages;
+            zone.m_watermarks[WATERMARK_LOW] = nMinPages + (nMinPages >> 2);
+            zone.m_watermarks[WATERMARK_HIGH] = nMinPages + (nMinPages >> 1);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::GetFreePages(const PageCounters &pageCounters)
+{
+    return pageCounters.m_nFreePages + pageCounters.m_nCachedPages + pageCounters.m_nDeferredPages + pageCounters.m_nZeroedPages +
+           pageCounters.m_nColoredPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::GetWatermarkAllowance(const uint8_t node, const ZoneType zoneType, const Watermark watermark) const
+{
+    const Zone &zone = m_nodes[node].m_zones[zoneType];
+    const size_t nFreePages = GetFreePages(zone.m_counters);
+
+    return (nFreePages > zone.m_watermarks[watermark]) ? (nFreePages - zone.m_watermarks[watermark]) : 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::IsBelowWatermark(const Watermark watermark) const
+{
+    for (const Node &node : Range(m_nodes, m_nNodes))
+    {
+        for (const Zone &zone : node.m_zones)
+        {
+            if (GetFreePages(zone.m_counters) < zone.m_watermarks[watermark])
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::RegisterShrinker(Shrinker &shrinker)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    m_shrinkers.push_back(&shrinker);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::UnregisterShrinker(Shrinker &shrinker)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    m_shrinkers.erase(&shrinker);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::ReclaimPages(const size_t nPages)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    ++m_reclaimCounters.m_nDirectReclaims;
+
+    const size_t nStartPages = m_counters.m_nFreePages;
+    ShrinkCaches((nPages > RECLAIM_BATCH) ? nPages : RECLAIM_BATCH);
+
+    //! The freed pages may sit in the page caches of other CPUs, where this CPU can't get at them.
+    DrainPageCaches();
+
+    return m_counters.m_nFreePages - nStartPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::ReclaimBackground()
+{
+    if (!m_isReclaimPending)
+        return false;
+
+    //! Reclaim runs until every zone is back above its high watermark or the shrinkers have nothing left to give.
+    if (IsBelowWatermark(WATERMARK_HIGH))
+    {
+        ++m_reclaimCounters.m_nBackgroundReclaims;
+        if (0 < ShrinkCaches(RECLAIM_BATCH))
+            return true;
+    }
+
+    m_isReclaimPending = false;
+
+    return false;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::ShrinkCaches(const size_t nPages)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    //! The shrinkers don't allocate, whatever the free pages grow by came back from them.
+    const size_t nStartPages = GetFreePages(m_counters);
+
+    size_t nReclaimedPages = 0;
+    for (size_t priority = RECLAIM_PRIORITY + 1; (priority-- > 0) && (nReclaimedPages < nPages);)
+    {
+        for (Shrinker *pShrinker : m_shrinkers)
+        {
+            const size_t nObjects = pShrinker->CountObjects();
+            if (0 == nObjects)
+                continue;
+
+            //! Every pass scans a larger share of the objects, a cache with few objects is scanned whole.
+            const size_t nScanObjects = (0 < (nObjects >> priority)) ? (nObjects >> priority) : nObjects;
+            m_reclaimCounters.m_nFreedObjects += pShrinker->ScanObjects(nScanObjects);
+
+            nReclaimedPages = GetFreePages(m_counters) - nStartPages;
+            if (nReclaimedPages >= nPages)
+                break;
+        }
+    }
+
+    m_reclaimCounters.m_nReclaimedPages += nReclaimedPages;
+
+    return nReclaimedPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+const PhysicalPage *MemoryPool::AllocatePage(const AllocationFlags allocationFlags)
+{
+    //! The page cache is only ever touched by its own CPU, keeping interrupts off is enough to own it.
+    CPU::InterruptDisabler interruptDisabler;
+
+    if (allocationFlags & ALLOC_ATOMIC)
+        ++m_atomicCounters.m_nAllocations;
+
+    //! Below the low watermark the allocation wakes background reclaim and may dip to the min watermark,
+    //! below that it has to reclaim directly.
+    const PhysicalPage *pPhysicalPage = AllocatePage(allocationFlags, WATERMARK_LOW);
+    if (!pPhysicalPage)
+    {
+        m_isReclaimPending = true;
+
+        //! Movable pages are lent from the CMA region only once the zones run low, so contiguous allocations mostly find it free.
+        if (allocationFlags & ALLOC_MOVABLE)
+            pPhysicalPage = AllocateCmaPage(allocationFlags);
+
+        if (!pPhysicalPage)
+            pPhysicalPage = AllocatePage(allocationFlags, WATERMARK_MIN);
+    }
+
+    //! An atomic allocation can't reclaim, the atomic reserve is all it has left.
+    if ((!pPhysicalPage) && (allocationFlags & ALLOC_ATOMIC))
+        TakeAtomicReservePages(1, &pPhysicalPage, allocationFlags);
+    else if ((!pPhysicalPage) && (0 < ReclaimPages(1)))
+        pPhysicalPage = AllocatePage(allocationFlags, WATERMARK_MIN);
+
+    return pPhysicalPage;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+const PhysicalPage *MemoryPool::AllocatePage(const AllocationFlags allocationFlags, const Watermark watermark)
+{
+    const uint8_t localNode = GetLocalNode();
+    const uint8_t * const pFallbackNodes = NumaTopology::Get().GetFallbackNodes(localNode);
+
+    //! Fall back from the local node to the remote ones by distance, and within a node from the highest allowed zone to the lower ones.
+    for (const uint8_t node : Range(pFallbackNodes, m_nNodes))
+    {
+        for (size_t zone = GetZoneType(allocationFlags) + 1; zone-- > 0;)
+        {
+            if (0 == GetWatermarkAllowance(node, static_cast<ZoneType>(zone), watermark))
+                continue;
+
+            const PhysicalPage * const pPhysicalPage = AllocateZonePage(node, static_cast<ZoneType>(zone), allocationFlags);
+            if (pPhysicalPage)
+            {
+                AccountNumaAllocation(localNode, node, 1);
+                return pPhysicalPage;
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+const PhysicalPage *MemoryPool::AllocateZonePage(const uint8_t node, const ZoneType zoneType, const AllocationFlags allocationFlags)
+{
+    const PhysicalPage *pPhysicalPage = nullptr;
+
+    if ((allocationFlags & ALLOC_COLORED) && AllocateColoredPages(node, zoneType, 1, &pPhysicalPage, allocationFlags))
+    {
+        if (allocationFlags & ALLOC_ZEROED)
+            ZeroPageRun(pPhysicalPage, 1);
+
+        return pPhysicalPage;
+    }
+
+    if ((allocationFlags & ALLOC_ZEROED) && TakeZeroedPages(node, zoneType, &pPhysicalPage, 1))
+        return pPhysicalPage;
+
+    if (GetLocalNode() == node)
+    {
+        PageCache &pageCache = m_pageCaches[CPU::GetCpuIndex()][zoneType];
+        if (pageCache.m_freeList.empty())
+            RefillPageCache(pageCache, node, zoneType, allocationFlags);
+
+        TakeCachedPages(pageCache, node, zoneType, &pPhysicalPage, 1, allocationFlags);
+    }
+    else
+    {
+        //! Remote pages bypass the page cache.
+        PhysicalPage * const pBlock = AllocateBlock(0, node, zoneType, allocationFlags);
+        if (pBlock)
+            pBlock->IncrementRefCount();
+
+        pPhysicalPage = pBlock;
+    }
+
+    if (pPhysicalPage)
+    {
+        if (allocationFlags & ALLOC_ZEROED)
+            ZeroPageRun(pPhysicalPage, 1);
+
+        return pPhysicalPage;
+    }
+
+    //! The pre-zeroed pages are handed out to other allocations only once the zone is otherwise exhausted.
+    if (TakeZeroedPages(node, zoneType, &pPhysicalPage, 1))
+        return pPhysicalPage;
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::AllocatePages(const size_t nPages, const PhysicalPage **ppPages, const AllocationFlags allocationFlags)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    if (allocationFlags & ALLOC_ATOMIC)
+        ++m_atomicCounters.m_nAllocations;
+
+    size_t nAllocated = AllocatePages(nPages, ppPages, allocationFlags, WATERMARK_LOW);
+    if (nAllocated < nPages)
+    {
+        m_isReclaimPending = true;
+        nAllocated += AllocatePages(nPages - nAllocated, ppPages + nAllocated, allocationFlags, WATERMARK_MIN);
+    }
+
+    if ((nAllocated < nPages) && (allocationFlags & ALLOC_ATOMIC))
+        nAllocated += TakeAtomicReservePages(nPages - nAllocated, ppPages + nAllocated, allocationFlags);
+    else if ((nAllocated < nPages) && (0 < ReclaimPages(nPages - nAllocated)))
+        nAllocated += AllocatePages(nPages - nAllocated, ppPages + nAllocated, allocationFlags, WATERMARK_MIN);
+
+    return nAllocated;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::AllocatePages(const size_t nPages, const PhysicalPage **ppPages, const AllocationFlags allocationFlags,
+    const Watermark watermark)
+{
+    const uint8_t localNode = GetLocalNode();
+    const uint8_t * const pFallbackNodes = NumaTopology::Get().GetFallbackNodes(localNode);
+
+    size_t nAllocated = 0;
+    for (const uint8_t node : Range(pFallbackNodes, m_nNodes))
+    {
+        for (size_t zone = GetZoneType(allocationFlags) + 1; (zone-- > 0) && (nAllocated < nPages);)
+        {
+            //! A zone only gives the pages it has above the watermark.
+            const size_t nAllowedPages = GetWatermarkAllowance(node, static_cast<ZoneType>(zone), watermark);
+            const size_t nZonePages = ((nPages - nAllocated) < nAllowedPages) ? (nPages - nAllocated) : nAllowedPages;
+            if (0 == nZonePages)
+                continue;
+
+            const size_t nZoneAllocated = AllocateZonePages(node, static_cast<ZoneType>(zone), nZonePages, ppPages + nAllocated,
+                                                            allocationFlags);
+            AccountNumaAllocation(localNode, node, nZoneAllocated);
+            nAllocated += nZoneAllocated;
+        }
+    }
+
+    return nAllocated;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::AllocateZonePages(const uint8_t node, const ZoneType zoneType, const size_t nPages, const PhysicalPage **ppPages,
+    const AllocationFlags allocationFlags)
 {
+    //! The rest of the zone is only used for a colored allocation once the colors run dry.
+    if (allocationFlags & ALLOC_COLORED)
+    {
+        const size_t nColored = AllocateColoredPages(node, zoneType, nPages, ppPages, allocationFlags);
+        if (allocationFlags & ALLOC_ZEROED)
+        {
+            for (const PhysicalPage * const pPhysicalPage : Range(ppPages, nColored))
+                ZeroPageRun(pPhysicalPage, 1);
+        }
+
+        return nColored + AllocateZonePages(node, zoneType, nPages - nColored, ppPages + nColored,
+                                            static_cast<AllocationFlags>(allocationFlags & ~ALLOC_COLORED));
+    }
+
+    size_t nAllocated = 0;
+    if (allocationFlags & ALLOC_ZEROED)
+        nAllocated += TakeZeroedPages(node, zoneType, ppPages, nPages);
+
+    const size_t nFirstDirtyPage = nAllocated;
+
+    //! The cached pages are off the free lists already and likely cache hot, only the local node has them.
+    if (GetLocalNode() == node)
+    {
+        PageCache &pageCache = m_pageCaches[CPU::GetCpuIndex()][zoneType];
+        nAllocated += TakeCachedPages(pageCache, node, zoneType, ppPages + nAllocated, nPages - nAllocated, allocationFlags);
+    }
+
+    //! Take the rest as whole blocks, a block costs a single free list operation no matter its size.
+    while (nAllocated < nPages)
+    {
+        size_t order = (TypeSizeTraits<unsigned long>::bitSize - 1) - __builtin_clzl(nPages - nAllocated);
+        if (order > (MAX_ORDER - 1))
+            order = (MAX_ORDER - 1);
+
+        PhysicalPage *pBlock = AllocateBlock(order, node, zoneType, allocationFlags);
+        while ((!pBlock) && (0 < order))
+            pBlock = AllocateBlock(--order, node, zoneType, allocationFlags);
+
+        if (!pBlock)
+            break;
+
+        pBlock->SetOrder(0);
+        for (PhysicalPage &physicalPage : Range(pBlock, 1UL << order))
+        {
+            physicalPage.IncrementRefCount();
+            ppPages[nAllocated++] = &physicalPage;
+        }
+    }
+
+    if (allocationFlags & ALLOC_ZEROED)
+    {
+        for (const PhysicalPage * const pPhysicalPage : Range(ppPages + nFirstDirtyPage, nAllocated - nFirstDirtyPage))
+            ZeroPageRun(pPhysicalPage, 1);
+    }
+    else
+    {
+        //! The pre-zeroed pages are handed out to other allocations only once the zone is otherwise exhausted.
+        nAllocated += TakeZeroedPages(node, zoneType, ppPages + nAllocated, nPages - nAllocated);
+    }
+
+    return nAllocated;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::AccountNumaAllocation(const uint8_t localNode, const uint8_t node, const size_t nPages)
+{
+    if (localNode == node)
+    {
+        m_nodes[node].m_numaCounters.m_nHits += nPages;
+    }
+    else
+    {
+        m_nodes[node].m_numaCounters.m_nMisses += nPages;
+        m_nodes[localNode].m_numaCounters.m_nForeign += nPages;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::AllocateColoredPages(const uint8_t node, const ZoneType zoneType, const size_t nPages, const PhysicalPage **ppPages,
+    const AllocationFlags allocationFlags)
+{
+    if (1 == m_nPageColors)
+        return 0;
+
+    Zone &zone = m_nodes[node].m_zones[zoneType];
+    size_t &nextPageColor = m_nextPageColors[CPU::GetCpuIndex()];
+    const size_t colorMask = m_nPageColors - 1;
+
+    size_t nAllocated = 0;
+    while (nAllocated < nPages)
+    {
+        if (zone.m_colorLists[nextPageColor].empty())
+        {
+            //! A naturally aligned block of m_nPageColors pages holds a page of every color, smaller blocks a run of them.
+            size_t order = __builtin_ctzl(m_nPageColors);
+            PhysicalPage *pBlock = AllocateBlock(order, node, zoneType, allocationFlags);
+            while ((!pBlock) && (0 < order))
+                pBlock = AllocateBlock(--order, node, zoneType, allocationFlags);
+
+            if (pBlock)
+            {
+                pBlock->SetOrder(0);
+                for (PhysicalPage &physicalPage : Range(pBlock, 1UL << order))
+                    zone.m_colorLists[PageToPfn(&physicalPage) & colorMask].push_back(&physicalPage);
+
+                AccountPages(pBlock, &PageCounters::m_nColoredPages, 1L << order);
+            }
+        }
+
+        size_t color = nextPageColor;
+        for (size_t nColors = 1; zone.m_colorLists[color].empty() && (nColors < m_nPageColors); ++nColors)
+            color = (color + 1) & colorMask;
+
+        if (zone.m_colorLists[color].empty())
+            break;
+
+        PhysicalPage * const pPhysicalPage = zone.m_colorLists[color].pop_front();
+        AccountPages(pPhysicalPage, &PageCounters::m_nColoredPages, -1);
+
+        pPhysicalPage->IncrementRefCount();
+        ppPages[nAllocated++] = pPhysicalPage;
+        nextPageColor = (color + 1) & colorMask;
+    }
+
+    return nAllocated;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::DrainColoredPages()
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    for (Node &node : Range(m_nodes, m_nNodes))
+    {
+        for (Zone &zone : node.m_zones)
+        {
+            for (PhysicalPageFreeList &colorList : Range(zone.m_colorLists, m_nPageColors))
+            {
+                while (!colorList.empty())
+                {
+                    PhysicalPage * const pPhysicalPage = colorList.pop_back();
+                    AccountPages(pPhysicalPage, &PageCounters::m_nColoredPages, -1);
+
+                    FreeBlock(pPhysicalPage, 0);
+                }
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::TakeCachedPages(PageCache &pageCache, const uint8_t node, const ZoneType zoneType, const PhysicalPage **ppPages,
+    const size_t nPages, const AllocationFlags allocationFlags)
+{
+    size_t nTaken = 0;
+    while ((nTaken < nPages) && (!pageCache.m_freeList.empty()))
+    {
+        PhysicalPage * const pPhysicalPage = (allocationFlags & ALLOC_COLD) ? pageCache.m_freeList.pop_back() : pageCache.m_freeList.pop_front();
+        --m_memoryRegions[pPhysicalPage->GetRegion()].m_counters.m_nCachedPages;
+
+        pPhysicalPage->IncrementRefCount();
+        ppPages[nTaken++] = pPhysicalPage;
+    }
+
+    //! All the pages are in the same zone, the pool, node and zone counters are updated once for the batch.
+    pageCache.m_nPages -= nTaken;
+    m_counters.m_nCachedPages -= nTaken;
+    m_nodes[node].m_counters.m_nCachedPages -= nTaken;
+    m_nodes[node].m_zones[zoneType].m_counters.m_nCachedPages -= nTaken;
+
+    return nTaken;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::TakeZeroedPages(const uint8_t node, const ZoneType zoneType, const PhysicalPage **ppPages, const size_t nPages)
+{
+    PageCache &zeroedPages = m_nodes[node].m_zones[zoneType].m_zeroedPages;
+
+    size_t nTaken = 0;
+    while ((nTaken < nPages) && (!zeroedPages.m_freeList.empty()))
+    {
+        PhysicalPage * const pPhysicalPage = zeroedPages.m_freeList.pop_front();
+        --m_memoryRegions[pPhysicalPage->GetRegion()].m_counters.m_nZeroedPages;
+
+        pPhysicalPage->IncrementRefCount();
+        ppPages[nTaken++] = pPhysicalPage;
+    }
+
+    zeroedPages.m_nPages -= nTaken;
+    m_counters.m_nZeroedPages -= nTaken;
+    m_nodes[node].m_counters.m_nZeroedPages -= nTaken;
+    m_nodes[node].m_zones[zoneType].m_counters.m_nZeroedPages -= nTaken;
+
+    return nTaken;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::RefillZeroedPages()
+{
+    for (size_t node = 0; node < m_nNodes; ++node)
+    {
+        //! ZONE_DMA is too scarce to hold pages back.
+        for (size_t zone = ZONE_DMA32; zone < MAX_ZONES; ++zone)
+        {
+            PageCache &zeroedPages = m_nodes[node].m_zones[zone].m_zeroedPages;
+
+            for (size_t pageIndex = 0; (pageIndex < ZEROED_PAGES_BATCH) && (zeroedPages.m_nPages < ZEROED_PAGES_HIGH); ++pageIndex)
+            {
+                PhysicalPage *pPhysicalPage = nullptr;
+                {
+                    CPU::InterruptDisabler interruptDisabler;
+                    pPhysicalPage = AllocateBlock(0, node, static_cast<ZoneType>(zone));
+                }
+
+                if (!pPhysicalPage)
+                    break;
+
+                //! The page isn't on any list while it's zeroed, interrupts stay enabled in between pages.
+                Vmm::Get().ZeroPhysicalPage(pPhysicalPage->GetAddress(), true);
+
+                CPU::InterruptDisabler interruptDisabler;
+                zeroedPages.m_freeList.push_back(pPhysicalPage);
+                ++zeroedPages.m_nPages;
+                AccountPages(pPhysicalPage, &PageCounters::m_nZeroedPages, 1);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::DrainZeroedPages()
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    for (Node &node : Range(m_nodes, m_nNodes))
+    {
+        for (Zone &zone : node.m_zones)
+        {
+            while (!zone.m_zeroedPages.m_freeList.empty())
+            {
+                PhysicalPage * const pPhysicalPage = zone.m_zeroedPages.m_freeList.pop_back();
+                --zone.m_zeroedPages.m_nPages;
+                AccountPages(pPhysicalPage, &PageCounters::m_nZeroedPages, -1);
+
+                FreeBlock(pPhysicalPage, 0);
+            }
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::TakeAtomicReservePages(const size_t nPages, const PhysicalPage **ppPages, const AllocationFlags allocationFlags)
+{
+    const uint8_t localNode = GetLocalNode();
+
+    //! Like the zones, from the highest allowed reserve to the lower ones.
+    size_t nTaken = 0;
+    for (size_t zone = GetZoneType(allocationFlags) + 1; (zone-- > ZONE_DMA32) && (nTaken < nPages);)
+    {
+        PageCache &atomicReserve = m_atomicReserves[zone];
+        while ((nTaken < nPages) && (!atomicReserve.m_freeList.empty()))
+        {
+            PhysicalPage * const pPhysicalPage = atomicReserve.m_freeList.pop_front();
+            --atomicReserve.m_nPages;
+            AccountPages(pPhysicalPage, &PageCounters::m_nAtomicPages, -1);
+            AccountNumaAllocation(localNode, GetNode(pPhysicalPage), 1);
+
+            pPhysicalPage->IncrementRefCount();
+            ppPages[nTaken++] = pPhysicalPage;
+        }
+    }
+
+    if (allocationFlags & ALLOC_ZEROED)
+    {
+        for (const PhysicalPage * const pPhysicalPage : Range(ppPages, nTaken))
+            ZeroPageRun(pPhysicalPage, 1);
+    }
+
+    m_atomicCounters.m_nReservePages += nTaken;
+    m_atomicCounters.m_nFailedPages += (nPages - nTaken);
+
+    return nTaken;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::RefillAtomicReserves()
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    const uint8_t * const pFallbackNodes = NumaTopology::Get().GetFallbackNodes(GetLocalNode());
+
+    size_t nRefilledPages = 0;
+
+    //! ZONE_DMA is too scarce to hold pages back.
+    for (size_t zone = ZONE_DMA32; zone < MAX_ZONES; ++zone)
+    {
+        PageCache &atomicReserve = m_atomicReserves[zone];
+
+        for (const uint8_t node : Range(pFallbackNodes, m_nNodes))
+        {
+            while ((atomicReserve.m_nPages < ATOMIC_RESERVE_PAGES) &&
+                   (0 < GetWatermarkAllowance(node, static_cast<ZoneType>(zone), WATERMARK_MIN)))
+            {
+                PhysicalPage * const pPhysicalPage = AllocateBlock(0, node, static_cast<ZoneType>(zone));
+                if (!pPhysicalPage)
+                    break;
+
+                atomicReserve.m_freeList.push_back(pPhysicalPage);
+                ++atomicReserve.m_nPages;
+                AccountPages(pPhysicalPage, &PageCounters::m_nAtomicPages, 1);
+                ++nRefilledPages;
+            }
+        }
+    }
+
+    m_atomicCounters.m_nRefilledPages += nRefilledPages;
+
+    return nRefilledPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::ZeroPageRun(const PhysicalPage *pPhysicalPage, const size_t nPages)
+{
+    //! The caller is about to use the pages, zero them through the cache.
+    for (const PhysicalPage &physicalPage : Range(pPhysicalPage, nPages))
+        Vmm::Get().ZeroPhysicalPage(physicalPage.GetAddress(), false);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::InflateBalloon(const size_t nPages, const PhysicalPage **ppPages)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    //! The host discards the pages, don't give it cache hot ones. The balloon only takes what is above the high
+    //! watermarks, so it doesn't inflate again right after reclaim deflated it.
+    const size_t nAllocated = AllocatePages(nPages, ppPages, ALLOC_COLD, WATERMARK_HIGH);
+
+    for (const PhysicalPage * const pPhysicalPage : Range(ppPages, nAllocated))
+        m_balloonPages.push_back(const_cast<PhysicalPage *>(pPhysicalPage));
+
+    return nAllocated;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::DeflateBalloon(const size_t nPages, const PhysicalPage **ppPages)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    size_t nDeflated = 0;
+    while ((nDeflated < nPages) && (!m_balloonPages.empty()))
+        ppPages[nDeflated++] = m_balloonPages.pop_back();
+
+    return nDeflated;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::TakeUnreportedBlocks(const size_t minOrder, const PhysicalPage **ppBlocks, const size_t nMaxBlocks)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    size_t nBlocks = 0;
+    for (size_t order = MAX_ORDER; (order-- > minOrder) && (nBlocks < nMaxBlocks);)
+    {
+        for (Node &node : Range(m_nodes, m_nNodes))
+        {
+            for (Zone &zone : node.m_zones)
+            {
+                //! Reported blocks are at the front of the free list, the unreported ones behind them.
+                PhysicalPageFreeList &freeList = zone.m_freeAreas[order].m_freeList;
+                while ((nBlocks < nMaxBlocks) && (!freeList.empty()) && (!freeList.back()->IsReported()))
+                {
+                    PhysicalPage * const pBlock = freeList.back();
+                    RemoveFreeBlock(pBlock);
+
+                    ppBlocks[nBlocks++] = pBlock;
+                }
+            }
+        }
+    }
+
+    return nBlocks;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::PutBackReportedBlocks(const PhysicalPage * const *ppBlocks, const size_t nBlocks, const bool isReported)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    for (const PhysicalPage * const pPhysicalPage : Range(ppBlocks, nBlocks))
+    {
+        PhysicalPage * const pBlock = const_cast<PhysicalPage *>(pPhysicalPage);
+        const size_t order = pBlock->GetOrder();
+
+        FreeBlock(pBlock, order);
+
+        //! A block which wasn't merged moves to the front of its free list, so it's the last one handed out.
+        if (isReported && pBlock->IsFree() && (pBlock->GetOrder() == order))
+        {
+            PhysicalPageFreeList &freeList = m_nodes[GetNode(pBlock)].m_zones[GetZoneType(PageToPfn(pBlock))].m_freeAreas[order].m_freeList;
+            freeList.erase(pBlock);
+            freeList.push_front(pBlock);
+
+            pBlock->SetReported(true);
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+MemoryPool::PhysicalRange MemoryPool::AllocateRange(const size_t nPages, const AllocationFlags allocationFlags)
+{
+    if (0 == nPages)
+        return PhysicalRange(nullptr, 0);
+
+    const ZoneType zoneType = GetZoneType(allocationFlags);
+    const size_t order = GetOrder(nPages);
+    const uint8_t localNode = GetLocalNode();
+
+    //! Interrupt handlers allocate too, they must not see the free lists in the middle of a block split.
+    PhysicalPage *pPhysicalPage = nullptr;
+    {
+        CPU::InterruptDisabler interruptDisabler;
+
+        if (allocationFlags & ALLOC_ATOMIC)
+            ++m_atomicCounters.m_nAllocations;
+
+        //! Ranges larger than the biggest buddy block go straight to the scan.
+        pPhysicalPage = AllocateFallbackBlock(order, zoneType, WATERMARK_LOW, allocationFlags);
+        if ((!pPhysicalPage) && (order < MAX_ORDER))
+        {
+            m_isReclaimPending = true;
+            pPhysicalPage = AllocateFallbackBlock(order, zoneType, WATERMARK_MIN, allocationFlags);
+        }
+
+        if (pPhysicalPage)
+        {
+            AccountNumaAllocation(localNode, GetNode(pPhysicalPage), nPages);
+
+            //! Give back the tail of the block which isn't part of the range.
+            const size_t nBlockPages = (1UL << order);
+            if (nPages < nBlockPages)
+                FreePageRun(pPhysicalPage + nPages, nBlockPages - nPages);
+        }
+        else
+        {
+            //! Have the idle loop compact towards the order for the next time.
+            if ((order < MAX_ORDER) && ((MAX_ORDER == m_compactionOrder) || (order > m_compactionOrder)))
+                m_compactionOrder = order;
+
+            //! The scan, reclaim and migration out of the CMA region are unbounded, an atomic allocation gives up instead.
+            //! The atomic reserves only hold single pages.
+            if (allocationFlags & ALLOC_ATOMIC)
+            {
+                m_atomicCounters.m_nFailedPages += nPages;
+                return PhysicalRange(nullptr, 0);
+            }
+        }
+    }
+
+    if (!pPhysicalPage)
+    {
+        //! Cached, pre-zeroed and colored pages can't coalesce, give them back before falling back to the scan.
+        DrainPageCaches();
+        DrainZeroedPages();
+        DrainColoredPages();
+
+        PhysicalRange physicalRange(AllocateRangeScan(nPages, zoneType));
+        if ((!physicalRange.IsInitalized()) && (0 < ReclaimPages(nPages)))
+            physicalRange = AllocateRangeScan(nPages, zoneType);
+
+        //! The last resort is the CMA region, the pages lent from it are migrated out of the way.
+        if (!physicalRange.IsInitalized())
+            physicalRange = AllocateCmaRange(nPages, zoneType);
+
+        if (physicalRange.IsInitalized())
+        {
+            CPU::InterruptDisabler interruptDisabler;
+            AccountNumaAllocation(localNode, GetNode(physicalRange.m_pPhysicalPage), nPages);
+        }
+
+        if (physicalRange.IsInitalized() && (allocationFlags & ALLOC_ZEROED))
+            ZeroPageRun(physicalRange.m_pPhysicalPage, nPages);
+
+        return physicalRange;
+    }
+
+    //! The range is off the free lists, it's zeroed with interrupts enabled.
+    if (allocationFlags & ALLOC_ZEROED)
+        ZeroPageRun(pPhysicalPage, nPages);
+
+    return PhysicalRange(pPhysicalPage, nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::AllocateFallbackBlock(const size_t order, const ZoneType zoneType, const Watermark watermark,
+    const AllocationFlags allocationFlags)
+{
+    if (order >= MAX_ORDER)
+        return nullptr;
+
+    //! Fall back from the local node to the remote ones, and within a node from the highest allowed zone to the lower ones.
+    for (const uint8_t node : Range(NumaTopology::Get().GetFallbackNodes(GetLocalNode()), m_nNodes))
+    {
+        for (size_t zone = zoneType + 1; zone-- > 0;)
+        {
+            if (GetWatermarkAllowance(node, static_cast<ZoneType>(zone), watermark) < (1UL << order))
+                continue;
+
+            PhysicalPage * const pPhysicalPage = AllocateBlock(order, node, static_cast<ZoneType>(zone), allocationFlags);
+            if (pPhysicalPage)
+                return pPhysicalPage;
+        }
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+MemoryPool::PhysicalRange MemoryPool::AllocateRangeScan(const size_t nPages, const ZoneType zoneType)
+{
+    for (const uint8_t node : Range(NumaTopology::Get().GetFallbackNodes(GetLocalNode()), m_nNodes))
+    {
+        for (size_t zone = zoneType + 1; zone-- > 0;)
+        {
+            if (GetWatermarkAllowance(node, static_cast<ZoneType>(zone), WATERMARK_MIN) < nPages)
+                continue;
+
+            //! The scan walks the page descriptors directly, all of them have to be initialized.
+            while (InitializeDeferredSection(node, static_cast<ZoneType>(zone)));
+
+            const size_t zoneStartPfn = GetZoneStartPfn(static_cast<ZoneType>(zone));
+            const size_t zoneEndPfn = GetZoneEndPfn(static_cast<ZoneType>(zone));
+
+            for (const MemoryRegion &region : Range(m_memoryRegions, m_nMemoryRegions))
+            {
+                if (region.m_node != node)
+                    continue;
+
+                const size_t regionStartPfn = PageToPfn(region.m_pPages);
+                const size_t startPfn = (regionStartPfn > zoneStartPfn) ? regionStartPfn : zoneStartPfn;
+                const size_t endPfn = ((regionStartPfn + region.m_nPages) < zoneEndPfn) ? (regionStartPfn + region.m_nPages) : zoneEndPfn;
+                if (startPfn >= endPfn)
+                    continue;
+
+                //! The run must still be free when it's taken, interrupts are enabled again between the regions.
+                CPU::InterruptDisabler interruptDisabler;
+
+                PhysicalPage * const pRunStart = ScanPageRun(PfnToPage(startPfn), endPfn - startPfn, nPages);
+                if (pRunStart)
+                {
+                    TakePageRun(pRunStart, nPages);
+
+                    return PhysicalRange(pRunStart, nPages);
+                }
+            }
+        }
+    }
+
+    return PhysicalRange(nullptr, 0);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::ScanPageRun(PhysicalPage * const pPages, const size_t nPages, const size_t nRunPages)
+{
+    PhysicalPage *pRunStart = nullptr;
+    size_t runLength = 0;
+
+    PhysicalPage *pPhysicalPage = pPages;
+    PhysicalPage * const pPagesEnd = pPages + nPages;
+    while (pPhysicalPage < pPagesEnd)
+    {
+        //! Free pages are only ever found at the head of a free block, skip the whole block.
+        if (!pPhysicalPage->IsFree())
+        {
+            pRunStart = nullptr;
+            runLength = 0;
+            ++pPhysicalPage;
+            continue;
+        }
+
+        if (!pRunStart)
+            pRunStart = pPhysicalPage;
+
+        runLength += (1UL << pPhysicalPage->GetOrder());
+        pPhysicalPage += (1UL << pPhysicalPage->GetOrder());
+
+        if (runLength >= nRunPages)
+            return pRunStart;
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::InitializeCma(const size_t nPages)
+{
+    const size_t nBlockPages = (1UL << (MAX_ORDER - 1));
+    const size_t nCmaPages = ALIGN_TO_NEXT_BOUNDARY((nPages), (nBlockPages));
+    if (0 == nCmaPages)
+        return 0;
+
+    const size_t zoneStartPfn = GetZoneStartPfn(ZONE_DMA32);
+    const size_t zoneEndPfn = GetZoneEndPfn(ZONE_DMA32);
+
+    //! The regions are walked from the top down, the region only takes low memory when there is nothing else.
+    for (size_t regionIndex = m_nMemoryRegions; regionIndex-- > 0;)
+    {
+        const MemoryRegion &region = m_memoryRegions[regionIndex];
+        const size_t regionStartPfn = PageToPfn(region.m_pPages);
+        const size_t startPfn = (regionStartPfn > zoneStartPfn) ? regionStartPfn : zoneStartPfn;
+        const size_t endPfn = ((regionStartPfn + region.m_nPages) < zoneEndPfn) ? (regionStartPfn + region.m_nPages) : zoneEndPfn;
+
+        for (size_t cmaEndPfn = ALIGN((endPfn), (nBlockPages)); cmaEndPfn >= (startPfn + nCmaPages); cmaEndPfn -= nBlockPages)
+        {
+            const size_t cmaStartPfn = cmaEndPfn - nCmaPages;
+            InitializeSections(cmaStartPfn, nCmaPages);
+
+            CPU::InterruptDisabler interruptDisabler;
+
+            if (!IsBlockRunFree(cmaStartPfn, nCmaPages))
+                continue;
+
+            //! The blocks move from the free lists of their zone to the ones of the region.
+            for (size_t pfn = cmaStartPfn; pfn < cmaEndPfn; pfn += nBlockPages)
+                RemoveFreeBlock(PfnToPage(pfn));
+
+            m_cmaStartPfn = cmaStartPfn;
+            m_cmaEndPfn = cmaEndPfn;
+            m_cmaCounters.m_nPages = nCmaPages;
+
+            for (size_t pfn = cmaStartPfn; pfn < cmaEndPfn; pfn += nBlockPages)
+                AddFreeBlock(PfnToPage(pfn), MAX_ORDER - 1);
+
+            return nCmaPages;
+        }
+    }
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+const PhysicalPage *MemoryPool::AllocateCmaPage(const AllocationFlags allocationFlags)
+{
+    if ((m_cmaStartPfn == m_cmaEndPfn) || (GetZoneType(allocationFlags) < GetZoneType(m_cmaStartPfn)))
+        return nullptr;
+
+    PhysicalPage * const pPhysicalPage = AllocateBlock(0, m_cmaFreeAreas);
+    if (!pPhysicalPage)
+        return nullptr;
+
+    pPhysicalPage->IncrementRefCount();
+    AccountNumaAllocation(GetLocalNode(), GetNode(pPhysicalPage), 1);
+    ++m_cmaCounters.m_nLentPages;
+
+    if (allocationFlags & ALLOC_ZEROED)
+        ZeroPageRun(pPhysicalPage, 1);
+
+    return pPhysicalPage;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+MemoryPool::PhysicalRange MemoryPool::AllocateCmaRange(const size_t nPages, const ZoneType zoneType)
+{
+    if ((m_cmaStartPfn == m_cmaEndPfn) || (zoneType < GetZoneType(m_cmaStartPfn)))
+        return PhysicalRange(nullptr, 0);
+
+    const size_t order = GetOrder(nPages);
+    const size_t nAlignPages = (1UL << ((order < MAX_ORDER) ? order : (MAX_ORDER - 1)));
+
+    size_t runPfn = m_cmaStartPfn;
+    while ((runPfn + nPages) <= m_cmaEndPfn)
+    {
+        PhysicalPage * const pRunStart = PfnToPage(runPfn);
+
+        //! Skip past the page which pins the run.
+        const PhysicalPage *pPinnedPage = nullptr;
+        {
+            CPU::InterruptDisabler interruptDisabler;
+            pPinnedPage = FindPinnedPage(pRunStart, nPages);
+        }
+
+        if (pPinnedPage)
+        {
+            runPfn = ALIGN_TO_NEXT_BOUNDARY((PageToPfn(pPinnedPage) + 1), (nAlignPages));
+            continue;
+        }
+
+        //! The lent pages move to any zone, the old frames are freed back to the region.
+        bool isRunFree = true;
+        for (PhysicalPage &physicalPage : Range(pRunStart, nPages))
+        {
+            //! Migration rewrites the mapping, nothing may touch the page in between. Interrupts are enabled again
+            //! between the pages, the copies of a whole run would hold them off far too long.
+            CPU::InterruptDisabler interruptDisabler;
+
+            if (!physicalPage.IsMovable())
+                continue;
+
+            PhysicalPage * const pTargetPage = AllocateFallbackBlock(0, ZONE_NORMAL, WATERMARK_MIN, ALLOC_NO_FLAGS);
+            if (pTargetPage && MigratePage(&physicalPage, pTargetPage))
+            {
+                ++m_cmaCounters.m_nMigratedPages;
+                continue;
+            }
+
+            if (pTargetPage)
+                FreeBlock(pTargetPage, 0);
+
+            isRunFree = false;
+            break;
+        }
+
+        //! The pages migrated so far stay where they are, the next run may still be freed. Pages may also have been
+        //! lent from the run again while interrupts were enabled.
+        CPU::InterruptDisabler interruptDisabler;
+        if ((!isRunFree) || (!IsPageRunFree(pRunStart, nPages)))
+        {
+            runPfn += nAlignPages;
+            continue;
+        }
+
+        TakePageRun(pRunStart, nPages);
+        ++m_cmaCounters.m_nRanges;
+
+        return PhysicalRange(pRunStart, nPages);
+    }
+
+    ++m_cmaCounters.m_nFailedRanges;
+
+    return PhysicalRange(nullptr, 0);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::FindPinnedPage(PhysicalPage * const pPages, const size_t nPages)
+{
+    PhysicalPage *pPhysicalPage = pPages;
+    PhysicalPage * const pPagesEnd = pPages + nPages;
+    while (pPhysicalPage < pPagesEnd)
+    {
+        //! A free block may start before the run, skip to its end.
+        PhysicalPage * const pBlock = FindFreeBlock(pPhysicalPage);
+        if (pBlock)
+        {
+            pPhysicalPage = pBlock + (1UL << pBlock->GetOrder());
+            continue;
+        }
+
+        //! The same conditions as for the migration itself.
+        if ((!pPhysicalPage->IsMovable()) || (1 != pPhysicalPage->GetMapCount()) || (1 != pPhysicalPage->GetRefCount()))
+            return pPhysicalPage;
+
+        ++pPhysicalPage;
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::IsPageRunFree(PhysicalPage * const pPages, const size_t nPages)
+{
+    PhysicalPage *pPhysicalPage = pPages;
+    PhysicalPage * const pPagesEnd = pPages + nPages;
+    while (pPhysicalPage < pPagesEnd)
+    {
+        //! A free block may start before the run, skip to its end.
+        PhysicalPage * const pBlock = FindFreeBlock(pPhysicalPage);
+        if (!pBlock)
+            return false;
+
+        pPhysicalPage = pBlock + (1UL << pBlock->GetOrder());
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+MemoryPool::PhysicalRange MemoryPool::AllocateRange(const PhysicalAddress physicalAddress, const size_t nPages)
+{
+    if (0 < nPages)
+        InitializeSections(physicalAddress.Get() / PAGE_SIZE, nPages);
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    PhysicalPage * const pPhysicalPage = const_cast<PhysicalPage *>(FindPhysicalPage(physicalAddress));
+
+    if (pPhysicalPage)
+        ReservePageRun(pPhysicalPage, nPages);
+
+    PhysicalRange physicalRange(pPhysicalPage, nPages);
+
+    return physicalRange;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::ReservePageRun(PhysicalPage *pPhysicalPage, const size_t nPages)
+{
+    TakePageRun(pPhysicalPage, nPages);
+
+    for (PhysicalPage &physicalPage : Range(pPhysicalPage, nPages))
+    {
+        //! Pages in section holes are reserved already and not accounted for.
+        if (physicalPage.IsReserved())
+            continue;
+
+        physicalPage.SetReserved(true);
+        AccountPages(&physicalPage, &PageCounters::m_nReservedPages, 1);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::ReleasePageRun(const size_t pfn, const size_t nPages)
+{
+    if (0 == nPages)
+        return 0;
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    InitializeSections(pfn, nPages);
+
+    size_t nReleasedPages = 0;
+
+    //! Only the pages of the memory regions are backed by memory, the holes of a section stay reserved.
+    for (const MemoryRegion &region : Range(m_memoryRegions, m_nMemoryRegions))
+    {
+        const size_t regionStartPfn = PageToPfn(region.m_pPages);
+        const size_t startPfn = (regionStartPfn > pfn) ? regionStartPfn : pfn;
+        const size_t endPfn = ((regionStartPfn + region.m_nPages) < (pfn + nPages)) ? (regionStartPfn + region.m_nPages) : (pfn + nPages);
+        if (startPfn >= endPfn)
+            continue;
+
+        for (PhysicalPage &physicalPage : Range(PfnToPage(startPfn), endPfn - startPfn))
+        {
+            if (!physicalPage.IsReserved())
+                continue;
+
+            physicalPage.SetReserved(false);
+            AccountPages(&physicalPage, &PageCounters::m_nReservedPages, -1);
+            ++nReleasedPages;
+
+            //! The head of a range reserved by AllocateRange holds the reference of the whole range, the last one frees it.
+            if (0 < physicalPage.GetRefCount())
+                physicalPage.DecrementRefCount();
+            else
+                FreeBlock(&physicalPage, 0);
+        }
+    }
+
+    return nReleasedPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::InitializePhysicalRange(PhysicalRange &physicalRange)
+{
+    //! Safe to const cast because we know the page came from the pool.
+    PhysicalPage * const pPhysicalPage = const_cast<PhysicalPage *>(physicalRange.m_pPhysicalPage);
+    ASSERT(!pPhysicalPage->IsFree());
+
+    //! The first reference makes the page the head of the range, copies of the range only add to its ref count.
+    if (!pPhysicalPage->IsRangeHead())
+        pPhysicalPage->SetRangeHead(true, physicalRange.m_nPages);
+
+    ASSERT(pPhysicalPage->GetRangePages() == physicalRange.m_nPages);
+
+    pPhysicalPage->IncrementRefCount();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::ReleaseRangeTail(PhysicalRange &physicalRange, const size_t nPages)
+{
+    if ((!physicalRange.IsInitalized()) || (0 == nPages))
+        return 0;
+
+    ASSERT(nPages <= physicalRange.m_nPages);
+
+    //! Safe to const cast because we know the page came from the pool.
+    PhysicalPage * const pPhysicalPage = const_cast<PhysicalPage *>(physicalRange.m_pPhysicalPage);
+
+    //! Other owners of the range would still expect the released pages to be part of it.
+    ASSERT(1 == pPhysicalPage->GetRefCount());
+
+    const size_t pfn = PageToPfn(pPhysicalPage) + (physicalRange.m_nPages - nPages);
+
+    if (nPages == physicalRange.m_nPages)
+    {
+        //! Nothing is left of the range, its head is released as a single page along with the others.
+        pPhysicalPage->SetRangeHead(false);
+        physicalRange.Clear();
+    }
+    else
+    {
+        physicalRange.m_nPages -= nPages;
+        pPhysicalPage->SetRangeHead(true, physicalRange.m_nPages);
+    }
+
+    return ReleasePageRun(pfn, nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::ResizeHugePagePool(const HugePageSize hugePageSize, const size_t nHugePages)
+{
+    ASSERT((HUGE_PAGE_NONE < hugePageSize) && (hugePageSize < MAX_HUGE_PAGE_SIZES));
+
+    HugePagePool &hugePagePool = m_hugePagePools[hugePageSize];
+
+    while (hugePagePool.m_nHugePages < nHugePages)
+    {
+        PhysicalPage * const pPhysicalPage = TakeHugePageFrame(hugePageSize);
+        if (!pPhysicalPage)
+            break;
+
+        CPU::InterruptDisabler interruptDisabler;
+
+        pPhysicalPage->SetHugePageSize(hugePageSize);
+        hugePagePool.m_freeList.push_back(pPhysicalPage);
+        ++hugePagePool.m_nHugePages;
+        ++hugePagePool.m_nFreeHugePages;
+    }
+
+    //! Only free huge pages can be released, the ones in use stay in the pool until the pool is shrunk again.
+    while ((hugePagePool.m_nHugePages > nHugePages) && (!hugePagePool.m_freeList.empty()))
+    {
+        CPU::InterruptDisabler interruptDisabler;
+
+        PhysicalPage * const pPhysicalPage = hugePagePool.m_freeList.pop_back();
+        --hugePagePool.m_nHugePages;
+        --hugePagePool.m_nFreeHugePages;
+
+        pPhysicalPage->SetHugePageSize(HUGE_PAGE_NONE);
+        FreePageRun(pPhysicalPage, GetHugePagePages(hugePageSize));
+    }
+
+    return hugePagePool.m_nHugePages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::TakeHugePageFrame(const HugePageSize hugePageSize)
+{
+    if (HUGE_PAGE_1G == hugePageSize)
+        return FindGiganticPageFrame();
+
+    //! 2 MiB frames are plain buddy blocks, ZONE_DMA is too small to spare them.
+    CPU::InterruptDisabler interruptDisabler;
+
+    for (const uint8_t node : Range(NumaTopology::Get().GetFallbackNodes(GetLocalNode()), m_nNodes))
+    {
+        for (size_t zone = ZONE_NORMAL + 1; zone-- > ZONE_DMA32;)
+        {
+            PhysicalPage * const pPhysicalPage = AllocateBlock(GetOrder(GetHugePagePages(hugePageSize)), node, static_cast<ZoneType>(zone));
+            if (pPhysicalPage)
+                return pPhysicalPage;
+        }
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::FindGiganticPageFrame()
+{
+    const size_t nFramePages = GetHugePagePages(HUGE_PAGE_1G);
+    const size_t nBlockPages = (1UL << (MAX_ORDER - 1));
+
+    //! Free pages sitting in the caches would keep their blocks from coalescing.
+    DrainPageCaches();
+    DrainZeroedPages();
+    DrainColoredPages();
+
+    for (const uint8_t node : Range(NumaTopology::Get().GetFallbackNodes(GetLocalNode()), m_nNodes))
+    {
+        for (size_t zone = ZONE_NORMAL + 1; zone-- > ZONE_DMA32;)
+        {
+            const size_t zoneStartPfn = GetZoneStartPfn(static_cast<ZoneType>(zone));
+            const size_t zoneEndPfn = GetZoneEndPfn(static_cast<ZoneType>(zone));
+
+            for (const MemoryRegion &region : Range(m_memoryRegions, m_nMemoryRegions))
+            {
+                if (region.m_node != node)
+                    continue;
+
+                const size_t regionStartPfn = PageToPfn(region.m_pPages);
+                const size_t startPfn = (regionStartPfn > zoneStartPfn) ? regionStartPfn : zoneStartPfn;
+                const size_t endPfn = ((regionStartPfn + region.m_nPages) < zoneEndPfn) ? (regionStartPfn + region.m_nPages) : zoneEndPfn;
+
+                for (size_t framePfn = ALIGN_TO_NEXT_BOUNDARY((startPfn), (nFramePages)); (framePfn + nFramePages) <= endPfn; framePfn += nFramePages)
+                {
+                    InitializeSections(framePfn, nFramePages);
+
+                    CPU::InterruptDisabler interruptDisabler;
+
+                    if (!IsBlockRunFree(framePfn, nFramePages))
+                        continue;
+
+                    for (size_t pfn = framePfn; pfn < (framePfn + nFramePages); pfn += nBlockPages)
+                        RemoveFreeBlock(PfnToPage(pfn));
+
+                    return PfnToPage(framePfn);
+                }
+            }
+        }
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::IsBlockRunFree(const size_t pfn, const size_t nPages)
+{
+    //! The run is free as a whole only if every max order block in it is, the blocks of the CMA region stay where they are.
+    for (size_t blockPfn = pfn; blockPfn < (pfn + nPages); blockPfn += (1UL << (MAX_ORDER - 1)))
+    {
+        const PhysicalPage * const pBlock = PfnToPage(blockPfn);
+        if ((!pBlock) || IsCmaPfn(blockPfn) || (!pBlock->IsFree()) || ((MAX_ORDER - 1) != pBlock->GetOrder()))
+            return false;
+    }
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+const PhysicalPage *MemoryPool::AllocateHugePage(const HugePageSize hugePageSize)
+{
+    ASSERT((HUGE_PAGE_NONE < hugePageSize) && (hugePageSize < MAX_HUGE_PAGE_SIZES));
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    HugePagePool &hugePagePool = m_hugePagePools[hugePageSize];
+    if (hugePagePool.m_freeList.empty())
+        return nullptr;
+
+    PhysicalPage * const pPhysicalPage = hugePagePool.m_freeList.pop_front();
+    --hugePagePool.m_nFreeHugePages;
+
+    pPhysicalPage->IncrementRefCount();
+
+    return pPhysicalPage;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::FreeHugePage(PhysicalPage * const pPhysicalPage)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    HugePagePool &hugePagePool = m_hugePagePools[pPhysicalPage->GetHugePageSize()];
+    hugePagePool.m_freeList.push_front(pPhysicalPage);
+    ++hugePagePool.m_nFreeHugePages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::SetReverseMapping(PhysicalPage * const pPhysicalPage, AddressSpace &addressSpace, const VirtualAddress &virtualAddress)
+{
+    ASSERT(!pPhysicalPage->IsMovable());
+    ASSERT(0 == pPhysicalPage->GetMapCount());
+
+    pPhysicalPage->SetMovable(true);
+    pPhysicalPage->m_reverseMapping.m_pAddressSpace = &addressSpace;
+    pPhysicalPage->m_reverseMapping.m_virtualAddress = virtualAddress;
+    pPhysicalPage->IncrementMapCount();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::ClearReverseMapping(PhysicalPage * const pPhysicalPage)
+{
+    ASSERT(pPhysicalPage->IsMovable());
+
+    pPhysicalPage->DecrementMapCount();
+    pPhysicalPage->SetMovable(false);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::ReturnMovablePage(const PhysicalAddress physicalAddress)
+{
+    //! Safe to const cast because we know the page came from the pool.
+    PhysicalPage * const pPhysicalPage = const_cast<PhysicalPage *>(FindPhysicalPage(physicalAddress));
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    //! A merged page stays with its other sharers, the last one frees it.
+    if (pPhysicalPage->IsMerged())
+        DropMergedMapping(pPhysicalPage);
+    else
+        ClearReverseMapping(pPhysicalPage);
+
+    pPhysicalPage->DecrementRefCount();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::MigratePage(PhysicalPage * const pPhysicalPage, PhysicalPage * const pTargetPage)
+{
+    //! A page referenced by anything but its mapping could still be accessed through the old frame.
+    if ((!pPhysicalPage->IsMovable()) || (1 != pPhysicalPage->GetMapCount()) || (1 != pPhysicalPage->GetRefCount()))
+        return false;
+
+    AddressSpace &addressSpace = *pPhysicalPage->m_reverseMapping.m_pAddressSpace;
+    const VirtualAddress virtualAddress = pPhysicalPage->m_reverseMapping.m_virtualAddress;
+
+    if (STATUS_CODE_SUCCESS != Vmm::Get().MigratePage(addressSpace, virtualAddress, pPhysicalPage->GetAddress(), pTargetPage->GetAddress()))
+        return false;
+
+    //! The target takes over the mapping along with its reference.
+    pTargetPage->IncrementRefCount();
+    SetReverseMapping(pTargetPage, addressSpace, virtualAddress);
+
+    ClearReverseMapping(pPhysicalPage);
+    pPhysicalPage->DecrementRefCount();
+
+    ++m_compactionCounters.m_nMigratedPages;
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::CompactMemory()
+{
+    //! Cached, pre-zeroed and colored pages can't coalesce, give them back first.
+    DrainPageCaches();
+    DrainZeroedPages();
+    DrainColoredPages();
+
+    size_t nMigratedPages = 0;
+    for (size_t node = 0; node < m_nNodes; ++node)
+    {
+        for (size_t zone = 0; zone < MAX_ZONES; ++zone)
+        {
+            //! Start a fresh pass over the whole zone.
+            Zone &compactedZone = m_nodes[node].m_zones[zone];
+            compactedZone.m_migrateScanPfn = compactedZone.m_freeScanPfn;
+
+            nMigratedPages += CompactZone(node, static_cast<ZoneType>(zone), MAX_ORDER, SIZE_MAX);
+        }
+    }
+
+    return nMigratedPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::CompactMemoryBackground()
+{
+    if (MAX_ORDER == m_compactionOrder)
+        return false;
+
+    bool isPending = false;
+    for (size_t node = 0; node < m_nNodes; ++node)
+    {
+        for (size_t zone = 0; zone < MAX_ZONES; ++zone)
+        {
+            const ZoneType zoneType = static_cast<ZoneType>(zone);
+
+            //! Below the threshold the zone is short on free memory rather than fragmented, compaction won't help.
+            if (GetFragmentationIndex(node, zoneType, m_compactionOrder) <= COMPACTION_THRESHOLD)
+                continue;
+
+            CompactZone(node, zoneType, m_compactionOrder, COMPACTION_BATCH);
+
+            const Zone &compactedZone = m_nodes[node].m_zones[zone];
+            if ((0 == GetFreeBlockCount(node, zoneType, m_compactionOrder)) && (compactedZone.m_migrateScanPfn < compactedZone.m_freeScanPfn))
+                isPending = true;
+        }
+    }
+
+    if (!isPending)
+        m_compactionOrder = MAX_ORDER;
+
+    return isPending;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::CompactZone(const uint8_t node, const ZoneType zoneType, const size_t order, const size_t nScanPages)
+{
+    //! The scanners walk the page descriptors directly, all of them have to be initialized.
+    while (InitializeDeferredSection(node, zoneType));
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    Zone &zone = m_nodes[node].m_zones[zoneType];
+    if (zone.m_migrateScanPfn >= zone.m_freeScanPfn)
+    {
+        //! The scanners only walk the part of the zone spanned by the node.
+        const size_t startPfn = m_nodes[node].m_startPfn;
+        const size_t endPfn = m_nodes[node].m_endPfn;
+
+        zone.m_migrateScanPfn = (GetZoneStartPfn(zoneType) > startPfn) ? GetZoneStartPfn(zoneType) : startPfn;
+        zone.m_freeScanPfn = (GetZoneEndPfn(zoneType) < endPfn) ? GetZoneEndPfn(zoneType) : endPfn;
+        ++m_compactionCounters.m_nPasses;
+    }
+
+    const size_t targetOrder = (order < MAX_ORDER) ? order : (MAX_ORDER - 1);
+    const size_t nFreeBlocks = GetFreeBlockCount(node, zoneType, targetOrder);
+
+    size_t nMigratedPages = 0;
+    size_t nScannedPages = 0;
+    while ((nScannedPages < nScanPages) && (zone.m_migrateScanPfn < zone.m_freeScanPfn))
+    {
+        if ((order < MAX_ORDER) && (0 < GetFreeBlockCount(node, zoneType, order)))
+            break;
+
+        const size_t pfn = zone.m_migrateScanPfn;
+        PhysicalPage * const pPhysicalPage = PfnToPage(pfn);
+        if (!pPhysicalPage)
+        {
+            //! Skip the hole up to the next section.
+            zone.m_migrateScanPfn = ALIGN((pfn + PAGES_PER_SECTION), (PAGES_PER_SECTION));
+            continue;
+        }
+
+        //! Free pages are only ever found at the head of a free block, skip the whole block.
+        const size_t nPages = pPhysicalPage->IsFree() ? (1UL << pPhysicalPage->GetOrder()) : 1;
+        zone.m_migrateScanPfn += nPages;
+        nScannedPages += nPages;
+
+        //! Other nodes may have pages within the span of the node.
+        if ((!pPhysicalPage->IsMovable()) || (GetNode(pPhysicalPage) != node))
+            continue;
+
+        PhysicalPage * const pTargetPage = TakeCompactionTarget(node, zoneType);
+        if (!pTargetPage)
+            break;
+
+        if (MigratePage(pPhysicalPage, pTargetPage))
+        {
+            ++nMigratedPages;
+        }
+        else
+        {
+            FreeBlock(pTargetPage, 0);
+            ++m_compactionCounters.m_nFailedPages;
+        }
+    }
+
+    //! The migrated pages were freed to the page cache, give them back to the buddy free lists to coalesce.
+    DrainPageCaches();
+
+    const size_t nCompactedFreeBlocks = GetFreeBlockCount(node, zoneType, targetOrder);
+    if (nCompactedFreeBlocks > nFreeBlocks)
+        m_compactionCounters.m_nRecoveredBlocks += nCompactedFreeBlocks - nFreeBlocks;
+
+    return nMigratedPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::TakeCompactionTarget(const uint8_t node, const ZoneType zoneType)
+{
+    Zone &zone = m_nodes[node].m_zones[zoneType];
+
+    while (zone.m_freeScanPfn > zone.m_migrateScanPfn)
+    {
+        const size_t pfn = zone.m_freeScanPfn - 1;
+        PhysicalPage * const pPhysicalPage = PfnToPage(pfn);
+        if (!pPhysicalPage)
+        {
+            //! Skip the hole down to the previous section.
+            zone.m_freeScanPfn = ALIGN((pfn), (PAGES_PER_SECTION));
+            continue;
+        }
+
+        zone.m_freeScanPfn = pfn;
+        if ((!FindFreeBlock(pPhysicalPage)) || (GetNode(pPhysicalPage) != node))
+            continue;
+
+        TakePageRun(pPhysicalPage, 1);
+        pPhysicalPage->SetOrder(0);
+
+        return pPhysicalPage;
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::SetMergeBatch(const size_t nPages)
+{
+    m_mergeBatch = nPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::MergePagesBackground()
+{
+    const uint64_t startTsc = CPU::ReadTsc();
+    if ((0 == m_mergeBatch) || (startTsc < m_nextMergeTsc))
+        return false;
+
+    const size_t nFullScans = m_mergeCounters.m_nFullScans;
+    MergePages(m_mergeBatch);
+
+    const uint64_t endTsc = CPU::ReadTsc();
+    m_mergeCounters.m_scanCycles += endTsc - startTsc;
+    m_nextMergeTsc = endTsc + MERGE_SCAN_INTERVAL;
+
+    if ((nFullScans == m_mergeCounters.m_nFullScans) || (m_mergeScanSavedPages == m_mergeCounters.m_nSavedPages))
+        return false;
+
+    m_mergeScanSavedPages = m_mergeCounters.m_nSavedPages;
+
+    return true;
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
-void MemoryPool::AddMemoryRegion(const MemoryRegion &memoryRegion)
+size_t MemoryPool::MergePages(const size_t nScanPages)
 {
-    //! Don't process addresses below the kernel physical start since they're memory mapped to something else.
-    PhysicalAddress pagePhysAddr(ALIGN_TO_NEXT_BOUNDARY(memoryRegion.m_addr.Get(), PAGE_SIZE));
+    const size_t nMemmapPages = m_nPresentSections * PAGES_PER_SECTION;
 
-    PhysicalPage *pPhysicalPage;
-    if(0 == m_poolSize)
+    size_t nMergedPages = 0;
+    for (size_t nScannedPages = 0; nScannedPages < nScanPages; ++nScannedPages)
     {
-        //! Set m_pPool to point right after the kernel text and data.
-        pPhysicalPage = static_cast<PhysicalPage *>(VirtualAddress(get_kmalloc_eternal_ptr()));
-        m_pPool = pPhysicalPage;
+        if (m_mergeScanIndex >= nMemmapPages)
+        {
+            //! The candidates may have changed or gone since they were hashed, every scan pairs pages up anew.
+            for (PhysicalPage *&pCandidatePage : m_pMergeCandidates)
+                pCandidatePage = nullptr;
+
+            m_mergeScanIndex = 0;
+            ++m_mergeCounters.m_nFullScans;
+        }
+
+        const size_t memmapIndex = m_mergeScanIndex;
+        if (!m_pInitializedMemmaps[memmapIndex >> SECTION_SHIFT])
+        {
+            //! Only free pages live in a memmap block which isn't initialized yet, skip the whole block.
+            m_mergeScanIndex = ALIGN((memmapIndex + PAGES_PER_SECTION), (PAGES_PER_SECTION));
+            continue;
+        }
 
-        //! Make sure the page for the PhysicalPage object is mapped.
-        Vmm::Get().EnsureKernelMapped(PhysicalAddress::Create(VirtualAddress(pPhysicalPage)).PageAddress(PAGE_2M),
-                                      VirtualAddress(pPhysicalPage).PageAddress(PAGE_2M),
-                                      (PRESENT | WRITABLE | HUGE_PAGE), PAGE_2M);
+        ++m_mergeScanIndex;
+        ++m_mergeCounters.m_nScannedPages;
+
+        if (MergePage(&m_pPool[memmapIndex]))
+            ++nMergedPages;
     }
-    else
+
+    return nMergedPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::MergePage(PhysicalPage * const pPhysicalPage)
+{
+    //! The scanner works on pages which are mapped and could be unmapped or migrated by an interrupt handler.
+    CPU::InterruptDisabler interruptDisabler;
+
+    //! A page referenced by anything but its mapping could still be accessed through the old frame, as for migration.
+    if ((!pPhysicalPage->IsMovable()) || (1 != pPhysicalPage->GetMapCount()) || (1 != pPhysicalPage->GetRefCount()))
+        return false;
+
+    const uint32_t hash = Vmm::Get().HashPhysicalPage(pPhysicalPage->GetAddress());
+    const uint16_t checksum = static_cast<uint16_t>(hash ^ (hash >> 16)) & PhysicalPage::m_checksumMask;
+
+    //! A page which changed since the previous scan is likely to change again, merging it would only cost a fault.
+    if (checksum != pPhysicalPage->GetChecksum())
     {
-        pPhysicalPage = &m_pPool[m_poolSize];
+        pPhysicalPage->SetChecksum(checksum);
+        return false;
     }
-    
-    const PhysicalAddress regionEnd(memoryRegion.m_addr.Get() + memoryRegion.m_size);
 
-    for (; pagePhysAddr < regionEnd; pagePhysAddr += PAGE_SIZE)
+    AddressSpace &addressSpace = *pPhysicalPage->m_reverseMapping.m_pAddressSpace;
+    const VirtualAddress virtualAddress = pPhysicalPage->m_reverseMapping.m_virtualAddress;
+    const size_t bucket = checksum & (MERGE_TABLE_SIZE - 1);
+
+    for (PhysicalPage *pMergedPage : m_mergedPages[bucket])
     {
-        //! Check whether the page for the next PhysicalPage object is mapped.
-        Vmm::Get().EnsureKernelMapped(PhysicalAddress::Create(VirtualAddress(pPhysicalPage + 1)).PageAddress(PAGE_2M),
-                                      VirtualAddress(pPhysicalPage + 1).PageAddress(PAGE_2M),
-                                      (PRESENT | WRITABLE | HUGE_PAGE), PAGE_2M);
+        //! The map count and the ref count of a merged page count its sharers, they must not wrap.
+        if ((pMergedPage->GetChecksum() != checksum) || (UINT16_MAX == pMergedPage->GetRefCount()))
+            continue;
 
-        // Placement new to reinitialize.
-        new (pPhysicalPage) PhysicalPage(pagePhysAddr);
-        ++m_poolSize;
-        m_freeList.push_back(pPhysicalPage);
+        const StatusCode statusCode = Vmm::Get().MergePage(addressSpace, virtualAddress, pPhysicalPage->GetAddress(),
+                                                           pMergedPage->GetAddress());
+        if (STATUS_CODE_SUCCESS == statusCode)
+        {
+            ShareMergedPage(pPhysicalPage, pMergedPage);
+            return true;
+        }
 
-        ++pPhysicalPage;
+        if (STATUS_CODE_NOT_FOUND == statusCode)
+            return false;
     }
+
+    //! A shared frame can't be migrated, the pages lent from the CMA region only ever merge into frames outside of it.
+    if (IsCmaPfn(PageToPfn(pPhysicalPage)))
+        return false;
+
+    //! The candidate may have been freed or reused since it was hashed, it has to be a movable page of the same checksum.
+    PhysicalPage * const pCandidatePage = m_pMergeCandidates[bucket];
+    m_pMergeCandidates[bucket] = pPhysicalPage;
+    if ((!pCandidatePage) || (pCandidatePage == pPhysicalPage) || (!pCandidatePage->IsMovable()) ||
+        (1 != pCandidatePage->GetMapCount()) || (1 != pCandidatePage->GetRefCount()) || (pCandidatePage->GetChecksum() != checksum) ||
+        (!Vmm::Get().ComparePhysicalPages(pPhysicalPage->GetAddress(), pCandidatePage->GetAddress())))
+        return false;
+
+    //! The candidate becomes the shared frame, the page is merged into it.
+    if (STATUS_CODE_SUCCESS != Vmm::Get().WriteProtectPage(*pCandidatePage->m_reverseMapping.m_pAddressSpace,
+                                                           pCandidatePage->m_reverseMapping.m_virtualAddress, pCandidatePage->GetAddress()))
+        return false;
+
+    m_pMergeCandidates[bucket] = nullptr;
+    AddMergedPage(pCandidatePage);
+
+    if (STATUS_CODE_SUCCESS != Vmm::Get().MergePage(addressSpace, virtualAddress, pPhysicalPage->GetAddress(), pCandidatePage->GetAddress()))
+        return false;
+
+    ShareMergedPage(pPhysicalPage, pCandidatePage);
+
+    return true;
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
-const PhysicalPage *MemoryPool::AllocatePage()
+void MemoryPool::AddMergedPage(PhysicalPage * const pPhysicalPage)
 {
-    PhysicalPage *pPhysicalPage = m_freeList.pop_back();
-    ASSERT(pPhysicalPage);
+    ASSERT(pPhysicalPage->IsMovable());
 
-    pPhysicalPage->IncrementRefCount();
+    //! The mapping stays, its share is the map count and the reference the page already has.
+    pPhysicalPage->SetMovable(false);
+    pPhysicalPage->SetMerged(true);
+    m_mergedPages[pPhysicalPage->GetChecksum() & (MERGE_TABLE_SIZE - 1)].push_back(pPhysicalPage);
 
-    return pPhysicalPage;
+    ++m_mergeCounters.m_nMergedFrames;
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
-MemoryPool::PhysicalRange MemoryPool::AllocateRange(const size_t nPages)
+void MemoryPool::RemoveMergedPage(PhysicalPage * const pPhysicalPage)
 {
-    for (PhysicalPage &physicalPage : Range(m_pPool, m_poolSize))
-    {
-        bool isContiguous = false;
-        for (size_t nPage = 0; nPage < nPages; ++nPage)
-        {
-            PhysicalPage *pPhysicalPage = &physicalPage + nPage;
-            if (pPhysicalPage->m_freeListHook.in_list)
-            {
-                isContiguous = false;
-                break;
-            }
-            else
-            {
-                isContiguous = true;
-            }
-        }
+    ASSERT(pPhysicalPage->IsMerged());
 
-        if (isContiguous)
-        {
-            PhysicalRange physicalRange(&physicalPage, nPages);
+    m_mergedPages[pPhysicalPage->GetChecksum() & (MERGE_TABLE_SIZE - 1)].erase(pPhysicalPage);
+    pPhysicalPage->SetMerged(false);
 
-            return physicalRange;
-        }
-    }
+    --m_mergeCounters.m_nMergedFrames;
+}
 
-    return PhysicalRange(nullptr, 0);
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::ShareMergedPage(PhysicalPage * const pPhysicalPage, PhysicalPage * const pMergedPage)
+{
+    //! The shared frame takes over the mapping along with its reference.
+    pMergedPage->IncrementRefCount();
+    pMergedPage->IncrementMapCount();
+
+    ClearReverseMapping(pPhysicalPage);
+    pPhysicalPage->DecrementRefCount();
+
+    ++m_mergeCounters.m_nMergedPages;
+    ++m_mergeCounters.m_nSavedPages;
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
-MemoryPool::PhysicalRange MemoryPool::AllocateRange(const PhysicalAddress physicalAddress, const size_t nPages)
+void MemoryPool::DropMergedMapping(PhysicalPage * const pMergedPage)
 {
-    PhysicalPage * const pPhysicalPage = const_cast<PhysicalPage *>(FindPhysicalPage(physicalAddress));
+    ASSERT(pMergedPage->IsMerged());
 
-    PhysicalRange physicalRange(pPhysicalPage, nPages);
+    //! Only the sharers beyond the first save a page.
+    if (0 < pMergedPage->DecrementMapCount())
+        --m_mergeCounters.m_nSavedPages;
+}
 
-    return physicalRange;
+// ---------------------------------------------------------------------------------------------------------
+
+bool MemoryPool::IsMergedPageShared(const PhysicalAddress physicalAddress)
+{
+    const PhysicalPage * const pPhysicalPage = FindPhysicalPage(physicalAddress);
+    ASSERT(pPhysicalPage->IsMerged());
+
+    return (1 < pPhysicalPage->GetMapCount());
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
-void MemoryPool::InitializePhysicalRange(PhysicalRange &physicalRange)
+void MemoryPool::UnmergePage(const PhysicalAddress sharedAddress, PhysicalPage * const pPhysicalPage, AddressSpace &addressSpace,
+    const VirtualAddress &virtualAddress)
 {
     //! Safe to const cast because we know the page came from the pool.
-    for (const PhysicalPage &physicalPage : Range(physicalRange.m_pPhysicalPage, physicalRange.m_nPages))
+    PhysicalPage * const pMergedPage = const_cast<PhysicalPage *>(FindPhysicalPage(sharedAddress));
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    ++m_mergeCounters.m_nBrokenPages;
+    DropMergedMapping(pMergedPage);
+
+    //! The last sharer keeps the frame with its reference, the page is movable again.
+    if (!pPhysicalPage)
+    {
+        ASSERT(0 == pMergedPage->GetMapCount());
+
+        RemoveMergedPage(pMergedPage);
+        SetReverseMapping(pMergedPage, addressSpace, virtualAddress);
+        return;
+    }
+
+    SetReverseMapping(pPhysicalPage, addressSpace, virtualAddress);
+    pMergedPage->DecrementRefCount();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t MemoryPool::GetFreeBlockCount(const uint8_t node, const ZoneType zoneType, const size_t order) const
+{
+    const size_t firstNode = (MAX_NODES == node) ? 0 : node;
+    const size_t endNode = (MAX_NODES == node) ? m_nNodes : (node + 1);
+
+    size_t nFreeBlocks = 0;
+    for (const Node &currentNode : Range(m_nodes + firstNode, endNode - firstNode))
+    {
+        for (size_t currentOrder = order; currentOrder < MAX_ORDER; ++currentOrder)
+            nFreeBlocks += currentNode.m_zones[zoneType].m_freeAreas[currentOrder].m_nFreeBlocks;
+    }
+
+    return nFreeBlocks;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+int32_t MemoryPool::GetFragmentationIndex(const uint8_t node, const ZoneType zoneType, const size_t order) const
+{
+    size_t nFreePages = 0;
+    size_t nFreeBlocks = 0;
+    for (size_t currentOrder = 0; currentOrder < MAX_ORDER; ++currentOrder)
     {
-        PhysicalPage &tempPageReference = const_cast<PhysicalPage &>(physicalPage);
-        tempPageReference.IncrementRefCount();
-        if (tempPageReference.m_freeListHook.in_list)
-            m_freeList.erase(&tempPageReference);
+        const size_t nOrderFreeBlocks = GetFreeBlockCount(node, zoneType, currentOrder) - GetFreeBlockCount(node, zoneType, currentOrder + 1);
+        nFreeBlocks += nOrderFreeBlocks;
+        nFreePages += (nOrderFreeBlocks << currentOrder);
     }
+
+    if (0 == nFreeBlocks)
+        return 0;
+
+    if (0 < GetFreeBlockCount(node, zoneType, order))
+        return -1000;
+
+    //! The index nears 1000 as the free memory which could satisfy the order is spread over more and more blocks.
+    return 1000 - static_cast<int32_t>((1000 + ((nFreePages * 1000) >> order)) / nFreeBlocks);
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -152,23 +2184,356 @@ void MemoryPool::ReturnPage(const PhysicalAddress pageAddress)
 
 // ---------------------------------------------------------------------------------------------------------
 
+void MemoryPool::ReturnPages(const PhysicalPage * const *ppPages, const size_t nPages)
+{
+    //! Keep interrupts off for the whole batch rather than for every freed page.
+    CPU::InterruptDisabler interruptDisabler;
+
+    for (const PhysicalPage * const pPhysicalPage : Range(ppPages, nPages))
+        ReturnPage(pPhysicalPage);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 void MemoryPool::ReturnRange(MemoryPool::PhysicalRange &physicalRange)
 {
-    for (const PhysicalPage &physicalPage : Range(physicalRange.m_pPhysicalPage, physicalRange.m_nPages))
-        ReturnPage(&physicalPage);
+    //! The head holds the reference of the whole range.
+    ReturnPage(physicalRange.m_pPhysicalPage);
 
     physicalRange.Clear();
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
-const PhysicalPage *MemoryPool::FindPhysicalPage(const PhysicalAddress pageAddress)
+void MemoryPool::FreePage(PhysicalPage * const pPhysicalPage)
+{
+    ASSERT(0 == pPhysicalPage->GetRefCount());
+
+    //! A movable page has to be unmapped first, its reverse mapping overlays the free list hook.
+    ASSERT(!pPhysicalPage->IsMovable());
+
+    //! The last reference of a range is gone, the range no longer holds its pages together.
+    size_t nRangePages = 0;
+    if (pPhysicalPage->IsRangeHead())
+    {
+        nRangePages = pPhysicalPage->GetRangePages();
+        pPhysicalPage->SetRangeHead(false);
+    }
+
+    //! Pages in the holes of a section aren't backed by memory, keep them out of the free lists. The pages of a range
+    //! reserved by AllocateRange stay reserved as well, they are given to the buddy allocator by ReleasePageRun.
+    if (pPhysicalPage->IsReserved())
+        return;
+
+    //! A range goes straight back to the free lists as whole blocks, it would only flood the page caches.
+    if (0 < nRangePages)
+    {
+        CPU::InterruptDisabler interruptDisabler;
+
+        FreePageRun(pPhysicalPage, nRangePages);
+        return;
+    }
+
+    //! A huge page is only ever referenced through its head page and goes back to its pool as a whole.
+    if (HUGE_PAGE_NONE != pPhysicalPage->GetHugePageSize())
+    {
+        FreeHugePage(pPhysicalPage);
+        return;
+    }
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    //! The last sharer of a merged page is gone, take it out of the merge table.
+    if (pPhysicalPage->IsMerged())
+        RemoveMergedPage(pPhysicalPage);
+
+    //! The pages of the CMA region bypass the page caches, the caches serve allocations which can't move. The single
+    //! pages of the region are only ever lent ones, its ranges are freed as a whole above.
+    if (IsCmaPfn(PageToPfn(pPhysicalPage)))
+    {
+        FreeBlock(pPhysicalPage, 0);
+        --m_cmaCounters.m_nLentPages;
+        return;
+    }
+
+    //! The page caches only hold local pages, a remote page goes straight back to the free lists of its node.
+    if (GetNode(pPhysicalPage) != GetLocalNode())
+    {
+        FreeBlock(pPhysicalPage, 0);
+        return;
+    }
+
+    //! The freed page is likely cache hot, put it on the hot end.
+    PageCache &pageCache = m_pageCaches[CPU::GetCpuIndex()][GetZoneType(PageToPfn(pPhysicalPage))];
+    pageCache.m_freeList.push_front(pPhysicalPage);
+    ++pageCache.m_nPages;
+    AccountPages(pPhysicalPage, &PageCounters::m_nCachedPages, 1);
+
+    if (pageCache.m_nPages > PAGE_CACHE_HIGH)
+        DrainPageCache(pageCache, PAGE_CACHE_BATCH);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::RefillPageCache(PageCache &pageCache, const uint8_t node, const ZoneType zoneType, const AllocationFlags allocationFlags)
+{
+    for (size_t pageIndex = 0; pageIndex < PAGE_CACHE_BATCH; ++pageIndex)
+    {
+        PhysicalPage * const pPhysicalPage = AllocateBlock(0, node, zoneType, allocationFlags);
+        if (!pPhysicalPage)
+            break;
+
+        pageCache.m_freeList.push_back(pPhysicalPage);
+        ++pageCache.m_nPages;
+        AccountPages(pPhysicalPage, &PageCounters::m_nCachedPages, 1);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::DrainPageCache(PageCache &pageCache, const size_t nPages)
+{
+    for (size_t pageIndex = 0; (pageIndex < nPages) && (!pageCache.m_freeList.empty()); ++pageIndex)
+    {
+        PhysicalPage * const pPhysicalPage = pageCache.m_freeList.pop_back();
+        --pageCache.m_nPages;
+        AccountPages(pPhysicalPage, &PageCounters::m_nCachedPages, -1);
+
+        FreeBlock(pPhysicalPage, 0);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::DrainPageCaches()
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    for (PageCache (&pageCaches)[MAX_ZONES] : m_pageCaches)
+    {
+        for (PageCache &pageCache : pageCaches)
+            DrainPageCache(pageCache, pageCache.m_nPages);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::AllocateBlock(const size_t order, const uint8_t node, const ZoneType zoneType,
+    const AllocationFlags allocationFlags)
+{
+    //! When the free lists run dry the next deferred memmap block of the zone is initialized and the lookup retried.
+    //! That's a whole section of descriptors with interrupts off, an atomic allocation goes to the atomic reserve instead.
+    do
+    {
+        PhysicalPage * const pPhysicalPage = AllocateBlock(order, m_nodes[node].m_zones[zoneType].m_freeAreas);
+        if (pPhysicalPage)
+            return pPhysicalPage;
+    } while ((!(allocationFlags & ALLOC_ATOMIC)) && InitializeDeferredSection(node, zoneType));
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::AllocateBlock(const size_t order, FreeArea * const pFreeAreas)
+{
+    for (size_t currentOrder = order; currentOrder < MAX_ORDER; ++currentOrder)
+    {
+        FreeArea &freeArea = pFreeAreas[currentOrder];
+        if (freeArea.m_freeList.empty())
+            continue;
+
+        PhysicalPage * const pPhysicalPage = freeArea.m_freeList.back();
+        RemoveFreeBlock(pPhysicalPage);
+
+        //! Split the block, the upper halves go back to the lower order free lists.
+        while (currentOrder > order)
+        {
+            --currentOrder;
+            AddFreeBlock(pPhysicalPage + (1UL << currentOrder), currentOrder);
+        }
+
+        pPhysicalPage->SetOrder(order);
+
+        return pPhysicalPage;
+    }
+
+    return nullptr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::FreeBlock(PhysicalPage *pPhysicalPage, size_t order)
+{
+    ASSERT(!pPhysicalPage->IsFree());
+
+    while (order < (MAX_ORDER - 1))
+    {
+        //! Blocks don't span memory regions so that the pages of a free block are accounted to a single region.
+        PhysicalPage * const pBuddy = GetBuddy(pPhysicalPage, order);
+        if ((!pBuddy->IsFree()) || (pBuddy->GetOrder() != order) || (pBuddy->GetRegion() != pPhysicalPage->GetRegion()))
+            break;
+
+        RemoveFreeBlock(pBuddy);
+
+        //! The merged block starts at the lower of the two buddies.
+        if (pBuddy < pPhysicalPage)
+            pPhysicalPage = pBuddy;
+
+        ++order;
+    }
+
+    AddFreeBlock(pPhysicalPage, order);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::AddFreeBlock(PhysicalPage * const pPhysicalPage, const size_t order)
+{
+    const size_t nPages = (1UL << order);
+
+    pPhysicalPage->SetOrder(order);
+    pPhysicalPage->SetFree(true);
+
+    FreeArea &freeArea = GetFreeArea(pPhysicalPage, order);
+    freeArea.m_freeList.push_back(pPhysicalPage);
+    ++freeArea.m_nFreeBlocks;
+
+    AccountPages(pPhysicalPage, IsCmaPfn(PageToPfn(pPhysicalPage)) ? &PageCounters::m_nCmaPages : &PageCounters::m_nFreePages, nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::RemoveFreeBlock(PhysicalPage * const pPhysicalPage)
+{
+    const size_t nPages = (1UL << pPhysicalPage->GetOrder());
+
+    FreeArea &freeArea = GetFreeArea(pPhysicalPage, pPhysicalPage->GetOrder());
+    freeArea.m_freeList.erase(pPhysicalPage);
+    --freeArea.m_nFreeBlocks;
+
+    pPhysicalPage->SetFree(false);
+    pPhysicalPage->SetReported(false);
+
+    AccountPages(pPhysicalPage, IsCmaPfn(PageToPfn(pPhysicalPage)) ? &PageCounters::m_nCmaPages : &PageCounters::m_nFreePages,
+                 -static_cast<int64_t>(nPages));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+MemoryPool::FreeArea &MemoryPool::GetFreeArea(const PhysicalPage * const pPhysicalPage, const size_t order)
+{
+    const size_t pfn = PageToPfn(pPhysicalPage);
+    if (IsCmaPfn(pfn))
+        return m_cmaFreeAreas[order];
+
+    return m_nodes[GetNode(pPhysicalPage)].m_zones[GetZoneType(pfn)].m_freeAreas[order];
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::AccountPages(const PhysicalPage * const pPhysicalPage, size_t PageCounters::* const pCounter, const int64_t nPages)
+{
+    Node &node = m_nodes[GetNode(pPhysicalPage)];
+
+    m_counters.*pCounter += nPages;
+    node.m_counters.*pCounter += nPages;
+    node.m_zones[GetZoneType(PageToPfn(pPhysicalPage))].m_counters.*pCounter += nPages;
+    m_memoryRegions[pPhysicalPage->GetRegion()].m_counters.*pCounter += nPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::AccountPageRun(const size_t regionIndex, size_t pfn, size_t PageCounters::* const pCounter, const int64_t nPages)
+{
+    const int64_t sign = (nPages < 0) ? -1 : 1;
+    size_t nRemainingPages = static_cast<size_t>(sign * nPages);
+    Node &node = m_nodes[m_memoryRegions[regionIndex].m_node];
+
+    //! Split the run at the zone boundaries.
+    while (0 < nRemainingPages)
+    {
+        const ZoneType zoneType = GetZoneType(pfn);
+        size_t nZonePages = GetZoneEndPfn(zoneType) - pfn;
+        if (nZonePages > nRemainingPages)
+            nZonePages = nRemainingPages;
+
+        const int64_t delta = sign * static_cast<int64_t>(nZonePages);
+        m_counters.*pCounter += delta;
+        node.m_counters.*pCounter += delta;
+        node.m_zones[zoneType].m_counters.*pCounter += delta;
+        m_memoryRegions[regionIndex].m_counters.*pCounter += delta;
+
+        pfn += nZonePages;
+        nRemainingPages -= nZonePages;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::FreePageRun(PhysicalPage *pPhysicalPage, size_t nPages)
+{
+    while (0 < nPages)
+    {
+        //! The largest block which is naturally aligned at the current page and still fits in the run.
+        const size_t pfn = PageToPfn(pPhysicalPage);
+        size_t order = (pfn) ? __builtin_ctzl(pfn) : (MAX_ORDER - 1);
+        if (order > (MAX_ORDER - 1))
+            order = (MAX_ORDER - 1);
+
+        while ((1UL << order) > nPages)
+            --order;
+
+        FreeBlock(pPhysicalPage, order);
+
+        pPhysicalPage += (1UL << order);
+        nPages -= (1UL << order);
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void MemoryPool::TakePageRun(PhysicalPage *pPhysicalPage, const size_t nPages)
+{
+    PhysicalPage * const pRunEnd = pPhysicalPage + nPages;
+
+    while (pPhysicalPage < pRunEnd)
+    {
+        PhysicalPage * const pBlock = FindFreeBlock(pPhysicalPage);
+        if (!pBlock)
+        {
+            ++pPhysicalPage;
+            continue;
+        }
+
+        PhysicalPage * const pBlockEnd = pBlock + (1UL << pBlock->GetOrder());
+
+        RemoveFreeBlock(pBlock);
+        pBlock->SetOrder(0);
+
+        //! Give back the parts of the block outside of the run.
+        if (pBlock < pPhysicalPage)
+            FreePageRun(pBlock, pPhysicalPage - pBlock);
+
+        if (pBlockEnd > pRunEnd)
+            FreePageRun(pRunEnd, pBlockEnd - pRunEnd);
+
+        pPhysicalPage = pBlockEnd;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalPage *MemoryPool::FindFreeBlock(PhysicalPage * const pPhysicalPage)
 {
-    // TODO: Optimize with binary search or smth.
-    for (PhysicalPage &physicalPage : Range(m_pPool, m_poolSize))
+    const size_t pfn = PageToPfn(pPhysicalPage);
+
+    //! Buddy blocks are naturally aligned and never cross a section, so the block head is in the same memmap block.
+    for (size_t order = 0; order < MAX_ORDER; ++order)
     {
-        if (physicalPage.m_addr == pageAddress.PageAddress(PAGE_SIZE))
-            return &physicalPage;
+        PhysicalPage * const pBlock = pPhysicalPage - (pfn & ((1UL << order) - 1));
+        if (pBlock->IsFree() && (pBlock->GetOrder() >= order))
+            return pBlock;
     }
 
     return nullptr;
@@ -176,6 +2541,21 @@ const PhysicalPage *MemoryPool::FindPhysicalPage(const PhysicalAddress pageAddre
 
 // ---------------------------------------------------------------------------------------------------------
 
+PhysicalPage *MemoryPool::GetBuddy(PhysicalPage * const pPhysicalPage, const size_t order)
+{
+    //! The buddy is always in the same section, pages in holes are reserved and never free so they never coalesce.
+    return PfnToPage(PageToPfn(pPhysicalPage) ^ (1UL << order));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+const PhysicalPage *MemoryPool::FindPhysicalPage(const PhysicalAddress pageAddress)
+{
+    return PfnToPage(pageAddress.Get() / PAGE_SIZE);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 const RefPtr<PhysicalPage> MemoryPool::GetPhysicalPage(const PhysicalAddress pageAddress)
 {
     //! Safe to const cast because we know the page came from the pool.
@@ -5,9 +5,13 @@
 #include "Libraries/Misc/RefPtr.h"
 #include "Libraries/Misc/Range.h"
 
+#include "Kernel/Arch/x86_64/CPU.h"
+
 #include "frg/list.hpp"
 
+#include "NumaTopology.h"
 #include "PhysicalPage.h"
+#include "Shrinker.h"
 
 namespace BartOS
 {
@@ -18,13 +22,244 @@ namespace MM
 //! Forward declare the pmm and vmm.
 class Pmm;
 class Vmm;
+class AddressSpace;
+class MemoryBenchmark;
 
 /*
  *  @brief The physical memory pool.
+ *
+ *  Free pages are kept in a binary buddy allocator. A free block of order N is 2^N physically contiguous,
+ *  2^N page aligned pages and is represented by its first (head) page on the free list of that order.
+ *
+ *  The page descriptors (memmap) are indexed by page frame number. Physical memory is split into sections of
+ *  PAGES_PER_SECTION pages and only sections which contain usable memory get a memmap block, so the holes
+ *  between memory regions cost nothing. Memmap blocks are laid out in ascending section order, which keeps
+ *  the descriptors of physically contiguous pages contiguous as well.
+ *
+ *  Only the first BOOT_MEMMAP_SECTIONS memmap blocks are initialized during boot. The remaining blocks are
+ *  initialized one section at a time, when the free lists run dry or from the idle loop, so boot time doesn't
+ *  grow with the amount of memory.
+ *
+ *  Reclaimable regions hold data the firmware and the bootloader hand over, such as the ACPI tables. Their pages
+ *  stay reserved until ReleasePageRun gives them to the buddy allocator once boot no longer needs the data.
+ *
+ *  Physical memory is partitioned into zones by address. Every zone has its own buddy free lists, page caches
+ *  and counters. Allocations are served from the highest zone they allow and fall back to the lower zones,
+ *  so ordinary allocations only take the scarce low memory once the higher zones are exhausted.
+ *
+ *  On NUMA machines every node has its own set of zones. Memory regions are split at the node boundaries, so a page
+ *  belongs to the node of its region and buddy blocks never span nodes. Allocations are served from the node of the
+ *  allocating CPU first and fall back to the other nodes by distance, each node from its highest allowed zone down.
+ *  The per-CPU page caches only hold pages of the local node, remote pages are freed straight to their free lists.
+ *  The memmap is not spread over the nodes, the descriptors of every node live in the kmalloc eternal arena next to
+ *  the kernel image. It is allocated before the direct map exists, the direct map's page tables come from the pool it
+ *  describes, and the scans and page runs rely on the descriptors of consecutive sections being contiguous.
+ *
+ *  Colored allocations spread their pages over the sets of the last level cache. A page's color is its pfn modulo the
+ *  number of pages in a cache way. Every zone keeps a free list per color, refilled with naturally aligned blocks which
+ *  hold a page of every color, and every CPU hands out the colors round robin.
+ *
+ *  Every zone but ZONE_DMA keeps a pool of pre-zeroed pages, refilled from the idle loop with non-temporal
+ *  stores. Zeroed allocations are served from it, other allocations only use it once the zone is exhausted.
+ *
+ *  Physically contiguous, naturally aligned 2 MiB and 1 GiB frames can be reserved into huge page pools at boot
+ *  and resized at runtime. A reserved frame is off the buddy free lists and is allocated and freed in O(1).
+ *
+ *  Pages mapped through Vmm::MapMovablePage are movable: their single mapping is recorded in the page descriptor
+ *  so that the page can be migrated to another frame. Compaction migrates movable pages from the bottom of a zone
+ *  to free pages at its top until a free block of the wanted order forms, on demand or from the idle loop after
+ *  a contiguous allocation failed.
+ *
+ *  Under a hypervisor, the balloon takes pages out of the pool for the host and gives them back on request. Large
+ *  free blocks are also reported to the host, which discards their contents. A reported block is put back at the
+ *  front of its free list, so it is handed out last and not reported again until it is allocated or merged.
+ *
+ *  Same-page merging is opt-in. A background scanner hashes the movable pages, a page whose hash matches a merged
+ *  frame or another page of the same scan is compared in full and remapped read-only to a single shared frame.
+ *  The candidates of a scan are dropped when the next one starts, only the merged frames are kept across scans.
+ *  A write to a merged page faults and gives the mapping a private copy again.
+ *
+ *  A CMA region of whole max order blocks is set aside at boot for large physically contiguous allocations. Its free
+ *  blocks are kept on free lists of their own and don't count against the watermarks. Until a contiguous allocation
+ *  needs them they are lent to movable allocations once the zones run low, a contiguous allocation which finds nothing
+ *  else migrates the lent pages of a run out of the region and takes the run.
+ *
+ *  Every zone has min, low and high watermarks of free pages. Allocations are served above the low watermark first.
+ *  Below it reclaim is started from the idle loop and the allocation may take the zone down to the min watermark,
+ *  below that it drains the page caches and calls the registered shrinkers before it fails. Background reclaim
+ *  shrinks the caches until every zone is back above its high watermark.
+ *
+ *  Single pages are allocated from and freed to a per-CPU page cache in front of the buddy allocator.
+ *  The cache is refilled from and drained to the buddy free lists in batches. Freed pages are put on the
+ *  hot end of the cache, cold allocations are served from the other end.
  */
 class MemoryPool
 {
 public:
+    static constexpr size_t MAX_ORDER = 11;             ///< The number of buddy orders, the largest block is 2^(MAX_ORDER - 1) pages.
+    static constexpr size_t MAX_MEMORY_REGIONS = 32;    ///< The maximum number of memory regions.
+    static constexpr size_t SECTION_SHIFT = 15;         ///< The log2 of the number of pages in a memmap section (128 MiB).
+    static constexpr size_t PAGES_PER_SECTION = (1UL << SECTION_SHIFT);    ///< The number of pages in a memmap section.
+    static constexpr size_t BOOT_MEMMAP_SECTIONS = 1;   ///< The number of memmap blocks initialized during boot.
+    static constexpr size_t MAX_NODES = NumaTopology::MAX_NODES;           ///< The maximum number of NUMA nodes.
+    static constexpr size_t MAX_PAGE_COLORS = 256;      ///< The maximum number of cache colors.
+
+    //! The memory zones, a page belongs to a zone depending on its physical address.
+    enum ZoneType : uint8_t
+    {
+        ZONE_DMA,       ///< Memory below 16 MiB, reachable by ISA DMA.
+        ZONE_DMA32,     ///< Memory below 4 GiB, reachable by 32-bit DMA.
+        ZONE_NORMAL,    ///< The rest of the memory.
+        MAX_ZONES
+    };
+
+    //! The huge page sizes with a reserved pool.
+    enum HugePageSize : uint8_t
+    {
+        HUGE_PAGE_NONE,     ///< Not a huge page.
+        HUGE_PAGE_2M,       ///< 2 MiB huge pages.
+        HUGE_PAGE_1G,       ///< 1 GiB huge pages.
+        MAX_HUGE_PAGE_SIZES
+    };
+
+    //! The watermarks of free pages of a zone.
+    enum Watermark : uint8_t
+    {
+        WATERMARK_MIN,      ///< Below it allocations reclaim directly.
+        WATERMARK_LOW,      ///< Below it background reclaim starts.
+        WATERMARK_HIGH,     ///< Background reclaim stops above it.
+        MAX_WATERMARKS
+    };
+
+    static constexpr size_t ZONE_DMA_END_PFN = ((16UL * MiB) / PAGE_SIZE);     ///< The first pfn after ZONE_DMA.
+    static constexpr size_t ZONE_DMA32_END_PFN = ((4UL * GiB) / PAGE_SIZE);    ///< The first pfn after ZONE_DMA32.
+    static constexpr size_t PAGE_CACHE_BATCH = 32;                              ///< The number of pages moved between a page cache and the free lists at once.
+    static constexpr size_t PAGE_CACHE_HIGH = (6 * PAGE_CACHE_BATCH);           ///< The page cache high watermark, a batch is drained above it.
+    static constexpr size_t ZEROED_PAGES_BATCH = 32;                            ///< The number of pages zeroed per zone by a single idle refill.
+    static constexpr size_t ZEROED_PAGES_HIGH = 256;                            ///< The number of pre-zeroed pages kept per zone.
+    static constexpr size_t ATOMIC_RESERVE_PAGES = 64;                          ///< The number of pages held back per zone for atomic allocations.
+    static constexpr size_t COMPACTION_BATCH = 1024;                            ///< The number of pages the migration scanner walks per idle compaction step.
+    static constexpr int32_t COMPACTION_THRESHOLD = 500;                        ///< The fragmentation index above which a failure is worth compacting for.
+    static constexpr size_t WATERMARK_MIN_SHIFT = 8;                            ///< The min watermark of a zone is its managed pages shifted right by it.
+    static constexpr size_t RECLAIM_BATCH = 32;                                 ///< The number of pages a single reclaim call tries to free.
+    static constexpr size_t RECLAIM_PRIORITY = 4;                               ///< The first reclaim pass scans the objects of a shrinker shifted right by it.
+    static constexpr size_t MERGE_TABLE_SIZE = 1024;                            ///< The number of hash buckets of the merged frames and of the merge candidates.
+    static constexpr uint64_t MERGE_SCAN_INTERVAL = (1UL << 26);                ///< The TSC cycles between two batches of the merge scanner.
+
+    /*
+     *  @brief The page counters of the pool or a part of it.
+     *  Kept up to date by the allocation and free paths.
+     */
+    class PageCounters
+    {
+    public:
+        //! Constructor
+        PageCounters();
+
+        size_t m_nPages;            ///< The number of usable pages.
+        size_t m_nFreePages;        ///< The number of pages in the buddy free lists.
+        size_t m_nReservedPages;    ///< The number of pages reserved at boot.
+        size_t m_nCachedPages;      ///< The number of free pages in the per-CPU page caches.
+        size_t m_nDeferredPages;    ///< The number of usable pages in memmap blocks which aren't initialized yet.
+        size_t m_nZeroedPages;      ///< The number of free pages in the pre-zeroed page pools.
+        size_t m_nColoredPages;     ///< The number of free pages in the cache color lists.
+        size_t m_nCmaPages;         ///< The number of free pages in the CMA region, only movable and contiguous allocations take them.
+        size_t m_nAtomicPages;      ///< The number of free pages in the atomic reserves, only atomic allocations take them.
+    };
+
+    /*
+     *  @brief The compaction counters, accumulated over all compaction passes.
+     */
+    class CompactionCounters
+    {
+    public:
+        //! Constructor
+        CompactionCounters();
+
+        size_t m_nPasses;           ///< The number of compaction passes started over a zone.
+        size_t m_nMigratedPages;    ///< The number of pages migrated.
+        size_t m_nFailedPages;      ///< The number of movable pages which couldn't be migrated.
+        size_t m_nRecoveredBlocks;  ///< The number of free blocks of the requested order assembled by compaction.
+    };
+
+    /*
+     *  @brief The reclaim counters, accumulated over all reclaim calls.
+     */
+    class ReclaimCounters
+    {
+    public:
+        //! Constructor
+        ReclaimCounters();
+
+        size_t m_nDirectReclaims;       ///< The number of allocations which had to reclaim directly.
+        size_t m_nBackgroundReclaims;   ///< The number of background reclaim steps run from the idle loop.
+        size_t m_nReclaimedPages;       ///< The number of pages the shrinkers gave back.
+        size_t m_nFreedObjects;         ///< The number of objects the shrinkers freed.
+    };
+
+    /*
+     *  @brief The same-page merging counters.
+     */
+    class MergeCounters
+    {
+    public:
+        //! Constructor
+        MergeCounters();
+
+        size_t m_nScannedPages;     ///< The number of pages the scanner visited.
+        size_t m_nFullScans;        ///< The number of completed scans over the whole memmap.
+        uint64_t m_scanCycles;      ///< The TSC cycles spent scanning.
+        size_t m_nMergedFrames;     ///< The number of frames currently shared by merged pages.
+        size_t m_nSavedPages;       ///< The number of pages currently saved, the sharers of the merged frames beyond the first.
+        size_t m_nMergedPages;      ///< The number of pages merged into a shared frame.
+        size_t m_nBrokenPages;      ///< The number of merged pages which got a private copy back on a write.
+    };
+
+    /*
+     *  @brief The CMA region counters.
+     */
+    class CmaCounters
+    {
+    public:
+        //! Constructor
+        CmaCounters();
+
+        size_t m_nPages;            ///< The number of pages in the CMA region, 0 without a region.
+        size_t m_nLentPages;        ///< The number of movable pages lent from the region and not freed or migrated out yet.
+        size_t m_nRanges;           ///< The number of contiguous ranges allocated from the region.
+        size_t m_nMigratedPages;    ///< The number of lent pages migrated out of the region for a contiguous range.
+        size_t m_nFailedRanges;     ///< The number of contiguous allocations the region couldn't serve.
+    };
+
+    /*
+     *  @brief The atomic allocation counters.
+     */
+    class AtomicCounters
+    {
+    public:
+        //! Constructor
+        AtomicCounters();
+
+        size_t m_nAllocations;      ///< The number of atomic allocation calls.
+        size_t m_nReservePages;     ///< The number of pages atomic allocations took from the reserves.
+        size_t m_nFailedPages;      ///< The number of pages atomic allocations couldn't get.
+        size_t m_nRefilledPages;    ///< The number of pages put back into the reserves by the idle refill.
+    };
+
+    /*
+     *  @brief The NUMA allocation counters of a node.
+     */
+    class NumaCounters
+    {
+    public:
+        //! Constructor
+        NumaCounters();
+
+        size_t m_nHits;             ///< The number of pages allocated from the node by its own CPUs.
+        size_t m_nMisses;           ///< The number of pages allocated from the node by CPUs of another node.
+        size_t m_nForeign;          ///< The number of pages the node's CPUs had to allocate from another node.
+    };
+
     /*
      *  @brief The physical memory region.
      */
@@ -34,12 +269,19 @@ public:
         //! Constructor
         MemoryRegion();
 
-        PhysicalAddress m_addr;     ///< The physical address of the region.
-        size_t          m_size;     ///< The size of the region.
+        PhysicalAddress m_addr;             ///< The physical address of the region.
+        size_t          m_size;             ///< The size of the region.
+        PhysicalPage    *m_pPages;          ///< The first page of the region in the pool.
+        size_t          m_nPages;           ///< The number of pages in the region.
+        PageCounters    m_counters;         ///< The page counters of the region.
+        uint8_t         m_node;             ///< The NUMA node of the region.
+        bool            m_isReclaimable;    ///< Whether the region holds boot data, its pages stay reserved until they are released.
     };
 
     /*
      *  @brief The physical memory range.
+     *  The range is referenced through the ref count of its head page only, so acquiring, copying and
+     *  returning it doesn't depend on its size. The last reference frees the whole range.
      */
     class PhysicalRange
     {
@@ -117,6 +359,87 @@ public:
         friend Vmm;
     };
 
+    /*
+     *  @brief Get the smallest buddy order which fits the amount of pages.
+     * 
+     *  @param nPages the amount of pages.
+     * 
+     *  @return the buddy order.
+     */
+    static size_t GetOrder(const size_t nPages);
+
+    /*
+     *  @brief Get the zone of a page frame number.
+     * 
+     *  @param pfn the page frame number.
+     * 
+     *  @return the zone type.
+     */
+    static ZoneType GetZoneType(const size_t pfn);
+
+    /*
+     *  @brief Get the highest zone the allocation flags allow.
+     * 
+     *  @param allocationFlags the allocation flags.
+     * 
+     *  @return the zone type.
+     */
+    static ZoneType GetZoneType(const AllocationFlags allocationFlags);
+
+    /*
+     *  @brief Get the first page frame number of a zone.
+     * 
+     *  @param zoneType the zone.
+     * 
+     *  @return the start page frame number.
+     */
+    static size_t GetZoneStartPfn(const ZoneType zoneType);
+
+    /*
+     *  @brief Get the first page frame number after a zone.
+     * 
+     *  @param zoneType the zone.
+     * 
+     *  @return the end page frame number.
+     */
+    static size_t GetZoneEndPfn(const ZoneType zoneType);
+
+    /*
+     *  @brief Get the huge page size of a page size.
+     * 
+     *  @param pageSize the page size.
+     * 
+     *  @return the huge page size, HUGE_PAGE_NONE if there is no pool for the page size.
+     */
+    static HugePageSize GetHugePageSize(const PageSize pageSize);
+
+    /*
+     *  @brief Get the number of pages in a huge page.
+     * 
+     *  @param hugePageSize the huge page size.
+     * 
+     *  @return the number of pages.
+     */
+    static size_t GetHugePagePages(const HugePageSize hugePageSize);
+
+    /*
+     *  @brief Get the page descriptor of a page frame number.
+     * 
+     *  @param pfn the page frame number.
+     * 
+     *  @return pointer to the physical page, nullptr if the pfn is not backed by a memmap section.
+     */
+    PhysicalPage *PfnToPage(const size_t pfn) const;
+
+    /*
+     *  @brief Get the page frame number of a page descriptor.
+     * 
+     *  @param pPhysicalPage pointer to the physical page.
+     * 
+     *  @return the page frame number.
+     */
+    size_t PageToPfn(const PhysicalPage * const pPhysicalPage) const;
+
 private:
     //! The free list typedef.
     using PhysicalPageFreeList = 
@@ -129,6 +452,21 @@ private:
 		    >
 	    >;
 
+    //! The shrinker list typedef.
+    using ShrinkerList =
+    	frg::intrusive_list<
+	    	Shrinker,
+    		frg::locate_member<
+			    Shrinker,
+			    frg::default_list_hook<Shrinker>,
+			    &Shrinker::m_shrinkerHook
+		    >
+	    >;
+
+    //! Forward declare the page cache and the free area.
+    class PageCache;
+    class FreeArea;
+
     //! Constructor
     MemoryPool();
 
@@ -139,101 +477,1315 @@ private:
     MemoryPool &operator=(MemoryPool &&rhs) = delete;
 
     /*
-     *  @brief Divide memory region into page sizes and add to pool.
+     *  @brief Add a memory region to the pool.
+     *  The region is split at the NUMA node boundaries, the pages are created and handed to the buddy allocator in Initialize.
      * 
      *  @param memoryRegion the memory region.
      */
     void AddMemoryRegion(const MemoryRegion &memoryRegion);
 
+    //! Build the memmap sections for the added memory regions and initialize the boot sections.
+    void Initialize();
+
+    /*
+     *  @brief Initialize the lowest deferred memmap block with pages in a zone of a node and free its usable pages.
+     * 
+     *  @param node the node, MAX_NODES for any node.
+     *  @param zoneType the zone, MAX_ZONES for any zone.
+     * 
+     *  @return whether a memmap block was initialized, false once the zone is fully initialized.
+     */
+    bool InitializeDeferredSection(const uint8_t node, const ZoneType zoneType);
+
+    /*
+     *  @brief Reserve the pages of the kernel image and of the kmalloc eternal arena, the memmap included.
+     *  Their sections were freed to the buddy allocator as a whole, the pages are taken back before anything allocates.
+     */
+    void ReserveKernelPages();
+
+    /*
+     *  @brief Initialize the deferred memmap blocks of the sections spanned by a page frame number range.
+     * 
+     *  @param pfn the first page frame number.
+     *  @param nPages the amount of pages.
+     */
+    void InitializeSections(const size_t pfn, const size_t nPages);
+
+    /*
+     *  @brief Initialize a memmap block and free its usable pages.
+     * 
+     *  @param memmapBlock the memmap block index.
+     */
+    void InitializeMemmapBlock(const size_t memmapBlock);
+
+    /*
+     *  @brief Check whether a section contains usable pages of any memory region on a node.
+     * 
+     *  @param section the section number.
+     *  @param node the node, MAX_NODES for any node.
+     * 
+     *  @return whether the section has usable pages on the node.
+     */
+    bool IsSectionPresent(const size_t section, const uint8_t node) const;
+
+    /*
+     *  @brief Set the watermarks of every zone from its managed pages.
+     *  Called once the boot reservations are known, the reserved pages never come back.
+     */
+    void SetWatermarks();
+
+    /*
+     *  @brief Get the number of free pages which count against the watermarks.
+     *  The pages in the per-CPU page caches count as well, direct reclaim drains them for the CPUs which run dry.
+     *
+     *  @param pageCounters the page counters.
+     *
+     *  @return the number of free pages.
+     */
+    static size_t GetFreePages(const PageCounters &pageCounters);
+
+    /*
+     *  @brief Get the number of free pages of a zone the allocations may take before it falls below a watermark.
+     *
+     *  @param node the node.
+     *  @param zoneType the zone.
+     *  @param watermark the watermark.
+     *
+     *  @return the number of pages above the watermark, 0 if the zone is at or below it.
+     */
+    size_t GetWatermarkAllowance(const uint8_t node, const ZoneType zoneType, const Watermark watermark) const;
+
+    /*
+     *  @brief Check whether any zone is below a watermark.
+     *
+     *  @param watermark the watermark.
+     *
+     *  @return whether a zone is below the watermark.
+     */
+    bool IsBelowWatermark(const Watermark watermark) const;
+
+    /*
+     *  @brief Register a shrinker with reclaim.
+     *
+     *  @param shrinker the shrinker.
+     */
+    void RegisterShrinker(Shrinker &shrinker);
+
+    /*
+     *  @brief Unregister a shrinker from reclaim.
+     *
+     *  @param shrinker the shrinker.
+     */
+    void UnregisterShrinker(Shrinker &shrinker);
+
+    /*
+     *  @brief Reclaim pages on the allocation path, once an allocation would take its zones below the min watermark.
+     *  The shrinkers are called for at least a batch of pages, then the page caches are drained.
+     *
+     *  @param nPages the amount of pages the allocation needs.
+     *
+     *  @return the number of pages which came back to the buddy free lists.
+     */
+    size_t ReclaimPages(const size_t nPages);
+
+    /*
+     *  @brief Run a reclaim step after a zone fell below its low watermark, called from the idle loop.
+     *
+     *  @return whether reclaim is still pending.
+     */
+    bool ReclaimBackground();
+
+    /*
+     *  @brief Call the shrinkers, scanning a larger share of their objects every pass, until enough pages came back.
+     *
+     *  @param nPages the amount of pages wanted.
+     *
+     *  @return the number of pages which came back, less than nPages once the shrinkers have nothing left.
+     */
+    size_t ShrinkCaches(const size_t nPages);
+
     /*
      *  @brief Allocate a physical page.
      * 
-     *  @return pointer to the allocated page.
+     *  @param allocationFlags the allocation flags.
+     * 
+     *  @return pointer to the allocated page, nullptr if the allowed zones are exhausted.
      */
-    const PhysicalPage *AllocatePage();
+    const PhysicalPage *AllocatePage(const AllocationFlags allocationFlags);
 
     /*
-     *  @brief Allocate a physical page range.
+     *  @brief Allocate a physical page from the first zone in fallback order which stays above a watermark.
+     *
+     *  @param allocationFlags the allocation flags.
+     *  @param watermark the watermark.
+     *
+     *  @return pointer to the allocated page, nullptr if every allowed zone is at or below the watermark.
+     */
+    const PhysicalPage *AllocatePage(const AllocationFlags allocationFlags, const Watermark watermark);
+
+    /*
+     *  @brief Allocate a physical page from a zone of a node.
+     *  Only the pages of the local node go through the page cache.
      * 
-     *  @param  nPages the amount of physically contiguous pages.
+     *  @param node the node.
+     *  @param zoneType the zone.
+     *  @param allocationFlags the allocation flags.
      * 
-     *  @return pointer to the allocated page.
+     *  @return pointer to the allocated page, nullptr if the zone is exhausted.
      */
-    PhysicalRange AllocateRange(const size_t nPages);
+    const PhysicalPage *AllocateZonePage(const uint8_t node, const ZoneType zoneType, const AllocationFlags allocationFlags);
 
     /*
-     *  @brief Allocate a physical page range at a specific address.
-     *  Used only by the KernelAddressSpace class during init.
-     *  
-     *  @param  physicalAddress the starting physical address.
-     *  @param  nPages the amount of physically contiguous pages.
+     *  @brief Allocate a batch of physical pages which don't have to be contiguous.
+     *  The pages of the page cache are used first, the rest is taken from the free lists as whole blocks.
      * 
-     *  @return pointer to the allocated page.
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the allocated pages are stored to.
+     *  @param allocationFlags the allocation flags.
+     * 
+     *  @return the amount of allocated pages, less than nPages if the allowed zones are exhausted.
      */
-    PhysicalRange AllocateRange(const PhysicalAddress physicalAddress, const size_t nPages);
+    size_t AllocatePages(const size_t nPages, const PhysicalPage **ppPages, const AllocationFlags allocationFlags);
 
     /*
-     *  @brief Initialize a physical page range.
-     *  
-     *  @param  physicalRange the physical range to initialize.
+     *  @brief Allocate a batch of physical pages from the zones in fallback order, none of them taken below a watermark.
+     *
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the allocated pages are stored to.
+     *  @param allocationFlags the allocation flags.
+     *  @param watermark the watermark.
+     *
+     *  @return the amount of allocated pages, less than nPages once every allowed zone is at the watermark.
      */
-    void InitializePhysicalRange(PhysicalRange &physicalRange);
+    size_t AllocatePages(const size_t nPages, const PhysicalPage **ppPages, const AllocationFlags allocationFlags, const Watermark watermark);
 
     /*
-     *  @brief Return a physical page.
+     *  @brief Allocate a batch of physical pages from a zone of a node.
      * 
-     *  @param pPhysicalPage pointer to the allocated page.
+     *  @param node the node.
+     *  @param zoneType the zone.
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the allocated pages are stored to.
+     *  @param allocationFlags the allocation flags.
+     * 
+     *  @return the amount of allocated pages, less than nPages if the zone is exhausted.
      */
-    void ReturnPage(const PhysicalPage * const pPhysicalPage);
+    size_t AllocateZonePages(const uint8_t node, const ZoneType zoneType, const size_t nPages, const PhysicalPage **ppPages,
+        const AllocationFlags allocationFlags);
 
     /*
-     *  @brief Return a physical page.
+     *  @brief Account allocated pages to the NUMA counters.
      * 
-     *  @param pageAddress the address of the page.
+     *  @param localNode the node of the allocating CPU.
+     *  @param node the node the pages were allocated from.
+     *  @param nPages the amount of pages.
      */
-    void ReturnPage(const PhysicalAddress pageAddress);
+    void AccountNumaAllocation(const uint8_t localNode, const uint8_t node, const size_t nPages);
 
     /*
-     *  @brief Return a physical page range.
+     *  @brief Allocate a batch of physical pages of consecutive cache colors from a zone of a node.
+     *  The colors continue from the last colored page of the CPU. When a color runs dry and no whole block of
+     *  colors is left, the nearest color with a free page is used.
      * 
-     *  @param  physicalRange pointer to the physical range.
+     *  @param node the node.
+     *  @param zoneType the zone.
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the allocated pages are stored to.
+     *  @param allocationFlags the allocation flags.
+     * 
+     *  @return the amount of allocated pages, 0 if page coloring is disabled, less than nPages if the zone is exhausted.
      */
-    void ReturnRange(MemoryPool::PhysicalRange &physicalRange);
+    size_t AllocateColoredPages(const uint8_t node, const ZoneType zoneType, const size_t nPages, const PhysicalPage **ppPages,
+        const AllocationFlags allocationFlags);
+
+    //! Give the pages of the cache color lists of every zone back to the buddy free lists.
+    void DrainColoredPages();
 
     /*
-     *  @brief Find a physical page from the pool.
-     *  CAUTION: This function does not increment the ref counter.
+     *  @brief Take pages off a page cache into an array.
      * 
-     *  @param pageAddr the address of the page
+     *  @param pageCache the page cache.
+     *  @param node the node of the page cache.
+     *  @param zoneType the zone of the page cache.
+     *  @param ppPages the array the pages are stored to.
+     *  @param nPages the maximum amount of pages.
+     *  @param allocationFlags the allocation flags.
      * 
-     *  @return pointer to the physical page.
+     *  @return the amount of pages taken.
      */
-    const PhysicalPage *FindPhysicalPage(const PhysicalAddress pageAddress);
-    
+    size_t TakeCachedPages(PageCache &pageCache, const uint8_t node, const ZoneType zoneType, const PhysicalPage **ppPages,
+        const size_t nPages, const AllocationFlags allocationFlags);
+
     /*
-     *  @brief Get a physical page from the pool.
+     *  @brief Take pages off the pre-zeroed page pool of a zone into an array.
      * 
-     *  @param pageAddr the address of the page
+     *  @param node the node.
+     *  @param zoneType the zone.
+     *  @param ppPages the array the pages are stored to.
+     *  @param nPages the maximum amount of pages.
      * 
-     *  @return pointer to the physical page.
+     *  @return the amount of pages taken.
      */
-    const RefPtr<PhysicalPage> GetPhysicalPage(const PhysicalAddress pageAddress);
+    size_t TakeZeroedPages(const uint8_t node, const ZoneType zoneType, const PhysicalPage **ppPages, const size_t nPages);
 
-    PhysicalPage            *m_pPool;       ///< Physical page pool.
-    size_t                  m_poolSize;     ///< The size of the pool.
-    PhysicalPageFreeList    m_freeList;     ///< The page free list.
+    //! Top up the pre-zeroed page pools by a batch, called from the idle loop.
+    void RefillZeroedPages();
 
-    friend class Pmm;
-};
+    //! Give the pre-zeroed pages of every zone back to the buddy free lists.
+    void DrainZeroedPages();
 
-// ---------------------------------------------------------------------------------------------------------
-// ---------------------------------------------------------------------------------------------------------
+    /*
+     *  @brief Take pages off the atomic reserves of the allowed zones into an array.
+     *  Only atomic allocations which found the zones exhausted down to the min watermark get here.
+     * 
+     *  @param nPages the maximum amount of pages.
+     *  @param ppPages the array the pages are stored to.
+     *  @param allocationFlags the allocation flags.
+     * 
+     *  @return the amount of pages taken.
+     */
+    size_t TakeAtomicReservePages(const size_t nPages, const PhysicalPage **ppPages, const AllocationFlags allocationFlags);
+
+    /*
+     *  @brief Top up the atomic reserves, called from the idle loop.
+     *  The reserves are only refilled from zones above their min watermark, they don't compete with direct reclaim.
+     * 
+     *  @return the number of pages put into the reserves.
+     */
+    size_t RefillAtomicReserves();
+
+    /*
+     *  @brief Zero a run of contiguous pages on the allocation path.
+     * 
+     *  @param pPhysicalPage pointer to the first page.
+     *  @param nPages the amount of pages.
+     */
+    void ZeroPageRun(const PhysicalPage *pPhysicalPage, const size_t nPages);
+
+    /*
+     *  @brief Allocate pages for the balloon and keep them on the balloon list.
+     * 
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the allocated pages are stored to.
+     * 
+     *  @return the amount of pages, less than nPages if out of memory.
+     */
+    size_t InflateBalloon(const size_t nPages, const PhysicalPage **ppPages);
+
+    /*
+     *  @brief Take pages off the balloon list, the last inflated first.
+     *  The pages stay allocated until they are returned with ReturnPages.
+     * 
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the pages are stored to.
+     * 
+     *  @return the amount of pages, less than nPages if the balloon runs empty.
+     */
+    size_t DeflateBalloon(const size_t nPages, const PhysicalPage **ppPages);
+
+    /*
+     *  @brief Take free blocks which weren't reported yet off the free lists, the highest orders first.
+     *  The blocks stay off the free lists until they are put back with PutBackReportedBlocks.
+     * 
+     *  @param minOrder the smallest buddy order taken.
+     *  @param ppBlocks the array the head pages of the blocks are stored to.
+     *  @param nMaxBlocks the maximum amount of blocks.
+     * 
+     *  @return the amount of blocks taken.
+     */
+    size_t TakeUnreportedBlocks(const size_t minOrder, const PhysicalPage **ppBlocks, const size_t nMaxBlocks);
+
+    /*
+     *  @brief Put blocks taken by TakeUnreportedBlocks back on the free lists.
+     *  A block whose buddy was freed in the meantime is merged and loses its reported state.
+     * 
+     *  @param ppBlocks the head pages of the blocks.
+     *  @param nBlocks the amount of blocks.
+     *  @param isReported whether the host accepted the report.
+     */
+    void PutBackReportedBlocks(const PhysicalPage * const *ppBlocks, const size_t nBlocks, const bool isReported);
+
+    /*
+     *  @brief Allocate a physical page range.
+     * 
+     *  @param  nPages the amount of physically contiguous pages.
+     *  @param  allocationFlags the allocation flags.
+     * 
+     *  @return pointer to the allocated page.
+     */
+    PhysicalRange AllocateRange(const size_t nPages, const AllocationFlags allocationFlags);
+
+    /*
+     *  @brief Take a block of an order from the first zone in fallback order which stays above a watermark.
+     *
+     *  @param order the buddy order.
+     *  @param zoneType the highest zone allowed.
+     *  @param watermark the watermark.
+     *  @param allocationFlags the allocation flags.
+     *
+     *  @return pointer to the head page of the block, nullptr if there is none.
+     */
+    PhysicalPage *AllocateFallbackBlock(const size_t order, const ZoneType zoneType, const Watermark watermark,
+        const AllocationFlags allocationFlags);
+
+    /*
+     *  @brief Allocate a physical page range by linearly scanning the pool for free pages.
+     *  Used for ranges larger than the biggest buddy block and when the buddy free lists are too fragmented.
+     *  The nodes and zones are scanned in fallback order and a range never spans zones or nodes. Zones the range
+     *  would take below their min watermark are skipped.
+     * 
+     *  @param  nPages the amount of physically contiguous pages.
+     *  @param  zoneType the highest zone to scan.
+     * 
+     *  @return the physical range.
+     */
+    PhysicalRange AllocateRangeScan(const size_t nPages, const ZoneType zoneType);
+
+    /*
+     *  @brief Find a run of contiguous free pages by linearly scanning page descriptors.
+     * 
+     *  @param  pPages pointer to the first page to scan.
+     *  @param  nPages the amount of pages to scan.
+     *  @param  nRunPages the amount of contiguous free pages needed.
+     * 
+     *  @return pointer to the first page of the run, nullptr if there is none.
+     */
+    PhysicalPage *ScanPageRun(PhysicalPage * const pPages, const size_t nPages, const size_t nRunPages);
+
+    /*
+     *  @brief Set aside the CMA region at the top of ZONE_DMA32, so that 32-bit devices can use it as well.
+     *  The region is made of free max order blocks, its size is rounded up to whole blocks.
+     * 
+     *  @param nPages the amount of pages.
+     * 
+     *  @return the number of pages in the region, 0 if there is no room for it.
+     */
+    size_t InitializeCma(const size_t nPages);
+
+    /*
+     *  @brief Is a page frame number in the CMA region.
+     * 
+     *  @param pfn the page frame number.
+     * 
+     *  @return whether the pfn is in the region.
+     */
+    bool IsCmaPfn(const size_t pfn) const;
+
+    /*
+     *  @brief Lend a free page of the CMA region to a movable allocation.
+     * 
+     *  @param allocationFlags the allocation flags.
+     * 
+     *  @return pointer to the allocated page, nullptr if the region is exhausted or outside of the allowed zones.
+     */
+    const PhysicalPage *AllocateCmaPage(const AllocationFlags allocationFlags);
+
+    /*
+     *  @brief Allocate a physical page range from the CMA region.
+     *  The runs are aligned like buddy blocks of the order of the range. The pages lent to movable allocations are
+     *  migrated out of the first run which holds nothing else, the free pages of the run are taken off the free lists.
+     * 
+     *  @param  nPages the amount of physically contiguous pages.
+     *  @param  zoneType the highest zone allowed.
+     * 
+     *  @return the physical range.
+     */
+    PhysicalRange AllocateCmaRange(const size_t nPages, const ZoneType zoneType);
+
+    /*
+     *  @brief Find the first page of a run which is neither free nor can be migrated.
+     * 
+     *  @param  pPages pointer to the first page of the run.
+     *  @param  nPages the amount of pages in the run.
+     * 
+     *  @return pointer to the page, nullptr if the whole run can be freed by migration.
+     */
+    PhysicalPage *FindPinnedPage(PhysicalPage * const pPages, const size_t nPages);
+
+    /*
+     *  @brief Check whether every page of a run is in a free block.
+     * 
+     *  @param  pPages pointer to the first page of the run.
+     *  @param  nPages the amount of pages in the run.
+     * 
+     *  @return whether the whole run is free.
+     */
+    bool IsPageRunFree(PhysicalPage * const pPages, const size_t nPages);
+
+    /*
+     *  @brief Allocate a physical page range at a specific address.
+     *  Used only by the KernelAddressSpace class during init.
+     *  
+     *  @param  physicalAddress the starting physical address.
+     *  @param  nPages the amount of physically contiguous pages.
+     * 
+     *  @return pointer to the allocated page.
+     */
+    PhysicalRange AllocateRange(const PhysicalAddress physicalAddress, const size_t nPages);
+
+    /*
+     *  @brief Take a run of contiguous pages off the free lists and mark them reserved.
+     *  Reserved pages are never freed, only released by ReleasePageRun.
+     * 
+     *  @param pPhysicalPage pointer to the first page.
+     *  @param nPages the amount of pages.
+     */
+    void ReservePageRun(PhysicalPage *pPhysicalPage, const size_t nPages);
+
+    /*
+     *  @brief Give the reserved usable pages of a page frame number range to the buddy allocator.
+     *  The head of a range reserved through AllocateRange drops the reference held by the range, pages in section holes stay reserved.
+     * 
+     *  @param pfn the first page frame number.
+     *  @param nPages the amount of pages.
+     * 
+     *  @return the number of released pages.
+     */
+    size_t ReleasePageRun(const size_t pfn, const size_t nPages);
+
+    /*
+     *  @brief Initialize a physical page range.
+     *  The first page becomes the head of the range, only its ref count is taken.
+     *  
+     *  @param  physicalRange the physical range to initialize.
+     */
+    void InitializePhysicalRange(PhysicalRange &physicalRange);
+
+    /*
+     *  @brief Shrink a physical range reserved by AllocateRange and give its last pages to the buddy allocator.
+     *  The range must not be shared, its head is released as well once nothing is left of it.
+     * 
+     *  @param physicalRange the physical range to shrink.
+     *  @param nPages the amount of pages to release.
+     * 
+     *  @return the number of released pages.
+     */
+    size_t ReleaseRangeTail(PhysicalRange &physicalRange, const size_t nPages);
+
+    /*
+     *  @brief Return a physical page.
+     * 
+     *  @param pPhysicalPage pointer to the allocated page.
+     */
+    void ReturnPage(const PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Return a physical page.
+     * 
+     *  @param pageAddress the address of the page.
+     */
+    void ReturnPage(const PhysicalAddress pageAddress);
+
+    /*
+     *  @brief Return a batch of physical pages.
+     * 
+     *  @param ppPages the pages.
+     *  @param nPages the amount of pages.
+     */
+    void ReturnPages(const PhysicalPage * const *ppPages, const size_t nPages);
+
+    /*
+     *  @brief Return a physical page range.
+     *  Drops the reference held on the head of the range.
+     * 
+     *  @param  physicalRange pointer to the physical range.
+     */
+    void ReturnRange(MemoryPool::PhysicalRange &physicalRange);
+
+    /*
+     *  @brief Grow or shrink a huge page pool.
+     *  Growing stops early once no more free frames are found, shrinking only releases free huge pages.
+     * 
+     *  @param hugePageSize the huge page size.
+     *  @param nHugePages the requested number of huge pages in the pool.
+     * 
+     *  @return the number of huge pages in the pool.
+     */
+    size_t ResizeHugePagePool(const HugePageSize hugePageSize, const size_t nHugePages);
+
+    /*
+     *  @brief Take a free frame off the buddy free lists for a huge page pool.
+     * 
+     *  @param hugePageSize the huge page size.
+     * 
+     *  @return pointer to the head page of the frame, nullptr if there is no free frame.
+     */
+    PhysicalPage *TakeHugePageFrame(const HugePageSize hugePageSize);
+
+    /*
+     *  @brief Find a free 1 GiB frame by scanning the naturally aligned frames of the zones above ZONE_DMA.
+     *  The nodes are scanned in fallback order and a frame never spans nodes.
+     * 
+     *  @return pointer to the head page of the frame, nullptr if there is no free frame.
+     */
+    PhysicalPage *FindGiganticPageFrame();
+
+    /*
+     *  @brief Check whether a run of whole max order blocks is free outside of the CMA region.
+     * 
+     *  @param pfn the first page frame number, aligned to the largest block.
+     *  @param nPages the amount of pages, a multiple of the largest block.
+     * 
+     *  @return whether every block of the run is free.
+     */
+    bool IsBlockRunFree(const size_t pfn, const size_t nPages);
+
+    /*
+     *  @brief Allocate a huge page from its pool.
+     * 
+     *  @param hugePageSize the huge page size.
+     * 
+     *  @return pointer to the head page of the huge page, nullptr if the pool is empty.
+     */
+    const PhysicalPage *AllocateHugePage(const HugePageSize hugePageSize);
+
+    /*
+     *  @brief Put a huge page which is no longer referenced back to its pool.
+     * 
+     *  @param pPhysicalPage pointer to the head page of the huge page.
+     */
+    void FreeHugePage(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Record the single mapping of a page and make it movable.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     *  @param addressSpace the address space of the mapping.
+     *  @param virtualAddress the virtual address of the mapping.
+     */
+    void SetReverseMapping(PhysicalPage * const pPhysicalPage, AddressSpace &addressSpace, const VirtualAddress &virtualAddress);
+
+    /*
+     *  @brief Forget the mapping of a movable page.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     */
+    void ClearReverseMapping(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Drop the mapping of a movable page and return the page.
+     * 
+     *  @param physicalAddress the physical address of the page.
+     */
+    void ReturnMovablePage(const PhysicalAddress physicalAddress);
+
+    /*
+     *  @brief Migrate a movable page to another frame.
+     *  The contents are copied, the mapping is rewritten and the old frame is freed.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     *  @param pTargetPage pointer to the allocated, unreferenced target page.
+     * 
+     *  @return whether the page was migrated, the target page is left untouched otherwise.
+     */
+    bool MigratePage(PhysicalPage * const pPhysicalPage, PhysicalPage * const pTargetPage);
+
+    /*
+     *  @brief Compact the whole memory.
+     * 
+     *  @return the number of migrated pages.
+     */
+    size_t CompactMemory();
+
+    /*
+     *  @brief Run a batch of compaction for the order of the last failed contiguous allocation, called from the idle loop.
+     * 
+     *  @return whether compaction is still pending.
+     */
+    bool CompactMemoryBackground();
+
+    /*
+     *  @brief Compact a zone of a node until a free block of an order forms or the scanners meet.
+     *  The migration scanner walks up from the bottom of the zone and the free scanner down from its top,
+     *  their positions are kept across calls. Pages never migrate to another node.
+     * 
+     *  @param node the node.
+     *  @param zoneType the zone.
+     *  @param order the wanted order, MAX_ORDER to compact the whole zone.
+     *  @param nScanPages the maximum number of pages for the migration scanner to walk.
+     * 
+     *  @return the number of migrated pages.
+     */
+    size_t CompactZone(const uint8_t node, const ZoneType zoneType, const size_t order, const size_t nScanPages);
+
+    /*
+     *  @brief Set the number of pages the merge scanner visits per batch.
+     * 
+     *  @param nPages the number of pages, 0 disables same-page merging.
+     */
+    void SetMergeBatch(const size_t nPages);
+
+    /*
+     *  @brief Run a batch of the merge scanner once the scan interval elapsed, called from the idle loop.
+     * 
+     *  @return whether a full scan ended which changed the number of saved pages.
+     */
+    bool MergePagesBackground();
+
+    /*
+     *  @brief Merge the pages of identical contents among the next pages of the memmap.
+     * 
+     *  @param nScanPages the number of pages to visit.
+     * 
+     *  @return the number of merged pages.
+     */
+    size_t MergePages(const size_t nScanPages);
+
+    /*
+     *  @brief Merge a page into a shared frame of identical contents.
+     *  Only movable pages are merged, and only once their checksum didn't change since the previous scan.
+     *  Without a shared frame to merge into, the page is paired with the candidate of the same hash.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     * 
+     *  @return whether the page was merged.
+     */
+    bool MergePage(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Turn a movable page into a shared frame, its mapping becomes the first sharer.
+     * 
+     *  @param pPhysicalPage pointer to the write protected page.
+     */
+    void AddMergedPage(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Take a merged page out of the merge table.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     */
+    void RemoveMergedPage(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Hand the mapping of a movable page over to a shared frame and free the page.
+     * 
+     *  @param pPhysicalPage pointer to the movable page, remapped to the shared frame.
+     *  @param pMergedPage pointer to the shared frame.
+     */
+    void ShareMergedPage(PhysicalPage * const pPhysicalPage, PhysicalPage * const pMergedPage);
+
+    /*
+     *  @brief Drop a sharer of a merged page.
+     *  The reference of the sharer is left to the caller.
+     * 
+     *  @param pMergedPage pointer to the merged page.
+     */
+    void DropMergedMapping(PhysicalPage * const pMergedPage);
+
+    /*
+     *  @brief Is a merged page shared by more than one mapping.
+     * 
+     *  @param physicalAddress the physical address of the merged page.
+     * 
+     *  @return whether the page has other sharers.
+     */
+    bool IsMergedPageShared(const PhysicalAddress physicalAddress);
+
+    /*
+     *  @brief Take a mapping off a merged page after its write fault.
+     * 
+     *  @param sharedAddress the physical address of the merged page.
+     *  @param pPhysicalPage pointer to the private copy now mapped, nullptr if the last sharer took the frame over.
+     *  @param addressSpace the address space of the mapping.
+     *  @param virtualAddress the virtual address of the mapping.
+     */
+    void UnmergePage(const PhysicalAddress sharedAddress, PhysicalPage * const pPhysicalPage, AddressSpace &addressSpace,
+        const VirtualAddress &virtualAddress);
+
+    /*
+     *  @brief Take the next free page off the buddy free lists for the free scanner of a zone.
+     * 
+     *  @param node the node.
+     *  @param zoneType the zone.
+     * 
+     *  @return pointer to the page, nullptr once the free scanner meets the migration scanner.
+     */
+    PhysicalPage *TakeCompactionTarget(const uint8_t node, const ZoneType zoneType);
+
+    /*
+     *  @brief Get the number of free blocks of at least an order in a zone.
+     * 
+     *  @param node the node, MAX_NODES for the zone on all nodes.
+     *  @param zoneType the zone.
+     *  @param order the order.
+     * 
+     *  @return the number of free blocks.
+     */
+    size_t GetFreeBlockCount(const uint8_t node, const ZoneType zoneType, const size_t order) const;
+
+    /*
+     *  @brief Get the fragmentation index of a zone for an order.
+     *  Towards 1000 an allocation of the order fails because free memory is fragmented, towards 0 because
+     *  there is too little free memory.
+     * 
+     *  @param node the node, MAX_NODES for the zone on all nodes.
+     *  @param zoneType the zone.
+     *  @param order the order.
+     * 
+     *  @return the fragmentation index, -1000 if a free block of the order is available.
+     */
+    int32_t GetFragmentationIndex(const uint8_t node, const ZoneType zoneType, const size_t order) const;
+
+    /*
+     *  @brief Put a physical page which is no longer referenced back to the buddy free lists.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     */
+    void FreePage(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Refill a page cache with a batch of pages from the buddy free lists of its zone.
+     * 
+     *  @param pageCache the page cache.
+     *  @param node the node of the page cache.
+     *  @param zoneType the zone of the page cache.
+     *  @param allocationFlags the flags of the allocation which found the page cache empty.
+     */
+    void RefillPageCache(PageCache &pageCache, const uint8_t node, const ZoneType zoneType, const AllocationFlags allocationFlags);
+
+    /*
+     *  @brief Drain the coldest pages of a page cache to the buddy free lists.
+     * 
+     *  @param pageCache the page cache.
+     *  @param nPages the maximum amount of pages to drain.
+     */
+    void DrainPageCache(PageCache &pageCache, const size_t nPages);
+
+    //! Drain every page cache to the buddy free lists.
+    void DrainPageCaches();
+
+    /*
+     *  @brief Take a block of the given order from the buddy free lists of a zone.
+     *  Larger blocks are split and the unused halves are put back on the free lists.
+     * 
+     *  @param order the buddy order.
+     *  @param node the node.
+     *  @param zoneType the zone.
+     *  @param allocationFlags the allocation flags, an atomic allocation never initializes a deferred memmap block.
+     * 
+     *  @return pointer to the head page of the block, nullptr if there is no free block.
+     */
+    PhysicalPage *AllocateBlock(const size_t order, const uint8_t node, const ZoneType zoneType,
+        const AllocationFlags allocationFlags = ALLOC_NO_FLAGS);
+
+    /*
+     *  @brief Take a block of the given order from a set of buddy free lists.
+     *  Larger blocks are split and the unused halves are put back on the free lists.
+     * 
+     *  @param order the buddy order.
+     *  @param pFreeAreas the free lists, by order.
+     * 
+     *  @return pointer to the head page of the block, nullptr if there is no free block.
+     */
+    PhysicalPage *AllocateBlock(const size_t order, FreeArea * const pFreeAreas);
+
+    /*
+     *  @brief Put a block back to the buddy free lists, coalescing it with its free buddies.
+     * 
+     *  @param pPhysicalPage pointer to the head page of the block.
+     *  @param order the buddy order of the block.
+     */
+    void FreeBlock(PhysicalPage *pPhysicalPage, size_t order);
+
+    /*
+     *  @brief Put a block on the free list of its order and account for its pages.
+     * 
+     *  @param pPhysicalPage pointer to the head page of the block.
+     *  @param order the buddy order of the block.
+     */
+    void AddFreeBlock(PhysicalPage * const pPhysicalPage, const size_t order);
+
+    /*
+     *  @brief Take a block off the free list of its order and account for its pages.
+     * 
+     *  @param pPhysicalPage pointer to the head page of the block.
+     */
+    void RemoveFreeBlock(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Get the free list a block belongs on, the blocks of the CMA region have free lists of their own.
+     * 
+     *  @param pPhysicalPage pointer to the head page of the block.
+     *  @param order the buddy order of the block.
+     * 
+     *  @return the free area.
+     */
+    FreeArea &GetFreeArea(const PhysicalPage * const pPhysicalPage, const size_t order);
+
+    /*
+     *  @brief Get the NUMA node of the allocating CPU.
+     * 
+     *  @return the node.
+     */
+    uint8_t GetLocalNode() const;
+
+    /*
+     *  @brief Get the NUMA node of a page.
+     * 
+     *  @param pPhysicalPage pointer to the page, usable or free.
+     * 
+     *  @return the node.
+     */
+    uint8_t GetNode(const PhysicalPage * const pPhysicalPage) const;
+
+    /*
+     *  @brief Account pages to a counter of the pool, their node, their zone and their memory region.
+     * 
+     *  @param pPhysicalPage pointer to the first page, all pages must be in the same zone and region.
+     *  @param pCounter the counter to update.
+     *  @param nPages the amount of pages to add, negative to subtract.
+     */
+    void AccountPages(const PhysicalPage * const pPhysicalPage, size_t PageCounters::* const pCounter, const int64_t nPages);
+
+    /*
+     *  @brief Account a run of pages of a memory region to a counter of the pool, its node, their zones and the region.
+     *  Unlike AccountPages the run may span zones and the page descriptors aren't accessed.
+     * 
+     *  @param regionIndex the index of the memory region.
+     *  @param pfn the page frame number of the first page.
+     *  @param pCounter the counter to update.
+     *  @param nPages the amount of pages to add, negative to subtract.
+     */
+    void AccountPageRun(const size_t regionIndex, size_t pfn, size_t PageCounters::* const pCounter, const int64_t nPages);
+
+    /*
+     *  @brief Free a run of contiguous pages as maximal naturally aligned buddy blocks.
+     * 
+     *  @param pPhysicalPage pointer to the first page.
+     *  @param nPages the amount of pages.
+     */
+    void FreePageRun(PhysicalPage *pPhysicalPage, size_t nPages);
+
+    /*
+     *  @brief Take a run of contiguous pages off the buddy free lists.
+     *  Free blocks overlapping the run are split and the parts outside of the run are freed again.
+     * 
+     *  @param pPhysicalPage pointer to the first page.
+     *  @param nPages the amount of pages.
+     */
+    void TakePageRun(PhysicalPage *pPhysicalPage, const size_t nPages);
+
+    /*
+     *  @brief Find the free buddy block containing a page.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     * 
+     *  @return pointer to the head page of the free block, nullptr if the page is not free.
+     */
+    PhysicalPage *FindFreeBlock(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Get the buddy of a block.
+     * 
+     *  @param pPhysicalPage pointer to the head page of the block.
+     *  @param order the buddy order of the block.
+     * 
+     *  @return pointer to the buddy head page.
+     */
+    PhysicalPage *GetBuddy(PhysicalPage * const pPhysicalPage, const size_t order);
+
+    /*
+     *  @brief Find a physical page from the pool.
+     *  CAUTION: This function does not increment the ref counter.
+     * 
+     *  @param pageAddr the address of the page
+     * 
+     *  @return pointer to the physical page.
+     */
+    const PhysicalPage *FindPhysicalPage(const PhysicalAddress pageAddress);
+    
+    /*
+     *  @brief Get a physical page from the pool.
+     * 
+     *  @param pageAddr the address of the page
+     * 
+     *  @return pointer to the physical page.
+     */
+    const RefPtr<PhysicalPage> GetPhysicalPage(const PhysicalAddress pageAddress);
+
+    /*
+     *  @brief The per-CPU cache of free single pages.
+     */
+    class PageCache
+    {
+    public:
+        //! Constructor
+        PageCache();
+
+        PhysicalPageFreeList    m_freeList;     ///< The cached pages, hot at the front and cold at the back.
+        size_t                  m_nPages;       ///< The number of cached pages.
+    };
+
+    /*
+     *  @brief The free blocks of a single buddy order.
+     */
+    class FreeArea
+    {
+    public:
+        //! Constructor
+        FreeArea();
+
+        PhysicalPageFreeList    m_freeList;     ///< The free block list.
+        size_t                  m_nFreeBlocks;  ///< The number of free blocks.
+    };
+
+    /*
+     *  @brief The free huge pages of a single huge page size.
+     */
+    class HugePagePool
+    {
+    public:
+        //! Constructor
+        HugePagePool();
+
+        PhysicalPageFreeList    m_freeList;         ///< The free huge pages, by head page.
+        size_t                  m_nHugePages;       ///< The number of huge pages in the pool.
+        size_t                  m_nFreeHugePages;   ///< The number of free huge pages.
+    };
+
+    /*
+     *  @brief The buddy free lists and the page counters of a zone.
+     */
+    class Zone
+    {
+    public:
+        //! Constructor
+        Zone();
+
+        FreeArea        m_freeAreas[MAX_ORDER];     ///< The buddy free lists.
+        PageCache       m_zeroedPages;              ///< The pre-zeroed free pages.
+        PhysicalPageFreeList m_colorLists[MAX_PAGE_COLORS]; ///< The free single pages split off for colored allocations, by color.
+        PageCounters    m_counters;                 ///< The page counters of the zone.
+        size_t          m_watermarks[MAX_WATERMARKS];///< The free page watermarks of the zone.
+        size_t          m_migrateScanPfn;           ///< The next pfn of the compaction migration scanner.
+        size_t          m_freeScanPfn;              ///< The pfn after the next one of the compaction free scanner.
+    };
+
+    /*
+     *  @brief The zones and the counters of a NUMA node.
+     */
+    class Node
+    {
+    public:
+        //! Constructor
+        Node();
+
+        Zone            m_zones[MAX_ZONES];         ///< The memory zones of the node.
+        PageCounters    m_counters;                 ///< The page counters of the node.
+        NumaCounters    m_numaCounters;             ///< The NUMA allocation counters of the node.
+        size_t          m_startPfn;                 ///< The first pfn of the node.
+        size_t          m_endPfn;                   ///< The pfn after the last one of the node.
+    };
+
+    PhysicalPage            *m_pPool;                           ///< Physical page pool, the memmap blocks of all present sections.
+    size_t                  m_poolSize;                         ///< The size of the pool.
+    size_t                  m_nPages;                           ///< The number of usable pages in the pool.
+    PhysicalPage            **m_pSectionMemmaps;                ///< Section number to memmap block, nullptr for holes.
+    uint32_t                *m_pMemmapSections;                 ///< Memmap block index to section number.
+    size_t                  m_nSections;                        ///< The number of sections spanned by physical memory.
+    size_t                  m_nPresentSections;                 ///< The number of sections with a memmap block.
+    bool                    *m_pInitializedMemmaps;             ///< Whether a memmap block is initialized, by memmap block index.
+    size_t                  m_nInitializedSections;             ///< The number of initialized memmap blocks.
+    PageCounters            m_counters;                         ///< The page counters of the whole pool.
+    Node                    m_nodes[MAX_NODES];                 ///< The NUMA nodes.
+    size_t                  m_nNodes;                           ///< The number of NUMA nodes.
+    PageCache               m_pageCaches[CPU::MAX_CPUS][MAX_ZONES];///< The per-CPU page caches of every zone of the local node.
+    size_t                  m_nPageColors;                      ///< The number of cache colors, a power of 2, 1 if page coloring is disabled.
+    size_t                  m_nextPageColors[CPU::MAX_CPUS];    ///< The color of the next colored page of every CPU.
+    PhysicalPageFreeList    m_balloonPages;                     ///< The pages taken by the balloon, the last inflated at the back.
+    HugePagePool            m_hugePagePools[MAX_HUGE_PAGE_SIZES];///< The huge page pools, by huge page size.
+    CompactionCounters      m_compactionCounters;               ///< The compaction counters.
+    size_t                  m_compactionOrder;                  ///< The order background compaction works towards, MAX_ORDER if none.
+    ShrinkerList            m_shrinkers;                        ///< The registered shrinkers.
+    ReclaimCounters         m_reclaimCounters;                  ///< The reclaim counters.
+    bool                    m_isReclaimPending;                 ///< Whether a zone fell below its low watermark since background reclaim last ran dry.
+    PhysicalPageFreeList    m_mergedPages[MERGE_TABLE_SIZE];    ///< The merged frames, by checksum bucket.
+    PhysicalPage            *m_pMergeCandidates[MERGE_TABLE_SIZE];///< The unmerged page of every checksum bucket seen by the current scan.
+    MergeCounters           m_mergeCounters;                    ///< The same-page merging counters.
+    size_t                  m_mergeBatch;                       ///< The number of pages the merge scanner visits per batch, 0 if disabled.
+    size_t                  m_mergeScanIndex;                   ///< The memmap index of the next page of the merge scanner.
+    size_t                  m_mergeScanSavedPages;              ///< The number of saved pages when the current scan started.
+    uint64_t                m_nextMergeTsc;                     ///< The TSC of the next batch of the merge scanner.
+    FreeArea                m_cmaFreeAreas[MAX_ORDER];          ///< The buddy free lists of the CMA region.
+    size_t                  m_cmaStartPfn;                      ///< The first pfn of the CMA region.
+    size_t                  m_cmaEndPfn;                        ///< The pfn after the last one of the CMA region, the start pfn without a region.
+    CmaCounters             m_cmaCounters;                      ///< The CMA region counters.
+    PageCache               m_atomicReserves[MAX_ZONES];        ///< The pages held back for atomic allocations, by zone. ZONE_DMA has none.
+    AtomicCounters          m_atomicCounters;                   ///< The atomic allocation counters.
+    MemoryRegion            m_memoryRegions[MAX_MEMORY_REGIONS];///< The memory regions backing the pool.
+    size_t                  m_nMemoryRegions;                   ///< The number of memory regions.
+
+    friend class Pmm;
+    friend class MemoryBenchmark;
+};
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::PageCounters::PageCounters() :
+    m_nPages(0),
+    m_nFreePages(0),
+    m_nReservedPages(0),
+    m_nCachedPages(0),
+    m_nDeferredPages(0),
+    m_nZeroedPages(0),
+    m_nColoredPages(0),
+    m_nCmaPages(0),
+    m_nAtomicPages(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::MemoryRegion::MemoryRegion() :
+    m_addr(0),
+    m_size(0),
+    m_pPages(nullptr),
+    m_nPages(0),
+    m_node(0),
+    m_isReclaimable(false)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::PageCache::PageCache() :
+    m_nPages(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::CompactionCounters::CompactionCounters() :
+    m_nPasses(0),
+    m_nMigratedPages(0),
+    m_nFailedPages(0),
+    m_nRecoveredBlocks(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::ReclaimCounters::ReclaimCounters() :
+    m_nDirectReclaims(0),
+    m_nBackgroundReclaims(0),
+    m_nReclaimedPages(0),
+    m_nFreedObjects(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::MergeCounters::MergeCounters() :
+    m_nScannedPages(0),
+    m_nFullScans(0),
+    m_scanCycles(0),
+    m_nMergedFrames(0),
+    m_nSavedPages(0),
+    m_nMergedPages(0),
+    m_nBrokenPages(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::CmaCounters::CmaCounters() :
+    m_nPages(0),
+    m_nLentPages(0),
+    m_nRanges(0),
+    m_nMigratedPages(0),
+    m_nFailedRanges(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::AtomicCounters::AtomicCounters() :
+    m_nAllocations(0),
+    m_nReservePages(0),
+    m_nFailedPages(0),
+    m_nRefilledPages(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::Zone::Zone() :
+    m_watermarks(),
+    m_migrateScanPfn(0),
+    m_freeScanPfn(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::NumaCounters::NumaCounters() :
+    m_nHits(0),
+    m_nMisses(0),
+    m_nForeign(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::Node::Node() :
+    m_startPfn(SIZE_MAX),
+    m_endPfn(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::HugePagePool::HugePagePool() :
+    m_nHugePages(0),
+    m_nFreeHugePages(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::FreeArea::FreeArea() :
+    m_nFreeBlocks(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline size_t MemoryPool::GetOrder(const size_t nPages)
+{
+    if (nPages <= 1)
+        return 0;
+
+    return (TypeSizeTraits<unsigned long>::bitSize - __builtin_clzl(nPages - 1));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::ZoneType MemoryPool::GetZoneType(const size_t pfn)
+{
+    if (pfn < ZONE_DMA_END_PFN)
+        return ZONE_DMA;
+
+    if (pfn < ZONE_DMA32_END_PFN)
+        return ZONE_DMA32;
+
+    return ZONE_NORMAL;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::ZoneType MemoryPool::GetZoneType(const AllocationFlags allocationFlags)
+{
+    if (allocationFlags & ALLOC_DMA)
+        return ZONE_DMA;
+
+    if (allocationFlags & ALLOC_DMA32)
+        return ZONE_DMA32;
+
+    return ZONE_NORMAL;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline size_t MemoryPool::GetZoneStartPfn(const ZoneType zoneType)
+{
+    return (ZONE_DMA == zoneType) ? 0 : GetZoneEndPfn(static_cast<ZoneType>(zoneType - 1));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline size_t MemoryPool::GetZoneEndPfn(const ZoneType zoneType)
+{
+    if (ZONE_DMA == zoneType)
+        return ZONE_DMA_END_PFN;
+
+    if (ZONE_DMA32 == zoneType)
+        return ZONE_DMA32_END_PFN;
+
+    return SIZE_MAX;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline MemoryPool::HugePageSize MemoryPool::GetHugePageSize(const PageSize pageSize)
+{
+    if (PAGE_2M == pageSize)
+        return HUGE_PAGE_2M;
+
+    if (PAGE_1G == pageSize)
+        return HUGE_PAGE_1G;
+
+    return HUGE_PAGE_NONE;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline size_t MemoryPool::GetHugePagePages(const HugePageSize hugePageSize)
+{
+    if (HUGE_PAGE_2M == hugePageSize)
+        return (2 * MiB) / PAGE_SIZE;
+
+    if (HUGE_PAGE_1G == hugePageSize)
+        return GiB / PAGE_SIZE;
+
+    return 1;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline PhysicalPage *MemoryPool::PfnToPage(const size_t pfn) const
+{
+    const size_t section = (pfn >> SECTION_SHIFT);
+    if ((section >= m_nSections) || (!m_pSectionMemmaps[section]))
+        return nullptr;
+
+    return m_pSectionMemmaps[section] + (pfn & (PAGES_PER_SECTION - 1));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline size_t MemoryPool::PageToPfn(const PhysicalPage * const pPhysicalPage) const
+{
+    const size_t memmapIndex = pPhysicalPage - m_pPool;
+    const size_t section = m_pMemmapSections[memmapIndex >> SECTION_SHIFT];
+
+    return (section << SECTION_SHIFT) | (memmapIndex & (PAGES_PER_SECTION - 1));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint8_t MemoryPool::GetLocalNode() const
+{
+    return NumaTopology::Get().GetCpuNode(CPU::GetCpuIndex());
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint8_t MemoryPool::GetNode(const PhysicalPage * const pPhysicalPage) const
+{
+    return m_memoryRegions[pPhysicalPage->GetRegion()].m_node;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline bool MemoryPool::IsCmaPfn(const size_t pfn) const
+{
+    return (m_cmaStartPfn <= pfn) && (pfn < m_cmaEndPfn);
+}
 
-inline MemoryPool::MemoryRegion::MemoryRegion() :
-    m_addr(0),
-    m_size(0)
-{
-}
 
 // ---------------------------------------------------------------------------------------------------------
 // ---------------------------------------------------------------------------------------------------------
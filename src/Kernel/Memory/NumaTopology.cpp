@@ -0,0 +1,226 @@
+#include "NumaTopology.h"
+
+#include "Kernel/ACPI.h"
+
+namespace BartOS
+{
+
+namespace MM
+{
+
+// ---------------------------------------------------------------------------------------------------------
+
+NumaTopology::NumaTopology() :
+    m_nMemoryRanges(0),
+    m_nNodes(1)
+{
+    m_proximityDomains[0] = 0;
+
+    for (uint8_t &cpuNode : m_cpuNodes)
+        cpuNode = 0;
+
+    for (size_t fromNode = 0; fromNode < MAX_NODES; ++fromNode)
+    {
+        for (size_t toNode = 0; toNode < MAX_NODES; ++toNode)
+            m_distances[fromNode][toNode] = (fromNode == toNode) ? LOCAL_DISTANCE : REMOTE_DISTANCE;
+    }
+
+    BuildFallbackLists();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NumaTopology::Initialize()
+{
+    const PhysicalAddress sratAddress = ACPI::FindTable(ACPI_SIG_SRAT);
+    if (0 == sratAddress.Get())
+    {
+        kprintf("[NUMA] No SRAT, single node\n");
+        return;
+    }
+
+    ParseSrat(sratAddress);
+
+    const PhysicalAddress slitAddress = ACPI::FindTable(ACPI_SIG_SLIT);
+    if (0 != slitAddress.Get())
+        ParseSlit(slitAddress);
+
+    BuildFallbackLists();
+
+    kprintf("[NUMA] %lu nodes, %lu memory ranges, %s\n", m_nNodes, m_nMemoryRanges, (0 != slitAddress.Get()) ? "SLIT distances" : "no SLIT");
+    for (const MemoryRange &memoryRange : Range(m_memoryRanges, m_nMemoryRanges))
+        kprintf("[NUMA] Node %u: memory start=%p end=%p\n", memoryRange.m_node, memoryRange.m_start, memoryRange.m_end);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+uint8_t NumaTopology::GetMemoryNode(const PhysicalAddress &physicalAddress, Address_t &rangeEnd) const
+{
+    const Address_t address = physicalAddress.Get();
+
+    //! The ranges are sorted, memory in front of the first range above the address belongs to node 0.
+    rangeEnd = SIZE_MAX;
+    for (const MemoryRange &memoryRange : Range(m_memoryRanges, m_nMemoryRanges))
+    {
+        if (address < memoryRange.m_start)
+        {
+            rangeEnd = memoryRange.m_start;
+            break;
+        }
+
+        if (address < memoryRange.m_end)
+        {
+            rangeEnd = memoryRange.m_end;
+            return memoryRange.m_node;
+        }
+    }
+
+    return 0;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+uint8_t NumaTopology::GetDomainNode(const uint32_t proximityDomain)
+{
+    for (size_t node = 0; node < m_nNodes; ++node)
+    {
+        if (m_proximityDomains[node] == proximityDomain)
+            return node;
+    }
+
+    if (m_nNodes >= MAX_NODES)
+        return MAX_NODES;
+
+    m_proximityDomains[m_nNodes] = proximityDomain;
+
+    return m_nNodes++;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NumaTopology::ParseSrat(const PhysicalAddress &sratAddress)
+{
+    acpi_table_srat srat;
+    ACPI::ReadTable(&srat, sratAddress, sizeof(srat));
+
+    //! The nodes are numbered from scratch in the order their domains show up.
+    m_nNodes = 0;
+
+    Address_t subtableAddress = sratAddress.Get() + sizeof(acpi_table_srat);
+    const Address_t sratEnd = sratAddress.Get() + srat.length;
+    while ((subtableAddress + sizeof(acpi_subtable_header)) <= sratEnd)
+    {
+        acpi_subtable_header subtableHeader;
+        ACPI::ReadTable(&subtableHeader, PhysicalAddress(subtableAddress), sizeof(subtableHeader));
+        if (sizeof(acpi_subtable_header) > subtableHeader.length)
+            break;
+
+        if ((ACPI_SRAT_TYPE_MEMORY_AFFINITY == subtableHeader.type) && (sizeof(acpi_srat_mem_affinity) <= subtableHeader.length))
+        {
+            acpi_srat_mem_affinity memAffinity;
+            ACPI::ReadTable(&memAffinity, PhysicalAddress(subtableAddress), sizeof(memAffinity));
+
+            const uint8_t node = (memAffinity.flags & ACPI_SRAT_ENABLED) ? GetDomainNode(memAffinity.proximity_domain) : MAX_NODES;
+            if ((MAX_NODES != node) && (0 != memAffinity.length) && (m_nMemoryRanges < MAX_MEMORY_RANGES))
+            {
+                //! Keep the ranges sorted by address.
+                size_t rangeIndex = m_nMemoryRanges++;
+                for (; (0 < rangeIndex) && (m_memoryRanges[rangeIndex - 1].m_start > memAffinity.base_address); --rangeIndex)
+                    m_memoryRanges[rangeIndex] = m_memoryRanges[rangeIndex - 1];
+
+                m_memoryRanges[rangeIndex].m_start = memAffinity.base_address;
+                m_memoryRanges[rangeIndex].m_end = memAffinity.base_address + memAffinity.length;
+                m_memoryRanges[rangeIndex].m_node = node;
+            }
+        }
+        else if ((ACPI_SRAT_TYPE_CPU_AFFINITY == subtableHeader.type) && (sizeof(acpi_srat_cpu_affinity) <= subtableHeader.length))
+        {
+            acpi_srat_cpu_affinity cpuAffinity;
+            ACPI::ReadTable(&cpuAffinity, PhysicalAddress(subtableAddress), sizeof(cpuAffinity));
+
+            const uint32_t proximityDomain = cpuAffinity.proximity_domain_lo | (cpuAffinity.proximity_domain_hi[0] << 8) |
+                                             (cpuAffinity.proximity_domain_hi[1] << 16) | (cpuAffinity.proximity_domain_hi[2] << 24);
+
+            //! CPUs are indexed by their APIC id.
+            const uint8_t node = (cpuAffinity.flags & ACPI_SRAT_ENABLED) ? GetDomainNode(proximityDomain) : MAX_NODES;
+            if ((MAX_NODES != node) && (cpuAffinity.apic_id < CPU::MAX_CPUS))
+                m_cpuNodes[cpuAffinity.apic_id] = node;
+        }
+        else if ((ACPI_SRAT_TYPE_X2APIC_CPU_AFFINITY == subtableHeader.type) && (sizeof(acpi_srat_x2apic_cpu_affinity) <= subtableHeader.length))
+        {
+            acpi_srat_x2apic_cpu_affinity x2apicAffinity;
+            ACPI::ReadTable(&x2apicAffinity, PhysicalAddress(subtableAddress), sizeof(x2apicAffinity));
+
+            const uint8_t node = (x2apicAffinity.flags & ACPI_SRAT_ENABLED) ? GetDomainNode(x2apicAffinity.proximity_domain) : MAX_NODES;
+            if ((MAX_NODES != node) && (x2apicAffinity.apic_id < CPU::MAX_CPUS))
+                m_cpuNodes[x2apicAffinity.apic_id] = node;
+        }
+
+        subtableAddress += subtableHeader.length;
+    }
+
+    //! A SRAT without any enabled entry describes a single node.
+    if (0 == m_nNodes)
+    {
+        m_proximityDomains[0] = 0;
+        m_nNodes = 1;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NumaTopology::ParseSlit(const PhysicalAddress &slitAddress)
+{
+    acpi_table_slit slit;
+    ACPI::ReadTable(&slit, slitAddress, sizeof(slit));
+
+    const Address_t entriesAddress = slitAddress.Get() + sizeof(acpi_table_header) + sizeof(slit.locality_count);
+
+    //! The SLIT is indexed by proximity domain, a table which doesn't cover every domain is ignored.
+    for (size_t node = 0; node < m_nNodes; ++node)
+    {
+        if (m_proximityDomains[node] >= slit.locality_count)
+            return;
+    }
+
+    for (size_t fromNode = 0; fromNode < m_nNodes; ++fromNode)
+    {
+        for (size_t toNode = 0; toNode < m_nNodes; ++toNode)
+        {
+            const size_t entryIndex = (m_proximityDomains[fromNode] * slit.locality_count) + m_proximityDomains[toNode];
+
+            uint8_t distance = 0;
+            ACPI::ReadTable(&distance, PhysicalAddress(entriesAddress + entryIndex), sizeof(distance));
+
+            //! Remote nodes are never closer than the local one.
+            if ((fromNode != toNode) && (distance > LOCAL_DISTANCE))
+                m_distances[fromNode][toNode] = distance;
+        }
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void NumaTopology::BuildFallbackLists()
+{
+    for (size_t node = 0; node < m_nNodes; ++node)
+    {
+        uint8_t * const pFallbackNodes = m_fallbackNodes[node];
+
+        //! Insertion sort by distance, ties keep the node order and the node itself is always first.
+        for (size_t fallbackIndex = 0; fallbackIndex < m_nNodes; ++fallbackIndex)
+        {
+            const uint8_t fallbackNode = (0 == fallbackIndex) ? node : ((fallbackIndex <= node) ? (fallbackIndex - 1) : fallbackIndex);
+
+            size_t insertIndex = fallbackIndex;
+            for (; (1 < insertIndex) && (m_distances[node][pFallbackNodes[insertIndex - 1]] > m_distances[node][fallbackNode]); --insertIndex)
+                pFallbackNodes[insertIndex] = pFallbackNodes[insertIndex - 1];
+
+            pFallbackNodes[insertIndex] = fallbackNode;
+        }
+    }
+}
+
+} // namespace MM
+
+} // namespace BartOS
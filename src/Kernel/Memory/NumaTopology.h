@@ -0,0 +1,182 @@
+#ifndef NUMA_TOPOLOGY_H
+#define NUMA_TOPOLOGY_H
+
+#include "Kernel/BartOS.h"
+#include "Libraries/Misc/Singleton.h"
+
+#include "Kernel/Arch/x86_64/CPU.h"
+
+#include "PhysicalAddress.h"
+
+namespace BartOS
+{
+
+namespace MM
+{
+
+/*
+ *  @brief The NUMA topology singleton.
+ *
+ *  The memory ranges and the CPUs are assigned to nodes by the ACPI SRAT, the distances between the nodes come
+ *  from the ACPI SLIT. The proximity domains of the SRAT are numbered densely into nodes in the order they are
+ *  first seen. Without a SRAT the whole machine is a single node, without a SLIT every remote node is at
+ *  REMOTE_DISTANCE.
+ *
+ *  Every node has a fallback list of all the nodes ordered by distance from it, starting with the node itself.
+ */
+class NumaTopology : public Singleton<NumaTopology>
+{
+public:
+    static constexpr size_t MAX_NODES = 8;              ///< The maximum number of NUMA nodes.
+    static constexpr size_t MAX_MEMORY_RANGES = 32;     ///< The maximum number of SRAT memory ranges.
+    static constexpr uint8_t LOCAL_DISTANCE = 10;       ///< The distance of a node to itself.
+    static constexpr uint8_t REMOTE_DISTANCE = 20;      ///< The distance to a remote node when there is no SLIT.
+
+    //! Constructor
+    NumaTopology();
+
+    //! Parse the SRAT and SLIT, must run before the PMM is initialized.
+    void Initialize();
+
+    /*
+     *  @brief Get the number of nodes.
+     *
+     *  @return the number of nodes.
+     */
+    size_t GetNodeCount() const;
+
+    /*
+     *  @brief Get the node of a physical address.
+     *  Memory which isn't covered by the SRAT belongs to node 0.
+     *
+     *  @param physicalAddress the physical address.
+     *  @param rangeEnd set to the first address after the run of memory on the same node.
+     *
+     *  @return the node.
+     */
+    uint8_t GetMemoryNode(const PhysicalAddress &physicalAddress, Address_t &rangeEnd) const;
+
+    /*
+     *  @brief Get the node of a CPU.
+     *
+     *  @param cpuIndex the CPU index.
+     *
+     *  @return the node.
+     */
+    uint8_t GetCpuNode(const size_t cpuIndex) const;
+
+    /*
+     *  @brief Get the distance between two nodes.
+     *
+     *  @param fromNode the node the memory is accessed from.
+     *  @param toNode the node of the memory.
+     *
+     *  @return the relative distance, LOCAL_DISTANCE for the same node.
+     */
+    uint8_t GetDistance(const uint8_t fromNode, const uint8_t toNode) const;
+
+    /*
+     *  @brief Get the fallback list of a node.
+     *
+     *  @param node the node.
+     *
+     *  @return the GetNodeCount() nodes ordered by distance from the node, the node itself first.
+     */
+    const uint8_t *GetFallbackNodes(const uint8_t node) const;
+
+private:
+    /*
+     *  @brief The memory range of a node.
+     */
+    class MemoryRange
+    {
+    public:
+        //! Constructor
+        MemoryRange();
+
+        Address_t   m_start;    ///< The start address.
+        Address_t   m_end;      ///< The first address after the range.
+        uint8_t     m_node;     ///< The node.
+    };
+
+    /*
+     *  @brief Get the node of a proximity domain, numbering a new domain.
+     *
+     *  @param proximityDomain the SRAT proximity domain.
+     *
+     *  @return the node, MAX_NODES if there are too many domains.
+     */
+    uint8_t GetDomainNode(const uint32_t proximityDomain);
+
+    /*
+     *  @brief Assign the memory ranges and CPUs to nodes from the SRAT.
+     *
+     *  @param sratAddress the physical address of the SRAT.
+     */
+    void ParseSrat(const PhysicalAddress &sratAddress);
+
+    /*
+     *  @brief Fill the distance table from the SLIT.
+     *
+     *  @param slitAddress the physical address of the SLIT.
+     */
+    void ParseSlit(const PhysicalAddress &slitAddress);
+
+    //! Sort the nodes by distance into the fallback list of every node.
+    void BuildFallbackLists();
+
+    MemoryRange     m_memoryRanges[MAX_MEMORY_RANGES];      ///< The memory ranges, by ascending address.
+    size_t          m_nMemoryRanges;                        ///< The number of memory ranges.
+    uint32_t        m_proximityDomains[MAX_NODES];          ///< The proximity domain of every node.
+    size_t          m_nNodes;                               ///< The number of nodes.
+    uint8_t         m_cpuNodes[CPU::MAX_CPUS];              ///< The node of every CPU.
+    uint8_t         m_distances[MAX_NODES][MAX_NODES];      ///< The distances between the nodes.
+    uint8_t         m_fallbackNodes[MAX_NODES][MAX_NODES];  ///< The fallback list of every node.
+
+    friend class Singleton<NumaTopology>;
+};
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline NumaTopology::MemoryRange::MemoryRange() :
+    m_start(0),
+    m_end(0),
+    m_node(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline size_t NumaTopology::GetNodeCount() const
+{
+    return m_nNodes;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint8_t NumaTopology::GetCpuNode(const size_t cpuIndex) const
+{
+    return m_cpuNodes[cpuIndex];
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint8_t NumaTopology::GetDistance(const uint8_t fromNode, const uint8_t toNode) const
+{
+    return m_distances[fromNode][toNode];
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline const uint8_t *NumaTopology::GetFallbackNodes(const uint8_t node) const
+{
+    return m_fallbackNodes[node];
+}
+
+} // namespace MM
+
+} // namespace BartOS
+
+#endif // NUMA_TOPOLOGY_H
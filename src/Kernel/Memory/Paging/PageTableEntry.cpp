@@ -71,6 +71,15 @@ bool PageTableEntry::SetGlobal(const bool isGlobal)
 
 // ---------------------------------------------------------------------------------------------------------
 
+bool PageTableEntry::SetCopyOnWrite(const bool isCopyOnWrite)
+{
+    Set<CopyOnWrite>(isCopyOnWrite);
+
+    return isCopyOnWrite;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 PageTableEntry::Available::ValueType PageTableEntry::SetAvailable1(const Available::ValueType available1)
 {
     Set<Available>(available1);
@@ -147,6 +156,13 @@ bool PageTableEntry::IsGlobal() const
 
 // ---------------------------------------------------------------------------------------------------------
 
+bool PageTableEntry::IsCopyOnWrite() const
+{
+    return Get<CopyOnWrite>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 PageTableEntry::Available::ValueType PageTableEntry::GetAvailable1() const
 {
     return Get<Available>();
@@ -26,7 +26,8 @@ public:
     typedef BitField<Accessed, 1>           Dirty;              ///< Set by the cpu, ignore.
     typedef BitField<Dirty, 1>              HugePage;           ///< Must be 0 in P1 and P4, creates a 1GiB page in P3, creates a 2MiB page in P2.
     typedef BitField<HugePage, 1>           Global;             ///< Address space switch doesn't flush this page from the TLB. PGE in CR4 must be set.
-    typedef BitField<Global, 3>             Available;          ///< Can be used freely.
+    typedef BitField<Global, 1>             CopyOnWrite;        ///< Software bit, the page was writable and is write protected while its frame is shared.
+    typedef BitField<CopyOnWrite, 2>        Available;          ///< Can be used freely.
     typedef BitField<Available, 40>         PhysicalAddress;    ///< 52 bit physical address (page aligned, 4K, 2M or 1G)
     typedef BitField<PhysicalAddress, 11>   Available2;         ///< Can be used freely.
     typedef BitField<Available2, 1>         NoExecute;          ///< Forbid executing code on this page (NXE bit in the EFER register must be set).
@@ -39,6 +40,7 @@ public:
     bool SetCacheDisabled(const bool isCacheDisabled);
     bool SetHugePage(const bool isHugePage);
     bool SetGlobal(const bool isGlobal);
+    bool SetCopyOnWrite(const bool isCopyOnWrite);
     Available::ValueType SetAvailable1(const Available::ValueType available1);
     Available2::ValueType SetAvailable2(const Available2::ValueType available2);
     bool SetNoExecute(const bool isNoExecute);
@@ -51,6 +53,7 @@ public:
     bool IsCacheDisabled() const;
     bool IsHugePage() const;
     bool IsGlobal() const;
+    bool IsCopyOnWrite() const;
     Available::ValueType GetAvailable1() const;
     Available2::ValueType GetAvailable2() const;
     bool IsNoExecute() const;
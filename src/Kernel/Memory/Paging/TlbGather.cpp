@@ -0,0 +1,245 @@
+#include "TlbGather.h"
+
+#include "Kernel/Arch/x86_64/CPU.h"
+#include "Kernel/Memory/AddressSpace.h"
+#include "Kernel/Memory/Pmm.h"
+#include "Kernel/Memory/Vmm.h"
+
+namespace BartOS
+{
+
+namespace MM
+{
+
+size_t TlbGather::m_flushAllThreshold = TlbGather::DEFAULT_FLUSH_ALL_THRESHOLD;
+TlbGather::Counters TlbGather::m_counters;
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+TlbGather::TlbGather(AddressSpace &addressSpace) :
+    m_addressSpace(addressSpace),
+    m_nRanges(0),
+    m_nTables(0),
+    m_nPages(0),
+    m_nRequestedPages(0),
+    m_isFlushAll(false),
+    m_isHigherHalf(false)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+TlbGather::~TlbGather()
+{
+    Commit();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void TlbGather::Add(const VirtualAddress &virtualAddress, const size_t nBytes, const PageSize pageSize)
+{
+    const Address_t startAddress = ALIGN((virtualAddress.Get()), (pageSize));
+    const Address_t endAddress = ALIGN_TO_NEXT_BOUNDARY((virtualAddress.Get() + nBytes), (pageSize));
+    const size_t nPages = (endAddress - startAddress) / pageSize;
+    m_nRequestedPages += nPages;
+    if (DIRECT_MAP_ADDR <= startAddress)
+        m_isHigherHalf = true;
+
+    //! Batches grow sequentially, extend the last range when the new one follows or overlaps it.
+    if (0 < m_nRanges)
+    {
+        FlushRange &lastRange = m_ranges[m_nRanges - 1];
+        if ((lastRange.m_pageSize == pageSize) && (lastRange.m_startAddress <= startAddress) && (startAddress <= lastRange.m_endAddress))
+        {
+            if (endAddress > lastRange.m_endAddress)
+            {
+                m_nPages += (endAddress - lastRange.m_endAddress) / pageSize;
+                lastRange.m_endAddress = endAddress;
+            }
+
+            return;
+        }
+    }
+
+    m_nPages += nPages;
+    if (MAX_RANGES == m_nRanges)
+    {
+        m_isFlushAll = true;
+        return;
+    }
+
+    FlushRange &range = m_ranges[m_nRanges++];
+    range.m_startAddress = startAddress;
+    range.m_endAddress = endAddress;
+    range.m_pageSize = pageSize;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void TlbGather::AddNewPage()
+{
+    ++m_counters.m_nAvoidedFlushes;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void TlbGather::RemoveTable(const PhysicalAddress &physicalAddress)
+{
+    if (MAX_TABLES == m_nTables)
+        Commit();
+
+    m_tables[m_nTables++] = physicalAddress;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void TlbGather::Commit()
+{
+    if ((0 == m_nRequestedPages) && (0 == m_nTables))
+        return;
+
+    //! The tables left over from a commit on a full table array were unlinked along with ranges already flushed.
+    if (0 < m_nRequestedPages)
+    {
+        Vmm &vmm = Vmm::Get();
+        const bool isFlushAll = m_isFlushAll || (m_nPages > m_flushAllThreshold);
+
+        //! The higher half is cached by the active address space whichever address space changed it. Without PCIDs the
+        //! TLB holds nothing else than the active address space.
+        size_t nIssued = 0;
+        if (m_isHigherHalf && isFlushAll)
+        {
+            FlushAllGlobal();
+            ++m_counters.m_nGlobalFlushes;
+            nIssued = 1;
+        }
+        else if (m_isHigherHalf || vmm.IsAddressSpaceActive(m_addressSpace))
+        {
+            nIssued = InvalidateActive(isFlushAll);
+        }
+        else if (vmm.m_isPcidEnabled)
+        {
+            nIssued = InvalidateInactive(isFlushAll);
+        }
+
+        //! invlpg only drops the paging structure caches of the active PCID, the global flush drops them all.
+        if (m_isHigherHalf && (!isFlushAll) && (0 < m_nTables))
+            vmm.InvalidateOtherPcids();
+
+        m_counters.m_nAvoidedFlushes += m_nRequestedPages - nIssued;
+        ++m_counters.m_nBatches;
+    }
+
+    //! Nothing can reach the tables anymore.
+    for (const PhysicalAddress &physicalAddress : Range(m_tables, m_nTables))
+        Pmm::Get().ReturnPageTable(physicalAddress);
+
+    m_nRanges = 0;
+    m_nTables = 0;
+    m_nPages = 0;
+    m_nRequestedPages = 0;
+    m_isFlushAll = false;
+    m_isHigherHalf = false;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void TlbGather::SetFlushAllThreshold(const size_t nPages)
+{
+    m_flushAllThreshold = nPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+TlbGather::Counters TlbGather::GetCounters()
+{
+    return m_counters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t TlbGather::InvalidateActive(const bool isFlushAll)
+{
+    if (isFlushAll)
+    {
+        FlushAll();
+        ++m_counters.m_nFlushAlls;
+
+        return 1;
+    }
+
+    for (const FlushRange &range : Range(m_ranges, m_nRanges))
+    {
+        for (Address_t address = range.m_startAddress; address < range.m_endAddress; address += range.m_pageSize)
+            CPU::Invlpg(address);
+    }
+
+    m_counters.m_nInvlpgs += m_nPages;
+
+    return m_nPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t TlbGather::InvalidateInactive(const bool isFlushAll)
+{
+    Vmm &vmm = Vmm::Get();
+
+    //! A PCID of an older generation is flushed before it tags anything again.
+    if (m_addressSpace.m_pcidGeneration != vmm.m_pcidGeneration)
+        return 0;
+
+    if (!vmm.m_isInvpcidSupported)
+    {
+        vmm.DropPcid(m_addressSpace);
+        return 0;
+    }
+
+    if (isFlushAll)
+    {
+        CPU::Invpcid(CPU::INVPCID_CONTEXT, m_addressSpace.m_pcid, 0);
+        ++m_counters.m_nFlushAlls;
+
+        return 1;
+    }
+
+    for (const FlushRange &range : Range(m_ranges, m_nRanges))
+    {
+        for (Address_t address = range.m_startAddress; address < range.m_endAddress; address += range.m_pageSize)
+            CPU::Invpcid(CPU::INVPCID_ADDRESS, m_addressSpace.m_pcid, address);
+    }
+
+    m_counters.m_nInvpcids += m_nPages;
+
+    return m_nPages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void TlbGather::FlushAll()
+{
+    CPU::SetCR3(CPU::GetCR3());
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void TlbGather::FlushAllGlobal()
+{
+    if (Vmm::Get().m_isInvpcidSupported)
+    {
+        CPU::Invpcid(CPU::INVPCID_ALL_GLOBAL, 0, 0);
+        return;
+    }
+
+    //! Clearing PGE invalidates all the translations of all the PCIDs, global ones included.
+    CPU::CR4 cr4 = CPU::GetCR4();
+    cr4.Set<CPU::CR4::PageGlobalEnabled>(false);
+    CPU::SetCR4(cr4);
+    cr4.Set<CPU::CR4::PageGlobalEnabled>(true);
+    CPU::SetCR4(cr4);
+}
+
+} // namespace MM
+
+} // namespace BartOS
@@ -0,0 +1,169 @@
+#ifndef TLB_GATHER_H
+#define TLB_GATHER_H
+
+#include "Kernel/BartOS.h"
+
+namespace BartOS
+{
+
+namespace MM
+{
+
+//! Forward declare the address space.
+class AddressSpace;
+
+/*
+ *  @brief Gather the TLB invalidations of a batch of page table changes.
+ *
+ *  The ranges whose translations changed are collected and invalidated once, on commit: one invlpg per page for
+ *  small batches, a single CR3 reload past the flush all threshold. The page tables unlinked during the batch are
+ *  only freed after the flush, the page walker may still reach them through the paging structure caches until then.
+ *  The gather commits on destruction.
+ *
+ *  With PCIDs, an inactive address space is invalidated in its own PCID with INVPCID, or loses its PCID without
+ *  INVPCID. The higher half pages are global, invlpg drops them from every PCID but a CR3 reload keeps them: a
+ *  higher half batch past the threshold flushes the global pages too. The other PCIDs are only retired when higher
+ *  half tables were removed, their paging structure caches may still point to them.
+ */
+class TlbGather
+{
+public:
+    /*
+     *  @brief The TLB invalidation counters, over all the batches.
+     */
+    class Counters
+    {
+    public:
+        //! Constructor
+        Counters();
+
+        size_t m_nBatches;          ///< The number of committed batches which invalidated translations.
+        size_t m_nInvlpgs;          ///< The number of invlpg issued.
+        size_t m_nInvpcids;         ///< The number of single address INVPCID issued for inactive address spaces.
+        size_t m_nFlushAlls;        ///< The number of CR3 reloads or single context INVPCID issued.
+        size_t m_nGlobalFlushes;    ///< The number of flushes of all the translations, global pages included.
+        size_t m_nAvoidedFlushes;   ///< The number of page invalidations requested but not issued, merged, not needed or covered by a CR3 reload.
+    };
+
+    /*
+     *  @brief Constructor.
+     *
+     *  @param addressSpace the address space whose page tables the batch changes.
+     */
+    TlbGather(AddressSpace &addressSpace);
+
+    //! Destructor, commits the batch.
+    ~TlbGather();
+
+    /*
+     *  @brief Add a range whose translations changed.
+     *
+     *  @param virtualAddress the virtual address of the range.
+     *  @param nBytes the size of the range.
+     *  @param pageSize the size of the pages which could be cached for the range, a single invlpg invalidates a page.
+     */
+    void Add(const VirtualAddress &virtualAddress, const size_t nBytes, const PageSize pageSize = PAGE_4K);
+
+    /*
+     *  @brief Account for a page mapped over a non present entry.
+     *  Non present translations are never cached, there's nothing to invalidate.
+     */
+    void AddNewPage();
+
+    /*
+     *  @brief Free a page table after the flush.
+     *  The batch is committed first when there's no room left for the table.
+     *
+     *  @param physicalAddress the physical address of the unlinked page table.
+     */
+    void RemoveTable(const PhysicalAddress &physicalAddress);
+
+    //! Invalidate the gathered ranges and free the gathered page tables, the gather can be reused afterwards.
+    void Commit();
+
+    /*
+     *  @brief Set the number of page invalidations above which a batch reloads CR3 instead.
+     *
+     *  @param nPages the number of pages, 0 always reloads CR3.
+     */
+    static void SetFlushAllThreshold(const size_t nPages);
+
+    /*
+     *  @brief Get the TLB invalidation counters.
+     *
+     *  @return the counters.
+     */
+    static Counters GetCounters();
+
+private:
+    static constexpr size_t MAX_RANGES = 16;            ///< The number of ranges gathered before the batch falls back to a CR3 reload.
+    static constexpr size_t MAX_TABLES = 32;            ///< The number of page tables gathered before the batch is committed.
+    static constexpr size_t DEFAULT_FLUSH_ALL_THRESHOLD = 32;   ///< The default number of pages above which a batch reloads CR3.
+
+    /*
+     *  @brief A gathered range, invalidated with one invlpg per page.
+     */
+    class FlushRange
+    {
+    public:
+        Address_t   m_startAddress; ///< The start address of the range.
+        Address_t   m_endAddress;   ///< The end address of the range.
+        PageSize    m_pageSize;     ///< The stride of the invlpg.
+    };
+
+    /*
+     *  @brief Invalidate the gathered ranges in the active PCID.
+     *
+     *  @param isFlushAll whether to reload CR3 instead of invalidating the pages.
+     *
+     *  @return the number of invalidations issued.
+     */
+    size_t InvalidateActive(const bool isFlushAll);
+
+    /*
+     *  @brief Invalidate the gathered ranges in the PCID of the inactive address space.
+     *
+     *  @param isFlushAll whether to invalidate the whole PCID instead of the pages.
+     *
+     *  @return the number of invalidations issued.
+     */
+    size_t InvalidateInactive(const bool isFlushAll);
+
+    //! Reload CR3, which invalidates all the non global translations of the active PCID.
+    static void FlushAll();
+
+    //! Invalidate all the translations of all the PCIDs, global pages included.
+    static void FlushAllGlobal();
+
+    AddressSpace    &m_addressSpace;        ///< The address space whose page tables the batch changes.
+    FlushRange      m_ranges[MAX_RANGES];   ///< The gathered ranges.
+    PhysicalAddress m_tables[MAX_TABLES];   ///< The gathered page tables.
+    size_t          m_nRanges;              ///< The number of gathered ranges.
+    size_t          m_nTables;              ///< The number of gathered page tables.
+    size_t          m_nPages;               ///< The number of invlpg the gathered ranges need.
+    size_t          m_nRequestedPages;      ///< The number of page invalidations requested by the batch.
+    bool            m_isFlushAll;           ///< Whether the ranges overflowed, the batch reloads CR3.
+    bool            m_isHigherHalf;         ///< Whether a range is in the higher half, which all the address spaces share.
+
+    static size_t   m_flushAllThreshold;    ///< The number of pages above which a batch reloads CR3.
+    static Counters m_counters;             ///< The TLB invalidation counters.
+};
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline TlbGather::Counters::Counters() :
+    m_nBatches(0),
+    m_nInvlpgs(0),
+    m_nInvpcids(0),
+    m_nFlushAlls(0),
+    m_nGlobalFlushes(0),
+    m_nAvoidedFlushes(0)
+{
+}
+
+} // namespace MM
+
+} // namespace BartOS
+
+#endif // TLB_GATHER_H
@@ -8,17 +8,22 @@ namespace BartOS
 namespace MM
 {
 
-PhysicalPage::PhysicalPage(const PhysicalAddress paddr) :
-    m_addr(paddr)
+PhysicalPage::PhysicalPage() :
+    m_mapCount(0),
+    m_flags(),
+    m_freeListHook()
 {
+    SetReserved(true);
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
 PhysicalPage::PhysicalPage(PhysicalPage &&rhs) : 
-    m_addr(std::move(rhs.m_addr))
+    Parent(std::forward<Parent &&>(rhs)),
+    m_mapCount(rhs.m_mapCount),
+    m_flags(rhs.m_flags),
+    m_freeListHook()
 {
-    rhs.m_addr.Set(0);
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -26,7 +31,8 @@ PhysicalPage::PhysicalPage(PhysicalPage &&rhs) :
 PhysicalPage &PhysicalPage::operator=(PhysicalPage &&rhs)
 {
     Parent::operator=(std::forward<Parent &&>(rhs));
-    m_addr = std::move(rhs.m_addr);
+    m_mapCount = rhs.m_mapCount;
+    m_flags = rhs.m_flags;
 
     return *this;
 }
@@ -37,14 +43,21 @@ void PhysicalPage::OnDie(Parent &object)
 {
     PhysicalPage &physicalPage = static_cast<PhysicalPage &>(object);
 
-    Pmm::Get().ReturnPage(&physicalPage);
+    Pmm::Get().FreePage(&physicalPage);
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
 PhysicalAddress PhysicalPage::GetAddress() const
 {
-    return m_addr;
+    return PhysicalAddress(GetPfn() * PAGE_SIZE);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t PhysicalPage::GetPfn() const
+{
+    return Pmm::Get().m_memoryPool.PageToPfn(this);
 }
 
 } // namespace MM
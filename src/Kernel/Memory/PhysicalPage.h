@@ -3,9 +3,12 @@
 
 #include "Kernel/BartOS.h"
 #include "Libraries/Misc/RefCounter.h"
+#include "Libraries/Misc/BitFields.h"
 
 #include "frg/list.hpp"
 
+#include <new>
+
 namespace BartOS
 {
 
@@ -14,13 +17,45 @@ namespace MM
 
 class Pmm;
 class MemoryPool;
+class AddressSpace;
 
+/*
+ *  @brief The physical page descriptor.
+ *  One descriptor exists for every page frame in the memmap, so the layout is kept to 32 bytes:
+ *  the ref count, the map count, a flags word and the free list hook. The page address is not
+ *  stored, it is derived from the position of the descriptor in the memmap.
+ *
+ *  The free list hook is only in use while the page is on a free list, a mapped movable page
+ *  reuses its storage for the reverse mapping of its single page table entry. A merged page links
+ *  into the merge table through the free list hook, its map count is its number of sharers.
+ *
+ *  A physical range is owned as a whole through its first page: the head carries the only ref count
+ *  of the range and reuses the free list hook storage for the range length, the other pages of the
+ *  range are not referenced individually.
+ */
 class PhysicalPage : public RefCounter<PhysicalPage>
 {
 public:
     typedef RefCounter<PhysicalPage> Parent;    ///< The ref counter parent typedef.
 
-    static constexpr uint16_t m_pageSize = PAGE_SIZE;   ///< The page size.
+    //! Page flags.
+    class Flags : public Bitmap<32>
+    {
+    public:
+        typedef BitField<Flags, 4>          Order;      ///< The order of the buddy block headed by the page.
+        typedef BitField<Order, 5>          Region;     ///< The index of the memory region containing the page.
+        typedef BitField<Region, 1>         Free;       ///< The page heads a block in the buddy free lists.
+        typedef BitField<Free, 1>           Reserved;   ///< The page is not backed by usable memory.
+        typedef BitField<Reserved, 2>       HugePage;   ///< The huge page size of the pool the page heads a frame of.
+        typedef BitField<HugePage, 1>       Movable;    ///< The page is mapped once and can be migrated through its reverse mapping.
+        typedef BitField<Movable, 1>        Reported;   ///< The free block headed by the page was reported to the hypervisor as unused.
+        typedef BitField<Reported, 1>       Merged;     ///< The page is a frame shared read-only by pages of identical contents.
+        typedef BitField<Merged, 1>         RangeHead;  ///< The page heads a physical range, its ref count holds the whole range.
+        typedef BitField<RangeHead, 15>     Checksum;   ///< The contents checksum of the page when the merge scanner last visited it.
+    };
+
+    static constexpr uint16_t m_pageSize = PAGE_SIZE;               ///< The page size.
+    static constexpr uint16_t m_checksumMask = (1U << 15) - 1;      ///< The checksum bits the page flags have room for.
 
     /*
      *  @brief Get the physical address of the page
@@ -29,22 +64,95 @@ public:
      */
     PhysicalAddress GetAddress() const;
 
-    frg::default_list_hook<PhysicalPage> m_freeListHook;    ///< frg intrusive list interface.
+    /*
+     *  @brief Get the page frame number of the page
+     * 
+     *  @return the page frame number of the page.
+     */
+    size_t GetPfn() const;
+
+    /*
+     *  @brief Is the page the head of a free buddy block.
+     * 
+     *  @return whether the page is the head of a free buddy block.
+     */
+    bool IsFree() const;
+
+    /*
+     *  @brief Get the buddy order of the page.
+     * 
+     *  @return the buddy order of the page.
+     */
+    uint8_t GetOrder() const;
+
+    /*
+     *  @brief Is the page reserved, i.e. not backed by usable memory.
+     *  Reserved pages are never handed out by the buddy allocator.
+     * 
+     *  @return whether the page is reserved.
+     */
+    bool IsReserved() const;
+
+    /*
+     *  @brief Get the number of page table entries mapping the page.
+     * 
+     *  @return the map count.
+     */
+    uint16_t GetMapCount() const;
+
+    /*
+     *  @brief Increment the map count.
+     */
+    void IncrementMapCount();
+
+    /*
+     *  @brief Decrement the map count.
+     * 
+     *  @return the new map count.
+     */
+    uint16_t DecrementMapCount();
+
+    /*
+     *  @brief Is the page movable, i.e. mapped by a single page table entry recorded in its reverse mapping.
+     * 
+     *  @return whether the page is movable.
+     */
+    bool IsMovable() const;
+
+    /*
+     *  @brief Is the page merged, i.e. shared read-only by pages of identical contents.
+     * 
+     *  @return whether the page is merged.
+     */
+    bool IsMerged() const;
+
+    /*
+     *  @brief Is the page the head of a physical range, i.e. the page holding the ref count of the whole range.
+     * 
+     *  @return whether the page heads a physical range.
+     */
+    bool IsRangeHead() const;
 
 private:
+    /*
+     *  @brief The page table entry mapping a movable page.
+     */
+    struct ReverseMapping
+    {
+        AddressSpace    *m_pAddressSpace;   ///< The address space of the mapping.
+        VirtualAddress  m_virtualAddress;   ///< The virtual address of the mapping.
+    };
 
-    //! Disable default and copy construction.
-    PhysicalPage() = delete;
+    //! Disable copy construction.
     PhysicalPage(const PhysicalPage &rhs) = delete;
     PhysicalPage &operator=(const PhysicalPage &rhs) = delete;
 
     /*
      *  @brief Constructor
-     *  Only the MemoryPool can create a physical page.
-     * 
-     *  @param paddr the physical address.
+     *  Only the MemoryPool can create a physical page. The page starts out reserved,
+     *  its address is derived from its position in the memmap.
      */
-    PhysicalPage(const PhysicalAddress paddr);
+    PhysicalPage();
 
     /*
      *  @brief Move constructor
@@ -69,12 +177,311 @@ private:
     //! RefCounter interface
     static void OnDie(Parent &object);
 
-    PhysicalAddress m_addr;     ///< The physical address of the page.
+    /*
+     *  @brief Set the buddy order of the page.
+     * 
+     *  @param order the buddy order.
+     */
+    void SetOrder(const uint8_t order);
+
+    /*
+     *  @brief Get the index of the memory region containing the page.
+     * 
+     *  @return the memory region index.
+     */
+    uint8_t GetRegion() const;
+
+    /*
+     *  @brief Set the index of the memory region containing the page.
+     * 
+     *  @param regionIndex the memory region index.
+     */
+    void SetRegion(const uint8_t regionIndex);
+
+    /*
+     *  @brief Set whether the page heads a block in the buddy free lists.
+     * 
+     *  @param isFree whether the page is free.
+     */
+    void SetFree(const bool isFree);
+
+    /*
+     *  @brief Set whether the page is reserved.
+     * 
+     *  @param isReserved whether the page is reserved.
+     */
+    void SetReserved(const bool isReserved);
+
+    /*
+     *  @brief Get the huge page size of the pool the page heads a frame of.
+     * 
+     *  @return the huge page size, MemoryPool::HUGE_PAGE_NONE if the page doesn't head a huge page.
+     */
+    uint8_t GetHugePageSize() const;
+
+    /*
+     *  @brief Set the huge page size of the pool the page heads a frame of.
+     * 
+     *  @param hugePageSize the huge page size.
+     */
+    void SetHugePageSize(const uint8_t hugePageSize);
+
+    /*
+     *  @brief Set whether the page is movable.
+     *  The reverse mapping and the free list hook share storage, switching reinitializes the one in use.
+     * 
+     *  @param isMovable whether the page is movable.
+     */
+    void SetMovable(const bool isMovable);
+
+    /*
+     *  @brief Was the free block headed by the page reported to the hypervisor.
+     * 
+     *  @return whether the block was reported.
+     */
+    bool IsReported() const;
+
+    /*
+     *  @brief Set whether the free block headed by the page was reported to the hypervisor.
+     * 
+     *  @param isReported whether the block was reported.
+     */
+    void SetReported(const bool isReported);
+
+    /*
+     *  @brief Set whether the page is merged.
+     * 
+     *  @param isMerged whether the page is merged.
+     */
+    void SetMerged(const bool isMerged);
+
+    /*
+     *  @brief Set whether the page heads a physical range.
+     *  The range length and the free list hook share storage, clearing reinitializes the hook.
+     * 
+     *  @param isRangeHead whether the page heads a physical range.
+     *  @param nRangePages the number of pages of the range.
+     */
+    void SetRangeHead(const bool isRangeHead, const size_t nRangePages = 0);
+
+    /*
+     *  @brief Get the number of pages of the physical range headed by the page.
+     * 
+     *  @return the number of pages of the range.
+     */
+    size_t GetRangePages() const;
+
+    /*
+     *  @brief Get the contents checksum recorded by the merge scanner.
+     * 
+     *  @return the checksum.
+     */
+    uint16_t GetChecksum() const;
+
+    /*
+     *  @brief Record the contents checksum of the page.
+     * 
+     *  @param checksum the checksum.
+     */
+    void SetChecksum(const uint16_t checksum);
+
+    uint16_t                                    m_mapCount;         ///< The number of page table entries mapping the page.
+    Flags                                       m_flags;            ///< The page flags.
+    union
+    {
+        frg::default_list_hook<PhysicalPage>    m_freeListHook;     ///< frg intrusive list interface, while the page isn't movable.
+        ReverseMapping                          m_reverseMapping;   ///< The reverse mapping, while the page is movable.
+        size_t                                  m_nRangePages;      ///< The number of pages of the range, while the page heads one.
+    };
 
     friend class MemoryPool;
     friend class RefCounter<PhysicalPage>;
 };
 
+// ---------------------------------------------------------------------------------------------------------
+
+inline bool PhysicalPage::IsFree() const
+{
+    return m_flags.Get<Flags::Free>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint8_t PhysicalPage::GetOrder() const
+{
+    return m_flags.Get<Flags::Order>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline bool PhysicalPage::IsReserved() const
+{
+    return m_flags.Get<Flags::Reserved>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint16_t PhysicalPage::GetMapCount() const
+{
+    return m_mapCount;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::IncrementMapCount()
+{
+    ++m_mapCount;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint16_t PhysicalPage::DecrementMapCount()
+{
+    ASSERT(m_mapCount > 0);
+
+    return --m_mapCount;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetOrder(const uint8_t order)
+{
+    m_flags.Set<Flags::Order>(order);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint8_t PhysicalPage::GetRegion() const
+{
+    return m_flags.Get<Flags::Region>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetRegion(const uint8_t regionIndex)
+{
+    m_flags.Set<Flags::Region>(regionIndex);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetFree(const bool isFree)
+{
+    m_flags.Set<Flags::Free>(isFree);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetReserved(const bool isReserved)
+{
+    m_flags.Set<Flags::Reserved>(isReserved);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint8_t PhysicalPage::GetHugePageSize() const
+{
+    return m_flags.Get<Flags::HugePage>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetHugePageSize(const uint8_t hugePageSize)
+{
+    m_flags.Set<Flags::HugePage>(hugePageSize);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline bool PhysicalPage::IsMovable() const
+{
+    return m_flags.Get<Flags::Movable>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetMovable(const bool isMovable)
+{
+    if (isMovable)
+        new (&m_reverseMapping) ReverseMapping();
+    else
+        new (&m_freeListHook) frg::default_list_hook<PhysicalPage>();
+
+    m_flags.Set<Flags::Movable>(isMovable);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline bool PhysicalPage::IsReported() const
+{
+    return m_flags.Get<Flags::Reported>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetReported(const bool isReported)
+{
+    m_flags.Set<Flags::Reported>(isReported);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline bool PhysicalPage::IsMerged() const
+{
+    return m_flags.Get<Flags::Merged>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetMerged(const bool isMerged)
+{
+    m_flags.Set<Flags::Merged>(isMerged);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline bool PhysicalPage::IsRangeHead() const
+{
+    return m_flags.Get<Flags::RangeHead>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetRangeHead(const bool isRangeHead, const size_t nRangePages)
+{
+    if (isRangeHead)
+        m_nRangePages = nRangePages;
+    else
+        new (&m_freeListHook) frg::default_list_hook<PhysicalPage>();
+
+    m_flags.Set<Flags::RangeHead>(isRangeHead);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline size_t PhysicalPage::GetRangePages() const
+{
+    ASSERT(IsRangeHead());
+
+    return m_nRangePages;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline uint16_t PhysicalPage::GetChecksum() const
+{
+    return m_flags.Get<Flags::Checksum>();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void PhysicalPage::SetChecksum(const uint16_t checksum)
+{
+    m_flags.Set<Flags::Checksum>(checksum);
+}
+
+static_assert(sizeof(PhysicalPage) <= 32, "The physical page descriptor must not exceed 32 bytes");
+
 } // namespace MM
 
 } // namespace BartOS
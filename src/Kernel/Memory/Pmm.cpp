@@ -1,4 +1,5 @@
 #include "Pmm.h"
+#include "Vmm.h"
 #include "Kernel/Multiboot2.h"
 
 #include "frg/list.hpp"
@@ -21,6 +22,32 @@ const char * memoryToStringArray[] =
     "MEMORY_BADRAM",
 };
 
+const char * zoneToStringArray[] = 
+{
+    "ZONE_DMA",
+    "ZONE_DMA32",
+    "ZONE_NORMAL",
+};
+
+//! The number of huge pages reserved at boot, before physical memory fragments.
+#ifndef BOOT_HUGE_PAGES_2M
+#define BOOT_HUGE_PAGES_2M 0
+#endif
+
+#ifndef BOOT_HUGE_PAGES_1G
+#define BOOT_HUGE_PAGES_1G 0
+#endif
+
+//! The number of pages the same-page merging scanner visits per batch, merging is off by default.
+#ifndef SAME_PAGE_MERGING_BATCH
+#define SAME_PAGE_MERGING_BATCH 0
+#endif
+
+//! The size of the CMA region in MiB, its pages stay usable by movable allocations until a contiguous allocation needs them.
+#ifndef CMA_SIZE_MB
+#define CMA_SIZE_MB 16
+#endif
+
 } // namespace
 
 // ---------------------------------------------------------------------------------------------------------
@@ -46,23 +73,57 @@ StatusCode Pmm::Initialize(const multiboot_tag_mmap *pMmapTag)
     {
         kprintf("[PMM] Memory region start=%p length=%p type=%s\n", pMmapEntry->addr, pMmapEntry->len, memoryToStringArray[pMmapEntry->type - 1]);
 
-        if (MULTIBOOT_MEMORY_AVAILABLE == pMmapEntry->type)
+        //! The ACPI reclaimable memory stays reserved until the tables have been parsed.
+        if ((MULTIBOOT_MEMORY_AVAILABLE == pMmapEntry->type) || (MULTIBOOT_MEMORY_ACPI_RECLAIMABLE == pMmapEntry->type))
         {
             MemoryPool::MemoryRegion memoryRegion;
             memoryRegion.m_addr = PhysicalAddress(static_cast<Address_t>(pMmapEntry->addr));
             memoryRegion.m_size = pMmapEntry->len;
+            memoryRegion.m_isReclaimable = (MULTIBOOT_MEMORY_ACPI_RECLAIMABLE == pMmapEntry->type);
 
             m_memoryPool.AddMemoryRegion(memoryRegion);
         }
     }
 
-    set_kmalloc_eternal_ptr(m_memoryPool.m_pPool + m_memoryPool.m_poolSize + 1);
+    m_memoryPool.Initialize();
+
+    //! The gigantic pages go first, they need whole naturally aligned 1 GiB frames.
+    ResizeHugePagePool(PAGE_1G, BOOT_HUGE_PAGES_1G);
+    ResizeHugePagePool(PAGE_2M, BOOT_HUGE_PAGES_2M);
+
+    //! The CMA region only needs max order blocks, it comes after the huge pages.
+    m_memoryPool.InitializeCma((CMA_SIZE_MB * MiB) / PAGE_SIZE);
 
-    kprintf("[PMM] PMM initialized. Pool start=%p, Page count=%u, Page handle size=%u\n", m_memoryPool.m_pPool, m_memoryPool.m_poolSize,
+    SetMergeBatch(SAME_PAGE_MERGING_BATCH);
+
+    kprintf("[PMM] PMM initialized. Pool start=%p, Page count=%lu, Page handle size=%u\n", m_memoryPool.m_pPool, m_memoryPool.m_nPages,
             sizeof(PhysicalPage));
+    kprintf("[PMM] Memmap sections: %lu present of %lu, %lu initialized at boot, %lu pages per section\n", m_memoryPool.m_nPresentSections,
+            m_memoryPool.m_nSections, m_memoryPool.m_nInitializedSections, MemoryPool::PAGES_PER_SECTION);
     kprintf("[PMM] Total system memory: %u MiB\n", GetMemoryStats().m_totalMemory / MiB);
     kprintf("[PMM] Memory used by PMM: %u MiB\n", (sizeof(PhysicalPage) * m_memoryPool.m_poolSize) / MiB);
 
+    for (size_t zone = 0; zone < MemoryPool::MAX_ZONES; ++zone)
+    {
+        const MemoryStats zoneStats = GetZoneMemoryStats(static_cast<MemoryPool::ZoneType>(zone));
+        kprintf("[PMM] %s: start pfn=%p total=%lu MiB free=%lu MiB\n", zoneToStringArray[zone],
+                MemoryPool::GetZoneStartPfn(static_cast<MemoryPool::ZoneType>(zone)), zoneStats.m_totalMemory / MiB, zoneStats.m_freeMemory / MiB);
+    }
+
+    for (size_t node = 0; node < GetNodeCount(); ++node)
+    {
+        const MemoryStats nodeStats = GetNodeMemoryStats(node);
+        kprintf("[PMM] Node %lu: start pfn=%p end pfn=%p total=%lu MiB free=%lu MiB\n", node, m_memoryPool.m_nodes[node].m_startPfn,
+                m_memoryPool.m_nodes[node].m_endPfn, nodeStats.m_totalMemory / MiB, nodeStats.m_freeMemory / MiB);
+    }
+
+    kprintf("[PMM] Huge page pools: 2M=%lu/%u 1G=%lu/%u\n", GetHugePageStats(PAGE_2M).m_totalMemory / (2 * MiB), BOOT_HUGE_PAGES_2M,
+            GetHugePageStats(PAGE_1G).m_totalMemory / GiB, BOOT_HUGE_PAGES_1G);
+    kprintf("[PMM] Page colors: %lu\n", m_memoryPool.m_nPageColors);
+    kprintf("[PMM] Same-page merging: %lu pages per batch\n", m_memoryPool.m_mergeBatch);
+    kprintf("[PMM] CMA region: %lu/%u MiB start pfn=%p\n", (GetCmaStats().m_nPages * PAGE_SIZE) / MiB, CMA_SIZE_MB,
+            m_memoryPool.m_cmaStartPfn);
+
     m_isInitialized = true;
 
     return STATUS_CODE_SUCCESS;
@@ -70,16 +131,76 @@ StatusCode Pmm::Initialize(const multiboot_tag_mmap *pMmapTag)
 
 // ---------------------------------------------------------------------------------------------------------
 
-const PhysicalPage *Pmm::AllocatePage()
+void Pmm::ReclaimBootMemory()
 {
-    return m_memoryPool.AllocatePage();
+    size_t nAcpiPages = 0;
+    for (MemoryPool::MemoryRegion &region : Range(m_memoryPool.m_memoryRegions, m_memoryPool.m_nMemoryRegions))
+    {
+        if (!region.m_isReclaimable)
+            continue;
+
+        nAcpiPages += m_memoryPool.ReleasePageRun(m_memoryPool.PageToPfn(region.m_pPages), region.m_nPages);
+        region.m_isReclaimable = false;
+    }
+
+    //! The partial pages of the boot info are shared with the kernel image or the kmalloc eternal arena.
+    size_t nBootInfoPages = 0;
+    if (g_pBootInfo)
+    {
+        const Address_t bootInfoAddress = PhysicalAddress::Create(VirtualAddress(reinterpret_cast<Address_t>(g_pBootInfo))).Get();
+        const size_t startPfn = ALIGN_TO_NEXT_BOUNDARY(bootInfoAddress, PAGE_SIZE) / PAGE_SIZE;
+        const size_t endPfn = ALIGN((bootInfoAddress + g_pBootInfo->total_size), (PAGE_SIZE)) / PAGE_SIZE;
+
+        //! The multiboot tags are gone from here on.
+        g_pBootInfo = nullptr;
+
+        if (startPfn < endPfn)
+            nBootInfoPages = m_memoryPool.ReleasePageRun(startPfn, endPfn - startPfn);
+    }
+
+    const size_t nKernelPages = Vmm::Get().ReleaseKernelAreaTail();
+
+    //! The boot reservations are final now, the watermarks follow the memory the zones really manage.
+    m_memoryPool.SetWatermarks();
+
+    kprintf("[PMM] Reclaimed boot memory: boot info=%lu KiB ACPI=%lu KiB kmalloc eternal=%lu KiB total=%lu KiB\n",
+            (nBootInfoPages * PAGE_SIZE) / KiB, (nAcpiPages * PAGE_SIZE) / KiB, (nKernelPages * PAGE_SIZE) / KiB,
+            ((nBootInfoPages + nAcpiPages + nKernelPages) * PAGE_SIZE) / KiB);
+
+    for (size_t zone = 0; zone < MemoryPool::MAX_ZONES; ++zone)
+    {
+        size_t watermarks[MemoryPool::MAX_WATERMARKS] = {};
+        for (const MemoryPool::Node &node : Range(m_memoryPool.m_nodes, m_memoryPool.m_nNodes))
+        {
+            for (size_t watermark = 0; watermark < MemoryPool::MAX_WATERMARKS; ++watermark)
+                watermarks[watermark] += node.m_zones[zone].m_watermarks[watermark];
+        }
+
+        kprintf("[PMM] %s watermarks: min=%lu KiB low=%lu KiB high=%lu KiB\n", zoneToStringArray[zone],
+                (watermarks[MemoryPool::WATERMARK_MIN] * PAGE_SIZE) / KiB, (watermarks[MemoryPool::WATERMARK_LOW] * PAGE_SIZE) / KiB,
+                (watermarks[MemoryPool::WATERMARK_HIGH] * PAGE_SIZE) / KiB);
+    }
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
-const Pmm::PhysicalRange Pmm::AllocateRange(const size_t nPages)
+const PhysicalPage *Pmm::AllocatePage(const AllocationFlags allocationFlags)
 {
-    return m_memoryPool.AllocateRange(nPages);
+    return m_memoryPool.AllocatePage(allocationFlags);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::AllocatePages(const size_t nPages, const PhysicalPage **ppPages, const AllocationFlags allocationFlags)
+{
+    return m_memoryPool.AllocatePages(nPages, ppPages, allocationFlags);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+const Pmm::PhysicalRange Pmm::AllocateRange(const size_t nPages, const AllocationFlags allocationFlags)
+{
+    return m_memoryPool.AllocateRange(nPages, allocationFlags);
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -91,6 +212,13 @@ const Pmm::PhysicalRange Pmm::AllocateRange(const PhysicalAddress physicalAddres
 
 // ---------------------------------------------------------------------------------------------------------
 
+size_t Pmm::ReleaseRange(PhysicalRange &physicalRange, const size_t nPages)
+{
+    return m_memoryPool.ReleaseRangeTail(physicalRange, nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 void Pmm::ReturnPage(const PhysicalPage * const pPhysicalPage)
 {
     m_memoryPool.ReturnPage(pPhysicalPage);
@@ -98,6 +226,13 @@ void Pmm::ReturnPage(const PhysicalPage * const pPhysicalPage)
 
 // ---------------------------------------------------------------------------------------------------------
 
+void Pmm::ReturnPages(const PhysicalPage * const *ppPages, const size_t nPages)
+{
+    m_memoryPool.ReturnPages(ppPages, nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 void Pmm::ReturnRange(PhysicalRange &physicalRange)
 {
     m_memoryPool.ReturnRange(physicalRange);
@@ -105,26 +240,297 @@ void Pmm::ReturnRange(PhysicalRange &physicalRange)
 
 // ---------------------------------------------------------------------------------------------------------
 
+size_t Pmm::ResizeHugePagePool(const PageSize pageSize, const size_t nHugePages)
+{
+    return m_memoryPool.ResizeHugePagePool(MemoryPool::GetHugePageSize(pageSize), nHugePages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+const PhysicalPage *Pmm::AllocateHugePage(const PageSize pageSize)
+{
+    return m_memoryPool.AllocateHugePage(MemoryPool::GetHugePageSize(pageSize));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool Pmm::InitializeDeferredMemmap()
+{
+    return m_memoryPool.InitializeDeferredSection(MemoryPool::MAX_NODES, MemoryPool::MAX_ZONES);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::RefillZeroedPages()
+{
+    m_memoryPool.RefillZeroedPages();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::RefillAtomicReserves()
+{
+    return m_memoryPool.RefillAtomicReserves();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::CompactMemory()
+{
+    return m_memoryPool.CompactMemory();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool Pmm::CompactMemoryBackground()
+{
+    return m_memoryPool.CompactMemoryBackground();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::RegisterShrinker(Shrinker &shrinker)
+{
+    m_memoryPool.RegisterShrinker(shrinker);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::UnregisterShrinker(Shrinker &shrinker)
+{
+    m_memoryPool.UnregisterShrinker(shrinker);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool Pmm::ReclaimBackground()
+{
+    return m_memoryPool.ReclaimBackground();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::SetMergeBatch(const size_t nPages)
+{
+    m_memoryPool.SetMergeBatch(nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool Pmm::MergePagesBackground()
+{
+    if (!m_memoryPool.MergePagesBackground())
+        return false;
+
+    const MergeStats mergeStats = GetMergeStats();
+    const uint64_t cyclesPerPage = (0 < mergeStats.m_nScannedPages) ? (mergeStats.m_scanCycles / mergeStats.m_nScannedPages) : 0;
+    kprintf("[PMM] Same-page merging: scan %lu, %lu frames shared by %lu pages, %lu KiB saved, %lu broken, %lu cycles per page\n",
+            mergeStats.m_nFullScans, mergeStats.m_nMergedFrames, mergeStats.m_nMergedFrames + mergeStats.m_nSavedPages,
+            (mergeStats.m_nSavedPages * PAGE_SIZE) / KiB, mergeStats.m_nBrokenPages, cyclesPerPage);
+
+    return true;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::InflateBalloon(const size_t nPages, const PhysicalPage **ppPages)
+{
+    return m_memoryPool.InflateBalloon(nPages, ppPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::DeflateBalloon(const size_t nPages, const PhysicalPage **ppPages)
+{
+    return m_memoryPool.DeflateBalloon(nPages, ppPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::TakeUnreportedBlocks(const size_t minOrder, const PhysicalPage **ppBlocks, const size_t nMaxBlocks)
+{
+    return m_memoryPool.TakeUnreportedBlocks(minOrder, ppBlocks, nMaxBlocks);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::PutBackReportedBlocks(const PhysicalPage * const *ppBlocks, const size_t nBlocks, const bool isReported)
+{
+    m_memoryPool.PutBackReportedBlocks(ppBlocks, nBlocks, isReported);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 Pmm::MemoryStats Pmm::GetMemoryStats()
 {
-    MemoryStats memoryStats;
-    memoryStats.m_totalMemory = m_memoryPool.m_poolSize * PhysicalPage::m_pageSize;
+    return GetMemoryStats(m_memoryPool.m_counters);
+}
 
-    //! Calculate the amount of Physical Pages in the free list.
-    size_t freeListCounter = 0;
-    for (const PhysicalPage &physicalPage : Range(m_memoryPool.m_pPool, m_memoryPool.m_poolSize))
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::MemoryStats Pmm::GetZoneMemoryStats(const MemoryPool::ZoneType zoneType)
+{
+    ASSERT(zoneType < MemoryPool::MAX_ZONES);
+
+    MemoryStats zoneStats = {};
+    for (size_t node = 0; node < m_memoryPool.m_nNodes; ++node)
     {
-        if (physicalPage.m_freeListHook.in_list)
-            ++freeListCounter;
+        const MemoryStats nodeZoneStats = GetMemoryStats(m_memoryPool.m_nodes[node].m_zones[zoneType].m_counters);
+        zoneStats.m_totalMemory += nodeZoneStats.m_totalMemory;
+        zoneStats.m_usedMemory += nodeZoneStats.m_usedMemory;
+        zoneStats.m_freeMemory += nodeZoneStats.m_freeMemory;
+        zoneStats.m_reservedMemory += nodeZoneStats.m_reservedMemory;
     }
 
-    memoryStats.m_usedMemory = (m_memoryPool.m_poolSize - freeListCounter) * PhysicalPage::m_pageSize;
+    return zoneStats;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::GetNodeCount()
+{
+    return m_memoryPool.m_nNodes;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::MemoryStats Pmm::GetNodeMemoryStats(const size_t node)
+{
+    ASSERT(node < m_memoryPool.m_nNodes);
+
+    return GetMemoryStats(m_memoryPool.m_nodes[node].m_counters);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::NumaStats Pmm::GetNumaStats(const size_t node)
+{
+    ASSERT(node < m_memoryPool.m_nNodes);
+
+    return m_memoryPool.m_nodes[node].m_numaCounters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::MemoryStats Pmm::GetHugePageStats(const PageSize pageSize)
+{
+    const MemoryPool::HugePageSize hugePageSize = MemoryPool::GetHugePageSize(pageSize);
+    ASSERT(MemoryPool::HUGE_PAGE_NONE != hugePageSize);
+
+    const MemoryPool::HugePagePool &hugePagePool = m_memoryPool.m_hugePagePools[hugePageSize];
+    const size_t hugePageBytes = MemoryPool::GetHugePagePages(hugePageSize) * PhysicalPage::m_pageSize;
+
+    MemoryStats memoryStats;
+    memoryStats.m_totalMemory = hugePagePool.m_nHugePages * hugePageBytes;
+    memoryStats.m_freeMemory = hugePagePool.m_nFreeHugePages * hugePageBytes;
+    memoryStats.m_reservedMemory = 0;
+    memoryStats.m_usedMemory = memoryStats.m_totalMemory - memoryStats.m_freeMemory;
 
     return memoryStats;
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
+size_t Pmm::GetMemoryRegionCount()
+{
+    return m_memoryPool.m_nMemoryRegions;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::MemoryStats Pmm::GetMemoryRegionStats(const size_t regionIndex)
+{
+    ASSERT(regionIndex < m_memoryPool.m_nMemoryRegions);
+
+    return GetMemoryStats(m_memoryPool.m_memoryRegions[regionIndex].m_counters);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalAddress Pmm::GetMemoryRegion(const size_t regionIndex, size_t &size)
+{
+    ASSERT(regionIndex < m_memoryPool.m_nMemoryRegions);
+
+    const MemoryPool::MemoryRegion &region = m_memoryPool.m_memoryRegions[regionIndex];
+    size = region.m_size;
+
+    return region.m_addr;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::GetFreeBlockCount(const size_t order)
+{
+    ASSERT(order < MemoryPool::MAX_ORDER);
+
+    size_t nFreeBlocks = 0;
+    for (size_t zone = 0; zone < MemoryPool::MAX_ZONES; ++zone)
+        nFreeBlocks += GetZoneFreeBlockCount(static_cast<MemoryPool::ZoneType>(zone), order);
+
+    return nFreeBlocks;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+size_t Pmm::GetZoneFreeBlockCount(const MemoryPool::ZoneType zoneType, const size_t order)
+{
+    ASSERT(zoneType < MemoryPool::MAX_ZONES);
+    ASSERT(order < MemoryPool::MAX_ORDER);
+
+    size_t nFreeBlocks = 0;
+    for (size_t node = 0; node < m_memoryPool.m_nNodes; ++node)
+        nFreeBlocks += m_memoryPool.m_nodes[node].m_zones[zoneType].m_freeAreas[order].m_nFreeBlocks;
+
+    return nFreeBlocks;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+int32_t Pmm::GetFragmentationIndex(const MemoryPool::ZoneType zoneType, const size_t order)
+{
+    ASSERT(zoneType < MemoryPool::MAX_ZONES);
+    ASSERT(order < MemoryPool::MAX_ORDER);
+
+    return m_memoryPool.GetFragmentationIndex(MemoryPool::MAX_NODES, zoneType, order);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::CompactionStats Pmm::GetCompactionStats()
+{
+    return m_memoryPool.m_compactionCounters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::ReclaimStats Pmm::GetReclaimStats()
+{
+    return m_memoryPool.m_reclaimCounters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::MergeStats Pmm::GetMergeStats()
+{
+    return m_memoryPool.m_mergeCounters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::CmaStats Pmm::GetCmaStats()
+{
+    return m_memoryPool.m_cmaCounters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::AtomicStats Pmm::GetAtomicStats()
+{
+    return m_memoryPool.m_atomicCounters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 PhysicalAddress Pmm::GetEndAddress()
 {
     if (!m_isInitialized)
@@ -140,6 +546,67 @@ void Pmm::InitializePhysicalRange(PhysicalRange &physicalRange)
     m_memoryPool.InitializePhysicalRange(physicalRange);
 }
 
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::FreePage(PhysicalPage * const pPhysicalPage)
+{
+    m_memoryPool.FreePage(pPhysicalPage);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::ReturnPageTable(const PhysicalAddress &physicalAddress)
+{
+    m_memoryPool.ReturnPage(m_memoryPool.FindPhysicalPage(physicalAddress));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::SetReverseMapping(const PhysicalPage * const pPhysicalPage, AddressSpace &addressSpace, const VirtualAddress &virtualAddress)
+{
+    //! Safe to const cast because we know the page came from the pool.
+    m_memoryPool.SetReverseMapping(const_cast<PhysicalPage *>(pPhysicalPage), addressSpace, virtualAddress);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::ReturnMovablePage(const PhysicalAddress &physicalAddress)
+{
+    m_memoryPool.ReturnMovablePage(physicalAddress);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool Pmm::IsMergedPageShared(const PhysicalAddress &physicalAddress)
+{
+    return m_memoryPool.IsMergedPageShared(physicalAddress);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Pmm::UnmergePage(const PhysicalAddress &sharedAddress, const PhysicalPage * const pPhysicalPage, AddressSpace &addressSpace,
+    const VirtualAddress &virtualAddress)
+{
+    //! Safe to const cast because we know the page came from the pool.
+    m_memoryPool.UnmergePage(sharedAddress, const_cast<PhysicalPage *>(pPhysicalPage), addressSpace, virtualAddress);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Pmm::MemoryStats Pmm::GetMemoryStats(const MemoryPool::PageCounters &pageCounters)
+{
+    MemoryStats memoryStats;
+    memoryStats.m_totalMemory = pageCounters.m_nPages * PhysicalPage::m_pageSize;
+    memoryStats.m_freeMemory = (pageCounters.m_nFreePages + pageCounters.m_nCachedPages + pageCounters.m_nDeferredPages +
+                                pageCounters.m_nZeroedPages + pageCounters.m_nColoredPages + pageCounters.m_nCmaPages +
+                                pageCounters.m_nAtomicPages) *
+                               PhysicalPage::m_pageSize;
+    memoryStats.m_reservedMemory = pageCounters.m_nReservedPages * PhysicalPage::m_pageSize;
+    memoryStats.m_usedMemory = memoryStats.m_totalMemory - memoryStats.m_freeMemory - memoryStats.m_reservedMemory;
+
+    return memoryStats;
+}
+
 } // namespace MM
 
 } // namespace BartOS
\ No newline at end of file
@@ -22,6 +22,12 @@ class Pmm : public Singleton<Pmm>
 {
 public:
     typedef MemoryPool::PhysicalRange PhysicalRange;    ///< Forward the PhysicalRange type.
+    typedef MemoryPool::CompactionCounters CompactionStats; ///< Forward the compaction counters type.
+    typedef MemoryPool::NumaCounters NumaStats;         ///< Forward the NUMA counters type.
+    typedef MemoryPool::ReclaimCounters ReclaimStats;   ///< Forward the reclaim counters type.
+    typedef MemoryPool::MergeCounters MergeStats;       ///< Forward the same-page merging counters type.
+    typedef MemoryPool::CmaCounters CmaStats;           ///< Forward the CMA region counters type.
+    typedef MemoryPool::AtomicCounters AtomicStats;     ///< Forward the atomic allocation counters type.
 
     /*
      *  @brief The memory stats.
@@ -31,6 +37,8 @@ public:
     public:
         size_t m_totalMemory;
         size_t m_usedMemory;
+        size_t m_freeMemory;
+        size_t m_reservedMemory;
     };
 
     //! Constructor
@@ -41,21 +49,42 @@ public:
      */
     StatusCode Initialize(const multiboot_tag_mmap *pMmapTag);
 
+    /*
+     *  @brief Give the memory only used during boot to the memory pool.
+     *  The ACPI reclaimable memory, the whole pages of the boot info and the kernel VMArea past the kmalloc eternal
+     *  arena are released. Called once the ACPI tables and the multiboot tags are no longer read.
+     */
+    void ReclaimBootMemory();
+
     /*
      *  @brief Allocate a physical page.
      * 
+     *  @param allocationFlags the allocation flags.
+     * 
      *  @return pointer to the allocated page.
      */
-    const PhysicalPage *AllocatePage();
+    const PhysicalPage *AllocatePage(const AllocationFlags allocationFlags = ALLOC_NO_FLAGS);
+
+    /*
+     *  @brief Allocate a batch of physical pages which don't have to be contiguous.
+     * 
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the allocated pages are stored to.
+     *  @param allocationFlags the allocation flags.
+     * 
+     *  @return the amount of allocated pages, less than nPages if out of memory.
+     */
+    size_t AllocatePages(const size_t nPages, const PhysicalPage **ppPages, const AllocationFlags allocationFlags = ALLOC_NO_FLAGS);
 
     /*
      *  @brief Allocate a physical page range.
      * 
      *  @param  nPages the amount of physically contiguous pages.
+     *  @param  allocationFlags the allocation flags.
      * 
      *  @return pointer to the allocated page.
      */
-    const PhysicalRange AllocateRange(const size_t nPages);
+    const PhysicalRange AllocateRange(const size_t nPages, const AllocationFlags allocationFlags = ALLOC_NO_FLAGS);
 
     /*
      *  @brief Return a physical page.
@@ -64,6 +93,14 @@ public:
      */
     void ReturnPage(const PhysicalPage * const pPhysicalPage);
 
+    /*
+     *  @brief Return a batch of physical pages.
+     * 
+     *  @param ppPages the pages.
+     *  @param nPages the amount of pages.
+     */
+    void ReturnPages(const PhysicalPage * const *ppPages, const size_t nPages);
+
     /*
      *  @brief Return a physical page range.
      * 
@@ -71,6 +108,137 @@ public:
      */
     void ReturnRange(PhysicalRange &physicalRange);
 
+    /*
+     *  @brief Grow or shrink a huge page pool.
+     * 
+     *  @param pageSize the huge page size, PAGE_2M or PAGE_1G.
+     *  @param nHugePages the requested number of huge pages in the pool.
+     * 
+     *  @return the number of huge pages in the pool, less than requested if physical memory is too fragmented.
+     */
+    size_t ResizeHugePagePool(const PageSize pageSize, const size_t nHugePages);
+
+    /*
+     *  @brief Allocate a huge page from its reserved pool.
+     *  The huge page is returned through ReturnPage of its head page.
+     * 
+     *  @param pageSize the huge page size, PAGE_2M or PAGE_1G.
+     * 
+     *  @return pointer to the head page of the huge page, nullptr if the pool is empty.
+     */
+    const PhysicalPage *AllocateHugePage(const PageSize pageSize);
+
+    /*
+     *  @brief Initialize the next deferred memmap section.
+     *  Called from the idle loop until the whole memmap is initialized.
+     * 
+     *  @return whether a section was initialized, false once the whole memmap is initialized.
+     */
+    bool InitializeDeferredMemmap();
+
+    //! Top up the pre-zeroed page pools, called from the idle loop.
+    void RefillZeroedPages();
+
+    /*
+     *  @brief Top up the atomic reserves after atomic allocations dipped into them, called from the idle loop.
+     *  They are first filled right before interrupts are enabled, once boot has reserved all the memory it keeps.
+     *
+     *  @return the number of pages put into the reserves.
+     */
+    size_t RefillAtomicReserves();
+
+    /*
+     *  @brief Compact the whole memory by migrating movable pages towards the top of their zone.
+     * 
+     *  @return the number of migrated pages.
+     */
+    size_t CompactMemory();
+
+    /*
+     *  @brief Run a batch of compaction after a contiguous allocation failed, called from the idle loop.
+     * 
+     *  @return whether compaction is still pending.
+     */
+    bool CompactMemoryBackground();
+
+    /*
+     *  @brief Register a cache which can give memory back under memory pressure.
+     *
+     *  @param shrinker the shrinker, it stays registered until it is unregistered.
+     */
+    void RegisterShrinker(Shrinker &shrinker);
+
+    /*
+     *  @brief Unregister a shrinker.
+     *
+     *  @param shrinker the shrinker.
+     */
+    void UnregisterShrinker(Shrinker &shrinker);
+
+    /*
+     *  @brief Run a reclaim step after a zone fell below its low watermark, called from the idle loop.
+     *
+     *  @return whether reclaim is still pending.
+     */
+    bool ReclaimBackground();
+
+    /*
+     *  @brief Set the number of pages the same-page merging scanner visits per batch.
+     * 
+     *  @param nPages the number of pages, 0 disables same-page merging.
+     */
+    void SetMergeBatch(const size_t nPages);
+
+    /*
+     *  @brief Run a batch of the same-page merging scanner, called from the idle loop.
+     *  The merge stats are printed after a full scan which changed the number of saved pages.
+     * 
+     *  @return whether the stats were printed.
+     */
+    bool MergePagesBackground();
+
+    /*
+     *  @brief Allocate pages for the balloon, they belong to the host until the balloon deflates.
+     * 
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the allocated pages are stored to.
+     * 
+     *  @return the amount of pages, less than nPages if out of memory.
+     */
+    size_t InflateBalloon(const size_t nPages, const PhysicalPage **ppPages);
+
+    /*
+     *  @brief Take pages back from the balloon, the last inflated first.
+     *  The pages are returned through ReturnPages once the host gave them back.
+     * 
+     *  @param nPages the amount of pages.
+     *  @param ppPages the array the pages are stored to.
+     * 
+     *  @return the amount of pages, less than nPages if the balloon runs empty.
+     */
+    size_t DeflateBalloon(const size_t nPages, const PhysicalPage **ppPages);
+
+    /*
+     *  @brief Take free blocks which weren't reported to the host yet, to report them.
+     *  The blocks are put back through PutBackReportedBlocks once the host handled the report.
+     * 
+     *  @param minOrder the smallest buddy order taken.
+     *  @param ppBlocks the array the head pages of the blocks are stored to.
+     *  @param nMaxBlocks the maximum amount of blocks.
+     * 
+     *  @return the amount of blocks taken.
+     */
+    size_t TakeUnreportedBlocks(const size_t minOrder, const PhysicalPage **ppBlocks, const size_t nMaxBlocks);
+
+    /*
+     *  @brief Put reported free blocks back on the free lists.
+     * 
+     *  @param ppBlocks the head pages of the blocks.
+     *  @param nBlocks the amount of blocks.
+     *  @param isReported whether the host accepted the report, otherwise the blocks are reported again later.
+     */
+    void PutBackReportedBlocks(const PhysicalPage * const *ppBlocks, const size_t nBlocks, const bool isReported);
+
     /*
      *  @brief Get the memory stats.
      * 
@@ -78,6 +246,145 @@ public:
      */
     MemoryStats GetMemoryStats();
 
+    /*
+     *  @brief Get the memory stats of a zone.
+     * 
+     *  @param zoneType the zone.
+     * 
+     *  @return the memory stats.
+     */
+    MemoryStats GetZoneMemoryStats(const MemoryPool::ZoneType zoneType);
+
+    /*
+     *  @brief Get the number of NUMA nodes.
+     * 
+     *  @return the number of nodes.
+     */
+    size_t GetNodeCount();
+
+    /*
+     *  @brief Get the memory stats of a NUMA node.
+     * 
+     *  @param node the node.
+     * 
+     *  @return the memory stats.
+     */
+    MemoryStats GetNodeMemoryStats(const size_t node);
+
+    /*
+     *  @brief Get the NUMA allocation stats of a node.
+     *  An allocation is a hit on the node of the allocating CPU when served from it, otherwise it's a miss on the
+     *  node which served it and foreign to the node of the CPU.
+     * 
+     *  @param node the node.
+     * 
+     *  @return the NUMA stats.
+     */
+    NumaStats GetNumaStats(const size_t node);
+
+    /*
+     *  @brief Get the memory stats of a huge page pool.
+     *  The pool is counted as used memory in the other memory stats.
+     * 
+     *  @param pageSize the huge page size, PAGE_2M or PAGE_1G.
+     * 
+     *  @return the memory stats.
+     */
+    MemoryStats GetHugePageStats(const PageSize pageSize);
+
+    /*
+     *  @brief Get the number of usable memory regions.
+     * 
+     *  @return the number of memory regions.
+     */
+    size_t GetMemoryRegionCount();
+
+    /*
+     *  @brief Get the memory stats of a usable memory region.
+     * 
+     *  @param regionIndex the index of the memory region.
+     * 
+     *  @return the memory stats.
+     */
+    MemoryStats GetMemoryRegionStats(const size_t regionIndex);
+
+    /*
+     *  @brief Get the physical extent of a usable memory region.
+     *  The regions reported by the memory map are split at the NUMA node boundaries.
+     * 
+     *  @param regionIndex the index of the memory region.
+     *  @param size the size of the memory region.
+     * 
+     *  @return the physical address of the memory region.
+     */
+    PhysicalAddress GetMemoryRegion(const size_t regionIndex, size_t &size);
+
+    /*
+     *  @brief Get the number of free buddy blocks of an order.
+     * 
+     *  @param order the buddy order.
+     * 
+     *  @return the number of free blocks.
+     */
+    size_t GetFreeBlockCount(const size_t order);
+
+    /*
+     *  @brief Get the number of free buddy blocks of an order in a zone.
+     * 
+     *  @param zoneType the zone.
+     *  @param order the buddy order.
+     * 
+     *  @return the number of free blocks.
+     */
+    size_t GetZoneFreeBlockCount(const MemoryPool::ZoneType zoneType, const size_t order);
+
+    /*
+     *  @brief Get the fragmentation index of a zone for an order.
+     *  Towards 1000 an allocation of the order fails because free memory is fragmented and compaction helps,
+     *  towards 0 because there is too little free memory.
+     * 
+     *  @param zoneType the zone.
+     *  @param order the buddy order.
+     * 
+     *  @return the fragmentation index, -1000 if a free block of the order is available.
+     */
+    int32_t GetFragmentationIndex(const MemoryPool::ZoneType zoneType, const size_t order);
+
+    /*
+     *  @brief Get the compaction stats.
+     * 
+     *  @return the compaction stats.
+     */
+    CompactionStats GetCompactionStats();
+
+    /*
+     *  @brief Get the reclaim stats.
+     * 
+     *  @return the reclaim stats.
+     */
+    ReclaimStats GetReclaimStats();
+
+    /*
+     *  @brief Get the same-page merging stats.
+     * 
+     *  @return the merge stats.
+     */
+    MergeStats GetMergeStats();
+
+    /*
+     *  @brief Get the CMA region stats.
+     * 
+     *  @return the CMA stats.
+     */
+    CmaStats GetCmaStats();
+
+    /*
+     *  @brief Get the atomic allocation stats.
+     * 
+     *  @return the atomic stats.
+     */
+    AtomicStats GetAtomicStats();
+
     /*
      *  @brief Get the end address.
      * 
@@ -97,6 +404,17 @@ private:
      */
     const PhysicalRange AllocateRange(const PhysicalAddress physicalAddress, const size_t nPages);
 
+    /*
+     *  @brief Give the last reserved pages of a physical range to the memory pool.
+     *  Used only by the Vmm when it shrinks the kernel VMArea.
+     * 
+     *  @param physicalRange the physical range to shrink.
+     *  @param nPages the amount of pages.
+     * 
+     *  @return the number of released pages.
+     */
+    size_t ReleaseRange(PhysicalRange &physicalRange, const size_t nPages);
+
     /*
      *  @brief Initialize a physical page range.
      *  
@@ -104,11 +422,79 @@ private:
      */
     void InitializePhysicalRange(PhysicalRange &physicalRange);
 
+    /*
+     *  @brief Free a physical page which is no longer referenced.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     */
+    void FreePage(PhysicalPage * const pPhysicalPage);
+
+    /*
+     *  @brief Return a page table which nothing walks anymore.
+     *  Used only by the TLB gather once the batch which unlinked the table was flushed.
+     * 
+     *  @param physicalAddress the physical address of the page table.
+     */
+    void ReturnPageTable(const PhysicalAddress &physicalAddress);
+
+    /*
+     *  @brief Record the single mapping of a page and make it movable.
+     *  Used only by the Vmm when it maps a movable page.
+     * 
+     *  @param pPhysicalPage pointer to the page.
+     *  @param addressSpace the address space of the mapping.
+     *  @param virtualAddress the virtual address of the mapping.
+     */
+    void SetReverseMapping(const PhysicalPage * const pPhysicalPage, AddressSpace &addressSpace, const VirtualAddress &virtualAddress);
+
+    /*
+     *  @brief Drop the mapping of a movable page and return the page.
+     *  Used only by the Vmm when it unmaps a movable page.
+     * 
+     *  @param physicalAddress the physical address of the page.
+     */
+    void ReturnMovablePage(const PhysicalAddress &physicalAddress);
+
+    /*
+     *  @brief Is a merged page shared by more than one mapping.
+     *  Used only by the Vmm when it breaks the sharing of a merged page.
+     * 
+     *  @param physicalAddress the physical address of the merged page.
+     * 
+     *  @return whether the page has other sharers.
+     */
+    bool IsMergedPageShared(const PhysicalAddress &physicalAddress);
+
+    /*
+     *  @brief Take a mapping off a merged page after its write fault.
+     *  Used only by the Vmm when it breaks the sharing of a merged page.
+     * 
+     *  @param sharedAddress the physical address of the merged page.
+     *  @param pPhysicalPage pointer to the private copy now mapped, nullptr if the last sharer took the frame over.
+     *  @param addressSpace the address space of the mapping.
+     *  @param virtualAddress the virtual address of the mapping.
+     */
+    void UnmergePage(const PhysicalAddress &sharedAddress, const PhysicalPage * const pPhysicalPage, AddressSpace &addressSpace,
+        const VirtualAddress &virtualAddress);
+
+    /*
+     *  @brief Convert page counters to memory stats.
+     * 
+     *  @param pageCounters the page counters.
+     * 
+     *  @return the memory stats.
+     */
+    static MemoryStats GetMemoryStats(const MemoryPool::PageCounters &pageCounters);
+
     MemoryPool  m_memoryPool;       ///< The physical memory pool.
     bool        m_isInitialized;    ///< Whether the object is initialized.
 
     friend class MemoryPool::PhysicalRange;
     friend class KernelAddressSpace;
+    friend class Vmm;
+    friend class TlbGather;
+    friend class PhysicalPage;
+    friend class MemoryBenchmark;
     friend class Singleton<Pmm>;
 };
 
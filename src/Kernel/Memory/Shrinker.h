@@ -0,0 +1,61 @@
+#ifndef SHRINKER_H
+#define SHRINKER_H
+
+#include "Kernel/BartOS.h"
+
+#include "frg/list.hpp"
+
+namespace BartOS
+{
+
+namespace MM
+{
+
+/*
+ *  @brief The interface of a cache which can give memory back to the PMM.
+ *
+ *  A shrinker is registered with Pmm::RegisterShrinker. Reclaim asks every shrinker how many objects it could free
+ *  and has it scan a share of them, a larger share every pass until enough pages came back. The callbacks run
+ *  with interrupts disabled and must not allocate memory.
+ */
+class Shrinker
+{
+public:
+    //! Constructor
+    Shrinker();
+
+    /*
+     *  @brief Count the objects the cache could free.
+     *
+     *  @return the number of freeable objects, 0 if there is nothing to give back.
+     */
+    virtual size_t CountObjects() = 0;
+
+    /*
+     *  @brief Free objects of the cache and return their pages to the PMM.
+     *
+     *  @param nObjects the number of objects to scan.
+     *
+     *  @return the number of freed objects.
+     */
+    virtual size_t ScanObjects(const size_t nObjects) = 0;
+
+    frg::default_list_hook<Shrinker> m_shrinkerHook;    ///< frg intrusive list interface.
+
+protected:
+    //! Destructor, shrinkers are never destroyed through the interface.
+    ~Shrinker() = default;
+};
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline Shrinker::Shrinker()
+{
+}
+
+} // namespace MM
+
+} // namespace BartOS
+
+#endif // SHRINKER_H
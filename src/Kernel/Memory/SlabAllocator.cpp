@@ -11,7 +11,9 @@ namespace MM
 {
 
 template<size_t SLAB_SIZE>
-SlabAllocator<SLAB_SIZE>::SlabAllocator(const size_t totalSize)
+SlabAllocator<SLAB_SIZE>::SlabAllocator(const size_t totalSize) :
+    m_pAtomicReserve(nullptr),
+    m_nAtomicReserveSlabs(0)
 {
     
     m_mainSlabCache.Initialize(kmalloc(totalSize), totalSize);
@@ -26,14 +28,18 @@ SlabAllocator<SLAB_SIZE>::SlabAllocator(const size_t totalSize)
 template<size_t SLAB_SIZE>
 SlabAllocator<SLAB_SIZE>::SlabAllocator() :
     m_totalSlabsAvailable(0),
-    m_totalSize(0)
+    m_totalSize(0),
+    m_pAtomicReserve(nullptr),
+    m_nAtomicReserveSlabs(0)
 {
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
 template<size_t SLAB_SIZE>
-SlabAllocator<SLAB_SIZE>::SlabAllocator(const size_t totalSize, kmalloc_eternal_tag)
+SlabAllocator<SLAB_SIZE>::SlabAllocator(const size_t totalSize, kmalloc_eternal_tag) :
+    m_pAtomicReserve(nullptr),
+    m_nAtomicReserveSlabs(0)
 {
     Initialize(totalSize, kmalloc_eternal_tag());
 }
@@ -53,8 +59,11 @@ void SlabAllocator<SLAB_SIZE>::Initialize(const size_t totalSize, kmalloc_eterna
 // ---------------------------------------------------------------------------------------------------------
 
 template<size_t SLAB_SIZE>
-void *SlabAllocator<SLAB_SIZE>::Allocate()
+void *SlabAllocator<SLAB_SIZE>::Allocate(const AllocationFlags allocationFlags)
 {
+    //! Interrupt handlers allocate as well, keep interrupts off while the free lists are in use.
+    CPU::InterruptDisabler interruptDisabler;
+
     const size_t percentSlabsLeft = (GetTotalSlabsAvailable() - GetFreeSlabsLeft()) / GetTotalSlabsAvailable();
     if (percentSlabsLeft < 10)
     {
@@ -71,6 +80,18 @@ void *SlabAllocator<SLAB_SIZE>::Allocate()
         }
     }
 
+    //! The slab caches are empty, only an atomic allocation can't wait for memory to be freed.
+    if ((!pAlloc) && (allocationFlags & ALLOC_ATOMIC) && m_pAtomicReserve)
+    {
+        SlabEntry * const pSlabEntry = m_pAtomicReserve;
+        ASSERT(SlabEntry::SLAB_MAGIC_NUMBER == pSlabEntry->m_magicNumber);
+
+        m_pAtomicReserve = pSlabEntry->m_pNext;
+        --m_nAtomicReserveSlabs;
+
+        pAlloc = reinterpret_cast<void *>(pSlabEntry);
+    }
+
     return pAlloc;
 }
 
@@ -79,6 +100,8 @@ void *SlabAllocator<SLAB_SIZE>::Allocate()
 template<size_t SLAB_SIZE>
 void SlabAllocator<SLAB_SIZE>::Free(void *pBuffer)
 {
+    CPU::InterruptDisabler interruptDisabler;
+
     for (SlabCache *pSlabCache : m_slabCacheList)
     {
         if (pSlabCache->ContainsSlab(pBuffer))
@@ -90,6 +113,25 @@ void SlabAllocator<SLAB_SIZE>::Free(void *pBuffer)
 
 // ---------------------------------------------------------------------------------------------------------
 
+template<size_t SLAB_SIZE>
+void SlabAllocator<SLAB_SIZE>::RefillAtomicReserve()
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    //! The reserved slabs stay allocated from their slab cache, they are freed to it like any other slab.
+    while (m_nAtomicReserveSlabs < (GetTotalSlabsAvailable() >> m_atomicReserveShift))
+    {
+        void * const pBuffer = Allocate();
+        if (!pBuffer)
+            break;
+
+        m_pAtomicReserve = new (pBuffer) SlabEntry(m_pAtomicReserve);
+        ++m_nAtomicReserveSlabs;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 template<size_t SLAB_SIZE>
 bool SlabAllocator<SLAB_SIZE>::ContainsSlab(void *pBuffer)
 {
@@ -5,6 +5,8 @@
 
 #include "Libraries/libc/string.h"
 
+#include "Kernel/Arch/x86_64/CPU.h"
+
 #include "frg/list.hpp"
 
 namespace BartOS
@@ -17,12 +19,17 @@ struct kmalloc_eternal_tag {};
 
 class KernelHeap;
 
-//! A slab allocator object.
+/*
+ *  @brief A slab allocator object.
+ *  A share of the slabs is held back in the atomic reserve. Only atomic allocations which found the slab caches
+ *  empty take from it, the idle loop tops it up again from the slab caches.
+ */
 template<size_t SLAB_SIZE>
 class SlabAllocator
 {
 public:
     static constexpr size_t m_slabSize = SLAB_SIZE;
+    static constexpr size_t m_atomicReserveShift = 3;   ///< The atomic reserve holds the total slabs shifted right by it.
 
     /*
      *  @brief Constructor
@@ -34,9 +41,11 @@ public:
     /*
      *  @brief Allocate a slab.
      * 
+     *  @param allocationFlags the allocation flags, ALLOC_ATOMIC allows taking from the atomic reserve.
+     * 
      *  @return pointer to the slab.
      */
-    void *Allocate();
+    void *Allocate(const AllocationFlags allocationFlags = ALLOC_NO_FLAGS);
 
     /*
      *  @brief Initialize the slab allocator.
@@ -45,6 +54,11 @@ public:
      */
     void Free(void *pBuffer);
 
+    /*
+     *  @brief Top up the atomic reserve from the slab caches, called from the idle loop.
+     */
+    void RefillAtomicReserve();
+
     /*
      *  @brief Does this allocator contains the slab.
      * 
@@ -178,6 +192,8 @@ private:
     SlabCacheList           m_slabCacheList;        ///< The slab cache list for additional slab caches.
     size_t                  m_totalSlabsAvailable;  ///< The total number of slabs available.
     size_t                  m_totalSize;            ///< The total size of the slab cache.
+    SlabEntry               *m_pAtomicReserve;      ///< The slabs held back for atomic allocations.
+    size_t                  m_nAtomicReserveSlabs;  ///< The number of slabs in the atomic reserve.
 
     static_assert(sizeof(SlabEntry) <= SLAB_SIZE, "Slab size must be bigger than SLAB_SIZE");
     static_assert(IsPowerOfTwo<SLAB_SIZE>::value);
@@ -5,6 +5,8 @@
 #include "AddressSpace.h"
 #include "Pmm.h"
 
+#include "Libraries/libc/string.h"
+
 //! Initial P4 table p4_table symbol exposed from boot.asm
 extern "C" BartOS::MM::PageTable p4_table;
 
@@ -17,7 +19,35 @@ namespace BartOS
 namespace MM
 {
 
+namespace
+{
+
+const PageFlags DIRECT_MAP_FLAGS = static_cast<PageFlags>(PRESENT | WRITABLE);  ///< The flags of the direct map pages.
+
+/*
+ *  @brief Get the flags of a leaf entry. The higher half is shared by all the address spaces, its pages are global and
+ *  survive the CR3 reloads. The lower half pages never are, they would leak into the other address spaces.
+ *
+ *  @param virtualAddress the virtual address of the page.
+ *  @param pageFlags the requested flags.
+ *
+ *  @return the flags of the leaf entry.
+ */
+PageFlags GetLeafPageFlags(const VirtualAddress &virtualAddress, const PageFlags pageFlags)
+{
+    if (DIRECT_MAP_ADDR <= virtualAddress.Get())
+        return static_cast<PageFlags>(pageFlags | GLOBAL);
+
+    return static_cast<PageFlags>(pageFlags & ~GLOBAL);
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
 PageTable * const Vmm::m_pTempMapTable = &p1_temp_map_table;
+bool Vmm::m_isDirectMapped = false;
 
 // ---------------------------------------------------------------------------------------------------------
 // ---------------------------------------------------------------------------------------------------------
@@ -25,6 +55,12 @@ PageTable * const Vmm::m_pTempMapTable = &p1_temp_map_table;
 Vmm::Vmm() :
     m_kernelAddressSpace(&p4_table),
     m_pageFaultHandler(*this),
+    m_pActiveAddressSpace(&m_kernelAddressSpace),
+    m_pcidGeneration(1),
+    m_nextPcid(FIRST_PCID),
+    m_isGigabytePageSupported(CPU::IsGigabytePageSupported()),
+    m_isPcidEnabled(false),
+    m_isInvpcidSupported(false),
     m_isInitialized(false)
 {
     Interrupt::RegisterInterrupt(&m_pageFaultHandler);
@@ -35,6 +71,16 @@ Vmm::Vmm() :
 void Vmm::Initialize()
 {
     m_kernelAddressSpace.Initialize();
+
+    //! The page tables are reached through the temporary mapping until the direct map is complete.
+    const MappingCounters mappingCounters = m_mappingCounters;
+    if (STATUS_CODE_SUCCESS == BuildDirectMap())
+        m_isDirectMapped = true;
+
+    //! The temporary mapping is global, invlpg drops its stale slots from every PCID.
+    if (CPU::IsPcidSupported())
+        EnablePcids();
+
     m_isInitialized = true;
 
     //! Disable kmalloc eternal forever.
@@ -46,6 +92,15 @@ void Vmm::Initialize()
     kprintf("[VMM] Kernel Address Space end: %p\n", (m_kernelAddressSpace.m_kernelVMArea.m_vend.Get()));
     kprintf("[VMM] Kernel address space size: %u MiB\n", (m_kernelAddressSpace.m_nVMAreas * PAGE_2M) / MiB);
     kprintf("[VMM] Memory used by VMM: %u KiB\n", (sizeof(VMArea) * m_kernelAddressSpace.m_nVMAreas) / KiB);
+    kprintf("[VMM] Direct map at %p: %s, %lu 1 GiB pages, %lu 2 MiB pages, %lu KiB of page tables\n", DIRECT_MAP_ADDR,
+            m_isDirectMapped ? "complete" : "out of memory", m_mappingCounters.m_nPages1G - mappingCounters.m_nPages1G,
+            m_mappingCounters.m_nPages2M - mappingCounters.m_nPages2M, ((m_mappingCounters.m_nTables - mappingCounters.m_nTables) * PAGE_SIZE) / KiB);
+
+    const TlbGather::Counters tlbCounters = TlbGather::GetCounters();
+    kprintf("[VMM] PCIDs %s, INVPCID %s\n", m_isPcidEnabled ? "enabled" : "disabled", m_isInvpcidSupported ? "supported" : "unsupported");
+    kprintf("[VMM] TLB gather: %lu batches, %lu invlpg, %lu CR3 reloads, %lu global flushes, %lu invalidations avoided\n",
+            tlbCounters.m_nBatches, tlbCounters.m_nInvlpgs, tlbCounters.m_nFlushAlls, tlbCounters.m_nGlobalFlushes,
+            tlbCounters.m_nAvoidedFlushes);
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -68,11 +123,81 @@ StatusCode Vmm::MapKernelPage(const PhysicalAddress &physicalAddress, const Virt
 StatusCode Vmm::MapPage(AddressSpace &addressSpace, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
     const PageFlags pageFlags, const PageSize pageSize)
 {
-    const StatusCode statusCode = MapPageImpl(addressSpace.m_pPageTable, physicalAddress, virtualAddress, pageFlags, pageSize);
-    if (STATUS_CODE_SUCCESS == statusCode)
-        CPU::Invlpg(virtualAddress);
+    TlbGather tlbGather(addressSpace);
+
+    return MapPageImpl(addressSpace.m_pPageTable, physicalAddress, virtualAddress, pageFlags, pageSize, tlbGather);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::MapRange(AddressSpace &addressSpace, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
+    const size_t nBytes, const PageFlags pageFlags)
+{
+    if ((ALIGN(physicalAddress.Get(), PAGE_SIZE) != physicalAddress.Get()) || (ALIGN(virtualAddress.Get(), PAGE_SIZE) != virtualAddress.Get()) ||
+        (ALIGN(nBytes, PAGE_SIZE) != nBytes))
+        return STATUS_CODE_INVALID_PARAMETER;
+
+    if ((KernelAddressSpace::TEMP_MAP_ADDR_BASE <= virtualAddress.Get()) || ((KernelAddressSpace::TEMP_MAP_ADDR_BASE - virtualAddress.Get()) < nBytes))
+        return STATUS_CODE_RESERVED;
+
+    //! The pages which were mapped before a failure are flushed too, the gather commits when it goes out of scope.
+    TlbGather tlbGather(addressSpace);
+    size_t offset = 0;
+    while (offset < nBytes)
+    {
+        const PhysicalAddress pagePhysicalAddress(physicalAddress.Get() + offset);
+        const VirtualAddress pageVirtualAddress(virtualAddress.Get() + offset);
+        const PageSize pageSize = GetLargestPageSize(pagePhysicalAddress, pageVirtualAddress, nBytes - offset);
+
+        const StatusCode statusCode = MapPageImpl(addressSpace.m_pPageTable, pagePhysicalAddress, pageVirtualAddress, pageFlags, pageSize,
+                                                  tlbGather);
+        if (STATUS_CODE_SUCCESS != statusCode)
+            return statusCode;
+
+        offset += pageSize;
+    }
+
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Vmm::MappingCounters Vmm::GetMappingCounters()
+{
+    return m_mappingCounters;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Vmm::SwitchAddressSpace(AddressSpace &addressSpace)
+{
+    CPU::InterruptDisabler interruptDisabler;
 
-    return statusCode;
+    CPU::CR3 cr3;
+    cr3.Set<CPU::CR3::PhysicalAddress>(GetPageTableAddress(addressSpace).Get() / PAGE_SIZE);
+    if (m_isPcidEnabled)
+    {
+        //! A new PCID may have tagged another address space in an older generation, its first switch flushes it.
+        const bool isPcidValid = (addressSpace.m_pcidGeneration == m_pcidGeneration);
+        if (!isPcidValid)
+            AssignPcid(addressSpace);
+        else
+            ++m_pcidCounters.m_nNoFlushSwitches;
+
+        cr3.Set<CPU::CR3::PCID>(addressSpace.m_pcid);
+        cr3.Set<CPU::CR3::NoFlush>(isPcidValid);
+    }
+
+    CPU::SetCR3(cr3);
+    m_pActiveAddressSpace = &addressSpace;
+    ++m_pcidCounters.m_nSwitches;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+Vmm::PcidCounters Vmm::GetPcidCounters()
+{
+    return m_pcidCounters;
 }
 
 // ---------------------------------------------------------------------------------------------------------
@@ -146,6 +271,96 @@ void Vmm::EnsureMapped(AddressSpace &addressSpace, const PhysicalAddress &physic
 
 // ---------------------------------------------------------------------------------------------------------
 
+void Vmm::ZeroPhysicalPage(const PhysicalAddress &physicalAddress, const bool isNonTemporal)
+{
+    //! The temporary mapping is shared, keep interrupts off while it's in use.
+    CPU::InterruptDisabler interruptDisabler;
+
+    uint8_t * const pPage = MapPage(physicalAddress);
+    if (isNonTemporal)
+        CPU::ZeroNonTemporal(pPage, PAGE_SIZE);
+    else
+        memset(pPage, 0, PAGE_SIZE);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Vmm::CopyFromPhysical(void *pBuffer, const PhysicalAddress &physicalAddress, const size_t nBytes)
+{
+    uint8_t *pDestination = static_cast<uint8_t *>(pBuffer);
+    Address_t address = physicalAddress.Get();
+    size_t nRemainingBytes = nBytes;
+
+    //! Copy page by page, the source may cross page boundaries.
+    while (0 < nRemainingBytes)
+    {
+        const size_t pageOffset = address & (PAGE_SIZE - 1);
+        const size_t nPageBytes = ((PAGE_SIZE - pageOffset) < nRemainingBytes) ? (PAGE_SIZE - pageOffset) : nRemainingBytes;
+
+        {
+            //! The temporary mapping is shared, keep interrupts off while it's in use.
+            CPU::InterruptDisabler interruptDisabler;
+
+            memcpy(pDestination, MapPage(PhysicalAddress(ALIGN((address), (PAGE_SIZE)))) + pageOffset, nPageBytes);
+        }
+
+        pDestination += nPageBytes;
+        address += nPageBytes;
+        nRemainingBytes -= nPageBytes;
+    }
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::MapMovablePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress, const PageFlags pageFlags)
+{
+    const PhysicalPage * const pPhysicalPage = Pmm::Get().AllocatePage(static_cast<AllocationFlags>(ALLOC_ZEROED | ALLOC_MOVABLE));
+    if (!pPhysicalPage)
+        return STATUS_CODE_FAILURE;
+
+    //! Compaction runs with interrupts disabled, it must not see the entry before the reverse mapping is recorded.
+    CPU::InterruptDisabler interruptDisabler;
+
+    PageTableEntry * const pPte = GetLeafPte(addressSpace.m_pPageTable, virtualAddress);
+    if ((!pPte) || pPte->IsPresent())
+    {
+        Pmm::Get().ReturnPage(pPhysicalPage);
+
+        return (pPte) ? STATUS_CODE_ALREADY_MAPPED : STATUS_CODE_NOT_PRESENT;
+    }
+
+    //! The entry wasn't present, the TLB can't hold a translation for it.
+    pPte->SetPhysicalAddress(pPhysicalPage->GetAddress());
+    pPte->SetPageFlags(GetLeafPageFlags(virtualAddress, pageFlags));
+
+    Pmm::Get().SetReverseMapping(pPhysicalPage, addressSpace, virtualAddress);
+
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::UnmapMovablePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    PageTableEntry * const pPte = GetLeafPte(addressSpace.m_pPageTable, virtualAddress);
+    if ((!pPte) || (!pPte->IsPresent()))
+        return STATUS_CODE_NOT_PRESENT;
+
+    const PhysicalAddress physicalAddress = pPte->GetPhysicalAddress();
+    pPte->SetPresent(false);
+    pPte->SetCopyOnWrite(false);
+    pPte->SetPhysicalAddress(PhysicalAddress(0));
+    InvalidatePage(addressSpace, virtualAddress);
+
+    Pmm::Get().ReturnMovablePage(physicalAddress);
+
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 void Vmm::AllocatePage(AddressSpace &addressSpace, VMArea &VMArea)
 {
         
@@ -161,90 +376,534 @@ PhysicalAddress Vmm::GetEndAddress()
 
 // ---------------------------------------------------------------------------------------------------------
 
+size_t Vmm::ReleaseKernelAreaTail()
+{
+    VMArea &kernelVMArea = m_kernelAddressSpace.m_kernelVMArea;
+    MemoryPool::PhysicalRange &physicalRange = kernelVMArea.m_physicalRange;
+    if (!physicalRange.IsInitalized())
+        return 0;
+
+    //! The address space break is where kmalloc eternal stopped.
+    const PhysicalAddress breakAddress = PhysicalAddress::Create(VirtualAddress(m_kernelAddressSpace.GetAddressSpaceBreak()));
+    const size_t startPfn = ALIGN_TO_NEXT_BOUNDARY(breakAddress.Get(), PAGE_SIZE) / PAGE_SIZE;
+    const size_t rangeStartPfn = physicalRange.GetAddress().Get() / PAGE_SIZE;
+    if ((startPfn < rangeStartPfn) || (startPfn >= (rangeStartPfn + physicalRange.m_nPages)))
+        return 0;
+
+    const size_t nPages = (rangeStartPfn + physicalRange.m_nPages) - startPfn;
+
+    return Pmm::Get().ReleaseRange(physicalRange, nPages);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::BuildDirectMap()
+{
+    Pmm &pmm = Pmm::Get();
+
+    Address_t spanStartAddress = 0;
+    Address_t spanEndAddress = 0;
+    for (size_t regionIndex = 0; regionIndex < pmm.GetMemoryRegionCount(); ++regionIndex)
+    {
+        size_t regionSize = 0;
+        const PhysicalAddress regionAddress = pmm.GetMemoryRegion(regionIndex, regionSize);
+        const Address_t startAddress = ALIGN((regionAddress.Get()), (PAGE_2M));
+        Address_t endAddress = ALIGN_TO_NEXT_BOUNDARY((regionAddress.Get() + regionSize), (PAGE_2M));
+        if (startAddress >= MAX_DIRECT_MAP_SIZE)
+            continue;
+        else if (endAddress > MAX_DIRECT_MAP_SIZE)
+            endAddress = MAX_DIRECT_MAP_SIZE;
+
+        //! Coalesce the regions which touch once widened, like the ones split at node boundaries. The spans of an unsorted
+        //! memory map may overlap, the overlap is mapped again with the same translation.
+        if ((spanStartAddress <= startAddress) && (startAddress <= spanEndAddress) && (spanStartAddress != spanEndAddress))
+        {
+            if (endAddress > spanEndAddress)
+                spanEndAddress = endAddress;
+
+            continue;
+        }
+
+        if (STATUS_CODE_SUCCESS != MapRange(m_kernelAddressSpace, PhysicalAddress(spanStartAddress),
+                                            VirtualAddress(DIRECT_MAP_ADDR + spanStartAddress), spanEndAddress - spanStartAddress, DIRECT_MAP_FLAGS))
+            return STATUS_CODE_FAILURE;
+
+        spanStartAddress = startAddress;
+        spanEndAddress = endAddress;
+    }
+
+    return MapRange(m_kernelAddressSpace, PhysicalAddress(spanStartAddress), VirtualAddress(DIRECT_MAP_ADDR + spanStartAddress),
+                    spanEndAddress - spanStartAddress, DIRECT_MAP_FLAGS);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Vmm::EnablePcids()
+{
+    //! PCIDE can only be set while the PCID of CR3 is 0, which the boot CR3 is.
+    CPU::CR4 cr4 = CPU::GetCR4();
+    cr4.Set<CPU::CR4::PCIDE>(true);
+    CPU::SetCR4(cr4);
+
+    m_isPcidEnabled = true;
+    m_isInvpcidSupported = CPU::IsInvpcidSupported();
+
+    //! The boot PCID is never assigned, the kernel address space gets a PCID like any other.
+    SwitchAddressSpace(m_kernelAddressSpace);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Vmm::AssignPcid(AddressSpace &addressSpace)
+{
+    if (MAX_PCIDS == m_nextPcid)
+        RetirePcidGeneration();
+
+    addressSpace.m_pcid = m_nextPcid++;
+    addressSpace.m_pcidGeneration = m_pcidGeneration;
+    ++m_pcidCounters.m_nAssignedPcids;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Vmm::RetirePcidGeneration()
+{
+    //! The PCIDs are assigned again from the first one, each is flushed by the first switch to its new address space.
+    ++m_pcidGeneration;
+    m_nextPcid = FIRST_PCID;
+    ++m_pcidCounters.m_nRetiredGenerations;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Vmm::InvalidateOtherPcids()
+{
+    if (!m_isPcidEnabled)
+        return;
+
+    //! Nothing to do when no other address space holds a PCID of the generation.
+    const size_t nAssignedPcids = m_nextPcid - FIRST_PCID;
+    const bool isActiveAssigned = (m_pActiveAddressSpace->m_pcidGeneration == m_pcidGeneration);
+    if (nAssignedPcids <= (isActiveAssigned ? 1 : 0))
+        return;
+
+    RetirePcidGeneration();
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Vmm::DropPcid(AddressSpace &addressSpace)
+{
+    //! The PCID isn't assigned again in this generation, its stale entries can't be used.
+    addressSpace.m_pcidGeneration = 0;
+    ++m_pcidCounters.m_nDroppedPcids;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool Vmm::IsAddressSpaceActive(const AddressSpace &addressSpace) const
+{
+    return (&addressSpace == m_pActiveAddressSpace);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PhysicalAddress Vmm::GetPageTableAddress(const AddressSpace &addressSpace)
+{
+    //! The kernel page table is part of the kernel image, the other ones are allocated pages in the direct map.
+    const Address_t address = reinterpret_cast<Address_t>(addressSpace.m_pPageTable);
+    if ((DIRECT_MAP_ADDR <= address) && (address < (DIRECT_MAP_ADDR + MAX_DIRECT_MAP_SIZE)))
+        return PhysicalAddress(address - DIRECT_MAP_ADDR);
+
+    return PhysicalAddress::Create(VirtualAddress(address));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void Vmm::InvalidatePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress)
+{
+    TlbGather tlbGather(addressSpace);
+    tlbGather.Add(virtualAddress, PAGE_SIZE);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PageSize Vmm::GetLargestPageSize(const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress, const size_t nBytes)
+{
+    //! A huge page needs both addresses aligned to its size, the physical and virtual offsets within it must match.
+    const Address_t alignment = physicalAddress.Get() | virtualAddress.Get();
+
+    if (m_isGigabytePageSupported && (nBytes >= PAGE_1G) && (ALIGN(alignment, PAGE_1G) == alignment))
+        return PAGE_1G;
+    else if ((nBytes >= PAGE_2M) && (ALIGN(alignment, PAGE_2M) == alignment))
+        return PAGE_2M;
+
+    return PAGE_4K;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::AllocatePageTable(PageTableEntry &pageTableEntry, const PageFlags pageFlags)
+{
+    const PhysicalPage * const pPhysicalPage = Pmm::Get().AllocatePage(ALLOC_ZEROED);
+    if (!pPhysicalPage)
+        return STATUS_CODE_FAILURE;
+
+    //! The access rights of a page are the most restrictive ones along the walk, the tables don't restrict anything.
+    pageTableEntry.SetPhysicalAddress(pPhysicalPage->GetAddress());
+    pageTableEntry.SetPageFlags(static_cast<PageFlags>(PRESENT | WRITABLE | (pageFlags & USER_ACCESSIBLE)));
+    ++m_mappingCounters.m_nTables;
+
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 StatusCode Vmm::MapPageImpl(PageTable * const pP4Table, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
-    const PageFlags pageFlags, const PageSize pageSize)
+    const PageFlags pageFlags, const PageSize pageSize, TlbGather &tlbGather)
 {
     ASSERT(pP4Table);
     if (KernelAddressSpace::TEMP_MAP_ADDR_BASE <= virtualAddress.Get())
         return STATUS_CODE_RESERVED;
-    
+
+    if ((ALIGN(physicalAddress.Get(), pageSize) != physicalAddress.Get()) || (ALIGN(virtualAddress.Get(), pageSize) != virtualAddress.Get()) ||
+        ((PAGE_1G == pageSize) && (!m_isGigabytePageSupported)))
+        return STATUS_CODE_INVALID_PARAMETER;
+
     //! Get PTE of the p3 table and check if it's present. Allocate a physical page for it if it doesn't exist.
     PageTableEntry &p4TableEntry = pP4Table->GetPte<TABLE_LEVEL4>(virtualAddress);
-    PageTable *pP3Table = nullptr;
-    if (!p4TableEntry.IsPresent())
+    if (STATUS_CODE_SUCCESS != GetLowerTable<TABLE_LEVEL4>(p4TableEntry, virtualAddress, pageFlags, tlbGather))
+        return STATUS_CODE_FAILURE;
+
+    PageTable * const pP3Table = MapPageLevel<TABLE_LEVEL3>(p4TableEntry.GetPhysicalAddress());
+    PageTableEntry &p3TableEntry = pP3Table->GetPte<TABLE_LEVEL3>(virtualAddress);
+    if (PAGE_1G == pageSize)
     {
-        // Allocate a kernel page.
-        //const PhysicalPage *pPhysicalPage = Pmm::Get().AllocatePage();
-        //const PhysicalAddress pAddr = pPhysicalPage->GetAddress();
-        //p4TableEntry.SetPhysicalAddress(pAddr);
-        //ASSERT(ALIGN(pAddr.Get(), PAGE_2M) == pAddr.Get());
+        SetLeafEntry<TABLE_LEVEL3>(p3TableEntry, physicalAddress, virtualAddress, pageFlags, tlbGather);
+        ++m_mappingCounters.m_nPages1G;
+
+        return STATUS_CODE_SUCCESS;
     }
 
-    pP3Table = MapPageLevel<TABLE_LEVEL3>(p4TableEntry.GetPhysicalAddress());
+    //! Get PTE of the p2 table, allocate the table if it doesn't exist or split the 1 GiB page if there's one.
+    if (STATUS_CODE_SUCCESS != GetLowerTable<TABLE_LEVEL3>(p3TableEntry, virtualAddress, pageFlags, tlbGather))
+        return STATUS_CODE_FAILURE;
 
-    //! Get PTE of the p3 table and check if it's present. Allocate a physical page for it if it doesn't exist.
-    PageTableEntry &p3TableEntry = pP3Table->GetPte<TABLE_LEVEL3>(virtualAddress);
-    PageTable *pP2Table = nullptr;
-    if (!p3TableEntry.IsPresent())
+    PageTable * const pP2Table = MapPageLevel<TABLE_LEVEL2>(p3TableEntry.GetPhysicalAddress());
+    PageTableEntry &p2TableEntry = pP2Table->GetPte<TABLE_LEVEL2>(virtualAddress);
+    if (PAGE_2M == pageSize)
     {
-        // Allocate a kernel page.
-        //const PhysicalPage *pPhysicalPage = Pmm::Get().AllocatePage();
-        //const PhysicalAddress pAddr = pPhysicalPage->GetAddress();
-        //p3TableEntry.SetPhysicalAddress(pAddr);
-        //ASSERT(ALIGN(pAddr.Get(), PAGE_2M) == pAddr.Get());
+        SetLeafEntry<TABLE_LEVEL2>(p2TableEntry, physicalAddress, virtualAddress, pageFlags, tlbGather);
+        ++m_mappingCounters.m_nPages2M;
+
+        return STATUS_CODE_SUCCESS;
     }
 
-    pP2Table = MapPageLevel<TABLE_LEVEL2>(p3TableEntry.GetPhysicalAddress());
+    //! Get PTE of the p1 table, allocate the table if it doesn't exist or split the 2 MiB page if there's one.
+    if (STATUS_CODE_SUCCESS != GetLowerTable<TABLE_LEVEL2>(p2TableEntry, virtualAddress, pageFlags, tlbGather))
+        return STATUS_CODE_FAILURE;
 
-    //! Get PTE of the p2 table and check if it's present. Allocate a physical page for it if it doesn't exist.
-    PageTableEntry &p2TableEntry = pP2Table->GetPte<TABLE_LEVEL2>(virtualAddress);
-    PageTable *pP1Table = nullptr;
-    if (!p2TableEntry.IsPresent())
+    PageTable * const pP1Table = MapPageLevel<TABLE_LEVEL1>(p2TableEntry.GetPhysicalAddress());
+    PageTableEntry &p1TableEntry = pP1Table->GetPte<TABLE_LEVEL1>(virtualAddress);
+    SetLeafEntry<TABLE_LEVEL1>(p1TableEntry, physicalAddress, virtualAddress, pageFlags, tlbGather);
+    ++m_mappingCounters.m_nPages4K;
+
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::MigratePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress, const PhysicalAddress &physicalAddress,
+    const PhysicalAddress &targetAddress)
+{
+    //! Nothing can touch the page between the copy and the switch of the mapping while interrupts are off.
+    CPU::InterruptDisabler interruptDisabler;
+
+    PageTableEntry * const pPte = GetLeafPte(addressSpace.m_pPageTable, virtualAddress);
+    if ((!pPte) || (!pPte->IsPresent()) || (pPte->GetPhysicalAddress().Get() != physicalAddress.Get()))
+        return STATUS_CODE_NOT_FOUND;
+
+    memcpy(MapPageLevelImpl<COPY_LEVEL>(targetAddress), MapPage(physicalAddress), PAGE_SIZE);
+
+    pPte->SetPhysicalAddress(targetAddress);
+    InvalidatePage(addressSpace, virtualAddress);
+
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+uint32_t Vmm::HashPhysicalPage(const PhysicalAddress &physicalAddress)
+{
+    //! The temporary mapping is shared, keep interrupts off while it's in use.
+    CPU::InterruptDisabler interruptDisabler;
+
+    //! FNV-1a over the quad words of the page, folded to 32 bits.
+    const uint64_t *pWords = reinterpret_cast<const uint64_t *>(MapPage(physicalAddress));
+    uint64_t hash = 0xCBF29CE484222325;
+    for (const uint64_t word : Range(pWords, PAGE_SIZE / sizeof(uint64_t)))
+        hash = (hash ^ word) * 0x100000001B3;
+
+    return static_cast<uint32_t>(hash ^ (hash >> 32));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool Vmm::ComparePhysicalPages(const PhysicalAddress &physicalAddress, const PhysicalAddress &otherAddress)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    return (0 == memcmp(MapPage(physicalAddress), MapPageLevelImpl<COPY_LEVEL>(otherAddress), PAGE_SIZE));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::WriteProtectPage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress, const PhysicalAddress &physicalAddress)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    PageTableEntry * const pPte = GetLeafPte(addressSpace.m_pPageTable, virtualAddress);
+    if ((!pPte) || (!pPte->IsPresent()) || (pPte->GetPhysicalAddress().Get() != physicalAddress.Get()))
+        return STATUS_CODE_NOT_FOUND;
+
+    if (pPte->IsWritablePresent())
     {
-        // Allocate a kernel page.
-        //const PhysicalPage *pPhysicalPage = Pmm::Get().AllocatePage();
-        //const PhysicalAddress pAddr = pPhysicalPage->GetAddress();
-        //p2TableEntry.SetPhysicalAddress(pAddr);
-        //ASSERT(ALIGN(pAddr.Get(), PAGE_2M) == pAddr.Get());
+        pPte->SetWritable(false);
+        pPte->SetCopyOnWrite(true);
+        InvalidatePage(addressSpace, virtualAddress);
     }
-    
-    pP1Table = MapPageLevel<TABLE_LEVEL1>(p2TableEntry.GetPhysicalAddress());
 
-    if ((pageFlags & PageFlags::HUGE_PAGE) && (PAGE_2M == pageSize))
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::MergePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress, const PhysicalAddress &physicalAddress,
+    const PhysicalAddress &sharedAddress)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    PageTableEntry * const pPte = GetLeafPte(addressSpace.m_pPageTable, virtualAddress);
+    if ((!pPte) || (!pPte->IsPresent()) || (pPte->GetPhysicalAddress().Get() != physicalAddress.Get()))
+        return STATUS_CODE_NOT_FOUND;
+
+    //! Write protect before the compare, a write in between would be lost with the old frame.
+    const bool isWritable = pPte->IsWritablePresent();
+    pPte->SetWritable(false);
+    InvalidatePage(addressSpace, virtualAddress);
+
+    //! The compare only reuses the page slots of the temporary mapping, the entry stays reachable.
+    if (!ComparePhysicalPages(physicalAddress, sharedAddress))
     {
-        ASSERT(ALIGN(physicalAddress.Get(), PAGE_2M) == physicalAddress.Get());
-        //! 52 bit page size aligned address.
-        p2TableEntry.SetPhysicalAddress(physicalAddress);
+        pPte->SetWritable(isWritable);
+        return STATUS_CODE_FAILURE;
+    }
 
-        //! Set the entry flags.
-        p2TableEntry.SetPageFlags(pageFlags);
+    pPte->SetCopyOnWrite(isWritable);
+    pPte->SetPhysicalAddress(sharedAddress);
+    InvalidatePage(addressSpace, virtualAddress);
 
-        return STATUS_CODE_SUCCESS;
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+StatusCode Vmm::BreakMergedPage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress)
+{
+    const VirtualAddress pageAddress(ALIGN((virtualAddress.Get()), (PAGE_SIZE)));
+
+    CPU::InterruptDisabler interruptDisabler;
+
+    PageTableEntry *pPte = GetLeafPte(addressSpace.m_pPageTable, pageAddress);
+    if ((!pPte) || (!pPte->IsPresent()) || (!pPte->IsCopyOnWrite()))
+        return STATUS_CODE_NOT_FOUND;
+
+    const PhysicalAddress sharedAddress = pPte->GetPhysicalAddress();
+
+    //! The last sharer takes the frame over, the others get a copy of their own. The copy is allocated from the page
+    //! fault handler, it can't reclaim.
+    const PhysicalPage *pPhysicalPage = nullptr;
+    if (Pmm::Get().IsMergedPageShared(sharedAddress))
+    {
+        pPhysicalPage = Pmm::Get().AllocatePage(static_cast<AllocationFlags>(ALLOC_COLD | ALLOC_MOVABLE | ALLOC_ATOMIC));
+        if (!pPhysicalPage)
+            return STATUS_CODE_FAILURE;
+
+        memcpy(MapPageLevelImpl<COPY_LEVEL>(pPhysicalPage->GetAddress()), MapPage(sharedAddress), PAGE_SIZE);
+
+        //! The temporary mapping of the leaf table may have been reused since, walk the tables again.
+        pPte = GetLeafPte(addressSpace.m_pPageTable, pageAddress);
+        pPte->SetPhysicalAddress(pPhysicalPage->GetAddress());
     }
-    else
+
+    pPte->SetCopyOnWrite(false);
+    pPte->SetWritable(true);
+    InvalidatePage(addressSpace, pageAddress);
+
+    Pmm::Get().UnmergePage(sharedAddress, pPhysicalPage, addressSpace, pageAddress);
+
+    return STATUS_CODE_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+PageTableEntry *Vmm::GetLeafPte(PageTable * const pP4Table, const VirtualAddress &virtualAddress)
+{
+    if (KernelAddressSpace::TEMP_MAP_ADDR_BASE <= virtualAddress.Get())
+        return nullptr;
+
+    const PageTableEntry &p4TableEntry = pP4Table->GetPte<TABLE_LEVEL4>(virtualAddress);
+    if (!p4TableEntry.IsPresent())
+        return nullptr;
+
+    const PageTable * const pP3Table = MapPageLevel<TABLE_LEVEL3>(p4TableEntry.GetPhysicalAddress());
+    const PageTableEntry &p3TableEntry = pP3Table->GetPte<TABLE_LEVEL3>(virtualAddress);
+    if ((!p3TableEntry.IsPresent()) || p3TableEntry.IsHugePage())
+        return nullptr;
+
+    const PageTable * const pP2Table = MapPageLevel<TABLE_LEVEL2>(p3TableEntry.GetPhysicalAddress());
+    const PageTableEntry &p2TableEntry = pP2Table->GetPte<TABLE_LEVEL2>(virtualAddress);
+    if ((!p2TableEntry.IsPresent()) || p2TableEntry.IsHugePage())
+        return nullptr;
+
+    PageTable * const pP1Table = MapPageLevel<TABLE_LEVEL1>(p2TableEntry.GetPhysicalAddress());
+
+    return &pP1Table->GetPte<TABLE_LEVEL1>(virtualAddress);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+template <PageTableLevel LEVEL>
+StatusCode Vmm::GetLowerTable(PageTableEntry &pageTableEntry, const VirtualAddress &virtualAddress, const PageFlags pageFlags,
+    TlbGather &tlbGather)
+{
+    if (!pageTableEntry.IsPresent())
+        return AllocatePageTable(pageTableEntry, pageFlags);
+
+    //! Level 4 entries can't map pages.
+    if constexpr (TABLE_LEVEL4 != LEVEL)
     {
-        // Can't be huge page and not a 2M page at this point.
-        ASSERT(false);
+        if (pageTableEntry.IsHugePage())
+            return SplitHugePage<LEVEL>(pageTableEntry, virtualAddress, tlbGather);
     }
 
-    //! Get PTE of the p1 table and check if it exists. Allocate a physical page for it if it doesn't exist.
-    PageTableEntry &p1TableEntry = pP1Table->GetPte<TABLE_LEVEL1>(virtualAddress);
+    //! The paging structure caches may still hold the entry without the user bit, invlpg drops them all.
+    if ((pageFlags & USER_ACCESSIBLE) && (!pageTableEntry.IsUserAccessible()))
+    {
+        pageTableEntry.SetUserAccessible(true);
+        tlbGather.Add(virtualAddress, PAGE_SIZE);
+    }
+
+    return STATUS_CODE_SUCCESS;
+}
 
-    ASSERT(ALIGN(physicalAddress.Get(), PAGE_SIZE) == physicalAddress.Get());
-    //! 52 bit page size aligned address.
-    p1TableEntry.SetPhysicalAddress(physicalAddress);
+// ---------------------------------------------------------------------------------------------------------
 
-    //! Set the entry flags.
-    p1TableEntry.SetPageFlags(pageFlags);
+template <PageTableLevel LEVEL>
+StatusCode Vmm::SplitHugePage(PageTableEntry &pageTableEntry, const VirtualAddress &virtualAddress, TlbGather &tlbGather)
+{
+    constexpr PageTableLevel LOWER_LEVEL = LowerPageLevel<LEVEL>::m_level;
+    constexpr PageSize hugePageSize = (TABLE_LEVEL3 == LEVEL) ? PAGE_1G : PAGE_2M;
+    constexpr PageSize lowerPageSize = (TABLE_LEVEL3 == LEVEL) ? PAGE_2M : PAGE_4K;
+
+    //! Every byte of the table is written, no need to zero it.
+    const PhysicalPage * const pPhysicalPage = Pmm::Get().AllocatePage();
+    if (!pPhysicalPage)
+        return STATUS_CODE_FAILURE;
+
+    //! The smaller pages keep the flags of the huge page, only 4 KiB pages have no huge page bit.
+    PageTableEntry lowerEntry(pageTableEntry);
+    lowerEntry.SetHugePage(PAGE_4K != lowerPageSize);
+    Address_t address = pageTableEntry.GetPhysicalAddress().Get();
+
+    PageTable * const pLowerTable = MapPageLevel<LOWER_LEVEL>(pPhysicalPage->GetAddress());
+    for (PageTableEntry &entry : pLowerTable->m_entries)
+    {
+        lowerEntry.SetPhysicalAddress(PhysicalAddress(address));
+        entry = lowerEntry;
+        address += lowerPageSize;
+    }
+
+    PageTableEntry tableEntry;
+    tableEntry.SetPhysicalAddress(pPhysicalPage->GetAddress());
+    tableEntry.SetPageFlags(static_cast<PageFlags>(PRESENT | WRITABLE | (pageTableEntry.IsUserAccessible() ? USER_ACCESSIBLE : NO_FLAGS)));
+    pageTableEntry = tableEntry;
+
+    //! The translation is the same, drop the TLB entry of the huge page so that the smaller pages take over.
+    tlbGather.Add(virtualAddress, PAGE_SIZE, hugePageSize);
+    ++m_mappingCounters.m_nTables;
+    ++m_mappingCounters.m_nSplitPages;
 
     return STATUS_CODE_SUCCESS;
 }
 
 // ---------------------------------------------------------------------------------------------------------
 
+template <PageTableLevel LEVEL>
+void Vmm::SetLeafEntry(PageTableEntry &pageTableEntry, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
+    const PageFlags pageFlags, TlbGather &tlbGather)
+{
+    constexpr PageSize pageSize = (TABLE_LEVEL3 == LEVEL) ? PAGE_1G : ((TABLE_LEVEL2 == LEVEL) ? PAGE_2M : PAGE_4K);
+
+    const PageTableEntry oldEntry(pageTableEntry);
+
+    //! Build the entry aside, the walk must never see it half written.
+    PageTableEntry entry;
+    entry.SetPhysicalAddress(physicalAddress);
+    entry.SetPageFlags(GetLeafPageFlags(virtualAddress, pageFlags));
+    entry.SetHugePage(PAGE_4K != pageSize);
+    pageTableEntry = entry;
+
+    if (!oldEntry.IsPresent())
+    {
+        tlbGather.AddNewPage();
+        return;
+    }
+
+    //! A huge page replaces the whole lower table, whose smaller pages may be cached anywhere in the range.
+    if constexpr (TABLE_LEVEL1 != LEVEL)
+    {
+        if (!oldEntry.IsHugePage())
+        {
+            tlbGather.Add(virtualAddress, pageSize);
+            FreePageTable<LEVEL>(oldEntry, tlbGather);
+            ++m_mappingCounters.m_nMergedTables;
+
+            return;
+        }
+    }
+
+    tlbGather.Add(virtualAddress, pageSize, pageSize);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+template <PageTableLevel LEVEL>
+void Vmm::FreePageTable(const PageTableEntry &pageTableEntry, TlbGather &tlbGather)
+{
+    //! The level 2 tables hold the level 1 tables, these only hold pages.
+    if constexpr (TABLE_LEVEL3 == LEVEL)
+    {
+        const PageTable * const pLowerTable = MapPageLevel<TABLE_LEVEL2>(pageTableEntry.GetPhysicalAddress());
+        for (const PageTableEntry &entry : pLowerTable->m_entries)
+        {
+            if (entry.IsPresent() && (!entry.IsHugePage()))
+                FreePageTable<TABLE_LEVEL2>(entry, tlbGather);
+        }
+    }
+
+    tlbGather.RemoveTable(pageTableEntry.GetPhysicalAddress());
+    ++m_mappingCounters.m_nFreedTables;
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
 template <PageTableLevel LEVEL>
 void *Vmm::MapPageLevelImpl(const PhysicalAddress &physicalAddress)
 {
+    if (m_isDirectMapped)
+        return PhysicalToVirtual(physicalAddress);
+
     VirtualAddress virtualAddress(KernelAddressSpace::TEMP_MAP_ADDR_BASE);
     virtualAddress.SetLevel1(virtualAddress.GetLevel1() + static_cast<uint8_t>(LEVEL));
 
@@ -256,9 +915,10 @@ void *Vmm::MapPageLevelImpl(const PhysicalAddress &physicalAddress)
     entry.SetWriteThrough(1);
     entry.SetCacheDisabled(0);
     entry.SetHugePage(0);
-    entry.SetGlobal(0);
+    entry.SetGlobal(1);
     entry.SetNoExecute(0);
 
+    //! The slot is global, invlpg drops its old translation whichever PCID cached it.
     CPU::Invlpg(virtualAddress);
 
     return static_cast<void *>(virtualAddress);
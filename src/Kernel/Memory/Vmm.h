@@ -7,6 +7,7 @@
 #include "Libraries/Misc/Singleton.h"
 
 #include "Paging/PageTable.h"
+#include "Paging/TlbGather.h"
 
 #include "KernelAddressSpace.h"
 #include "KernelHeap.h"
@@ -20,6 +21,40 @@ namespace MM
 class Vmm : public Singleton<Vmm>
 {
 public:
+    /*
+     *  @brief The page table mapping counters.
+     */
+    class MappingCounters
+    {
+    public:
+        //! Constructor
+        MappingCounters();
+
+        size_t m_nPages1G;          ///< The number of 1 GiB pages mapped.
+        size_t m_nPages2M;          ///< The number of 2 MiB pages mapped.
+        size_t m_nPages4K;          ///< The number of 4 KiB pages mapped.
+        size_t m_nTables;           ///< The number of page tables allocated.
+        size_t m_nFreedTables;      ///< The number of page tables freed.
+        size_t m_nSplitPages;       ///< The number of huge pages split into a table of smaller pages.
+        size_t m_nMergedTables;     ///< The number of tables replaced by a huge page.
+    };
+
+    /*
+     *  @brief The PCID counters.
+     */
+    class PcidCounters
+    {
+    public:
+        //! Constructor
+        PcidCounters();
+
+        size_t m_nSwitches;             ///< The number of address space switches.
+        size_t m_nNoFlushSwitches;      ///< The number of switches which kept the TLB entries of the address space.
+        size_t m_nAssignedPcids;        ///< The number of PCIDs assigned.
+        size_t m_nRetiredGenerations;   ///< The number of PCID generations retired, on PCID exhaustion or kernel page table removals.
+        size_t m_nDroppedPcids;         ///< The number of PCIDs of inactive address spaces dropped instead of invalidated.
+    };
+
     //! Constructor
     Vmm();
 
@@ -58,6 +93,47 @@ public:
     StatusCode MapPage(AddressSpace &addressSpace, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
         const PageFlags pageFlags, const PageSize pageSize);
 
+    /*
+     *  @brief Map a physically contiguous range with the largest pages the alignment allows.
+     *  The missing page tables are allocated, the huge pages which are partly remapped are split and the tables which
+     *  are entirely remapped by a huge page are freed. Existing mappings in the range are replaced.
+     *
+     *  @param addressSpace the address space.
+     *  @param physicalAddress the 4 KiB aligned physical address of the range.
+     *  @param virtualAddress the 4 KiB aligned virtual address of the range.
+     *  @param nBytes the size of the range, a multiple of 4 KiB.
+     *  @param pageFlags the page flags, the huge page flag is set according to the page sizes.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_INVALID_PARAMETER the range isn't 4 KiB aligned.
+     *  @retval STATUS_CODE_RESERVED the range overlaps the temporary mapping.
+     *  @retval STATUS_CODE_FAILURE out of memory for the page tables, the start of the range may be mapped.
+     */
+    StatusCode MapRange(AddressSpace &addressSpace, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
+        const size_t nBytes, const PageFlags pageFlags);
+
+    /*
+     *  @brief Get the page table mapping counters.
+     *
+     *  @return the mapping counters.
+     */
+    MappingCounters GetMappingCounters();
+
+    /*
+     *  @brief Switch the executing CPU to an address space.
+     *  With PCIDs the TLB entries of the address space are kept from its last switch, unless its PCID was retired.
+     *
+     *  @param addressSpace the address space.
+     */
+    void SwitchAddressSpace(AddressSpace &addressSpace);
+
+    /*
+     *  @brief Get the PCID counters.
+     *
+     *  @return the PCID counters.
+     */
+    PcidCounters GetPcidCounters();
+
     /*
      *  @brief Is a kernel address mapped.
      * 
@@ -98,6 +174,60 @@ public:
     void EnsureMapped(AddressSpace &addressSpace, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
                       const PageFlags pageFlags, const PageSize pageSize);
 
+    /*
+     *  @brief Zero a physical page through a temporary mapping.
+     *
+     *  @param physicalAddress the physical address of the page.
+     *  @param isNonTemporal whether to bypass the cache, for pages which aren't about to be used.
+     */
+    void ZeroPhysicalPage(const PhysicalAddress &physicalAddress, const bool isNonTemporal);
+
+    /*
+     *  @brief Copy from physical memory outside of the kernel image through a temporary mapping.
+     *
+     *  @param pBuffer the buffer to copy to.
+     *  @param physicalAddress the physical address to copy from.
+     *  @param nBytes the amount of bytes to copy.
+     */
+    void CopyFromPhysical(void *pBuffer, const PhysicalAddress &physicalAddress, const size_t nBytes);
+
+    /*
+     *  @brief Get the address of physical memory in the direct map.
+     *  The direct map covers all the RAM reported by the memory map once the VMM is initialized.
+     *
+     *  @param physicalAddress the physical address.
+     *
+     *  @return the virtual address.
+     */
+    static void *PhysicalToVirtual(const PhysicalAddress &physicalAddress);
+
+    /*
+     *  @brief Map a zeroed movable page.
+     *  The mapping owns the page, which the PMM may migrate to another frame while compacting memory.
+     *
+     *  @param addressSpace the address space.
+     *  @param virtualAddress the virtual address of the 4 KiB virtual page.
+     *  @param pageFlags the page flags.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_ALREADY_MAPPED
+     *  @retval STATUS_CODE_NOT_PRESENT a page table on the way is missing or maps a huge page.
+     *  @retval STATUS_CODE_FAILURE out of memory.
+     */
+    StatusCode MapMovablePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress, const PageFlags pageFlags);
+
+    /*
+     *  @brief Unmap a movable page and return it.
+     *  A page merged with others only drops its share of the frame.
+     *
+     *  @param addressSpace the address space.
+     *  @param virtualAddress the virtual address of the 4 KiB virtual page.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_NOT_PRESENT
+     */
+    StatusCode UnmapMovablePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress);
+
     /*
      *  @brief Allocate physical storage for the virtual page.
      *
@@ -113,23 +243,269 @@ public:
      */
     PhysicalAddress GetEndAddress();
 
+    /*
+     *  @brief Release the physical pages of the kernel VMArea past the end of the kmalloc eternal arena.
+     *  The kernel VMArea keeps its huge page mappings, only its physical range shrinks.
+     *
+     *  @return the number of released pages.
+     */
+    size_t ReleaseKernelAreaTail();
+
 private:
     static PageTable * const m_pTempMapTable;  ///< Level 1 page table used to map temporary pages. Always mapped as last 2MiB in kernel address space.
+    static constexpr PageTableLevel COPY_LEVEL = static_cast<PageTableLevel>(PAGE_LEVEL + 1);   ///< The temporary map slot of the copy destination page.
+    static constexpr uint16_t MAX_PCIDS = 4096;     ///< The number of PCIDs, from the width of the CR3 PCID field.
+    static constexpr uint16_t FIRST_PCID = 1;       ///< The first PCID assigned, PCID 0 is the one of the boot CR3.
+    static bool m_isDirectMapped;               ///< Whether the page tables and pages are reached through the direct map instead of the temporary mapping.
+
+    /*
+     *  @brief Map all the RAM reported by the memory map in the direct map, with the largest page size available.
+     *  The regions are widened to 2 MiB boundaries and the adjacent ones are coalesced, so that they can share 1 GiB pages.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_FAILURE out of memory for the page tables, the temporary mapping stays in use.
+     */
+    StatusCode BuildDirectMap();
+
+    //! Enable the PCIDs and move the kernel address space to its own PCID.
+    void EnablePcids();
+
+    /*
+     *  @brief Assign a PCID of the current generation to an address space, a new generation starts when they run out.
+     *
+     *  @param addressSpace the address space.
+     */
+    void AssignPcid(AddressSpace &addressSpace);
+
+    //! Retire the PCID generation, the PCIDs of all the address spaces are stale.
+    void RetirePcidGeneration();
+
+    //! Invalidate the higher half tables removed from the paging structure caches of the PCIDs other than the active one,
+    //! lazily by retiring the generation. The global pages themselves are invalidated in every PCID by invlpg.
+    void InvalidateOtherPcids();
+
+    /*
+     *  @brief Drop the PCID of an inactive address space, which gets a new one on its next switch.
+     *
+     *  @param addressSpace the address space.
+     */
+    void DropPcid(AddressSpace &addressSpace);
+
+    /*
+     *  @brief Whether an address space is the active one on the executing CPU.
+     *
+     *  @param addressSpace the address space.
+     *
+     *  @return whether the address space is active.
+     */
+    bool IsAddressSpaceActive(const AddressSpace &addressSpace) const;
+
+    /*
+     *  @brief Get the physical address of the level 4 page table of an address space.
+     *
+     *  @param addressSpace the address space.
+     *
+     *  @return the physical address.
+     */
+    PhysicalAddress GetPageTableAddress(const AddressSpace &addressSpace);
+
+    /*
+     *  @brief Invalidate the translation of a page after its entry changed.
+     *
+     *  @param addressSpace the address space.
+     *  @param virtualAddress the virtual address of the page.
+     */
+    void InvalidatePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress);
 
     /*
-     *  @brief Map an address 
+     *  @brief Get the largest page size which maps the start of a range.
+     *
+     *  @param physicalAddress the physical address of the range.
+     *  @param virtualAddress the virtual address of the range.
+     *  @param nBytes the size of the range.
+     *
+     *  @return the page size.
+     */
+    PageSize GetLargestPageSize(const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress, const size_t nBytes);
+
+    /*
+     *  @brief Allocate a zeroed page table and point a table entry to it.
+     *
+     *  @param pageTableEntry the entry.
+     *  @param pageFlags the flags of the pages mapped through the table, the table is user accessible with them.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_FAILURE out of memory.
+     */
+    StatusCode AllocatePageTable(PageTableEntry &pageTableEntry, const PageFlags pageFlags);
+
+    /*
+     *  @brief Make a table entry point to a lower page table.
+     *  The table is allocated if the entry isn't present, a huge page mapped by the entry is split.
+     *
+     *  @param pageTableEntry the entry.
+     *  @param virtualAddress a virtual address mapped through the entry.
+     *  @param pageFlags the flags of the pages mapped through the table.
+     *  @param tlbGather the gather of the batch.
+     *
+     *  @tparam LEVEL the level of the table holding the entry.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_FAILURE out of memory.
+     */
+    template <PageTableLevel LEVEL>
+    StatusCode GetLowerTable(PageTableEntry &pageTableEntry, const VirtualAddress &virtualAddress, const PageFlags pageFlags,
+        TlbGather &tlbGather);
+
+    /*
+     *  @brief Split a huge page into a table of the next smaller pages with the same translation.
+     *  The table is filled before the entry points to it, the mapping stays valid throughout.
+     *
+     *  @param pageTableEntry the entry mapping the huge page.
+     *  @param virtualAddress a virtual address in the huge page.
+     *  @param tlbGather the gather of the batch, the huge page is invalidated on commit.
+     *
+     *  @tparam LEVEL the level of the table holding the entry.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_FAILURE out of memory.
+     */
+    template <PageTableLevel LEVEL>
+    StatusCode SplitHugePage(PageTableEntry &pageTableEntry, const VirtualAddress &virtualAddress, TlbGather &tlbGather);
+
+    /*
+     *  @brief Point a table entry to a page.
+     *  The previous translation is invalidated on commit, a lower table the entry pointed to is freed after that.
+     *
+     *  @param pageTableEntry the entry.
+     *  @param physicalAddress the physical address of the page.
+     *  @param virtualAddress the virtual address of the page.
+     *  @param pageFlags the page flags.
+     *  @param tlbGather the gather of the batch.
+     *
+     *  @tparam LEVEL the level of the table holding the entry.
+     */
+    template <PageTableLevel LEVEL>
+    void SetLeafEntry(PageTableEntry &pageTableEntry, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
+        const PageFlags pageFlags, TlbGather &tlbGather);
+
+    /*
+     *  @brief Free the page table an unlinked entry pointed to, along with its lower tables, once the batch is flushed.
+     *
+     *  @param pageTableEntry the entry.
+     *  @param tlbGather the gather of the batch.
+     *
+     *  @tparam LEVEL the level of the table holding the entry.
+     */
+    template <PageTableLevel LEVEL>
+    void FreePageTable(const PageTableEntry &pageTableEntry, TlbGather &tlbGather);
+
+    /*
+     *  @brief Migrate a mapped page to another frame.
+     *  The contents are copied and the mapping is rewritten to the new frame.
+     *
+     *  @param addressSpace the address space.
+     *  @param virtualAddress the virtual address of the mapping.
+     *  @param physicalAddress the physical address of the mapped frame.
+     *  @param targetAddress the physical address of the new frame.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_NOT_FOUND the virtual address doesn't map the frame.
+     */
+    StatusCode MigratePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress, const PhysicalAddress &physicalAddress,
+        const PhysicalAddress &targetAddress);
+
+    /*
+     *  @brief Hash the contents of a physical page through a temporary mapping.
+     *
+     *  @param physicalAddress the physical address of the page.
+     *
+     *  @return the hash of the page contents.
+     */
+    uint32_t HashPhysicalPage(const PhysicalAddress &physicalAddress);
+
+    /*
+     *  @brief Compare the contents of two physical pages through temporary mappings.
+     *
+     *  @param physicalAddress the physical address of the first page.
+     *  @param otherAddress the physical address of the second page.
+     *
+     *  @return whether the contents are identical.
+     */
+    bool ComparePhysicalPages(const PhysicalAddress &physicalAddress, const PhysicalAddress &otherAddress);
+
+    /*
+     *  @brief Write protect a mapped page so that its frame can be shared.
+     *  A writable mapping is marked copy on write, a write fault gives it a private copy again.
+     *
+     *  @param addressSpace the address space.
+     *  @param virtualAddress the virtual address of the mapping.
+     *  @param physicalAddress the physical address of the mapped frame.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_NOT_FOUND the virtual address doesn't map the frame.
+     */
+    StatusCode WriteProtectPage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress, const PhysicalAddress &physicalAddress);
+
+    /*
+     *  @brief Remap a mapped page to a shared frame of identical contents.
+     *  The contents are compared with the mapping write protected, so the page can't change in between.
+     *
+     *  @param addressSpace the address space.
+     *  @param virtualAddress the virtual address of the mapping.
+     *  @param physicalAddress the physical address of the mapped frame.
+     *  @param sharedAddress the physical address of the shared frame.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_NOT_FOUND the virtual address doesn't map the frame.
+     *  @retval STATUS_CODE_FAILURE the contents differ, the mapping is left untouched.
+     */
+    StatusCode MergePage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress, const PhysicalAddress &physicalAddress,
+        const PhysicalAddress &sharedAddress);
+
+    /*
+     *  @brief Break the sharing of a merged page after a write fault.
+     *  The mapping gets a private copy of the shared frame, the last sharer takes the frame over.
+     *
+     *  @param addressSpace the address space.
+     *  @param virtualAddress the faulting virtual address.
+     *
+     *  @retval STATUS_CODE_SUCCESS
+     *  @retval STATUS_CODE_NOT_FOUND the address isn't a copy on write mapping.
+     *  @retval STATUS_CODE_FAILURE out of memory.
+     */
+    StatusCode BreakMergedPage(AddressSpace &addressSpace, const VirtualAddress &virtualAddress);
+
+    /*
+     *  @brief Get the level 1 page table entry of a virtual address.
+     *  The entry is reached through the temporary mapping of its table and stays valid until the next level 1 table is mapped.
+     *
+     *  @param pP4Table pointer to the Level 4 Page Table.
+     *  @param virtualAddress the virtual address.
+     *
+     *  @return pointer to the entry, nullptr if a table on the way is missing or maps a huge page.
+     */
+    PageTableEntry *GetLeafPte(PageTable * const pP4Table, const VirtualAddress &virtualAddress);
+
+    /*
+     *  @brief Map a page of any size.
+     *  The missing tables on the way are allocated and a huge page on the way is split. A page replaces the existing
+     *  mapping, the TLB entries are invalidated when the caller commits the gather.
      * 
      *  @param pP4Table pointer to the Level 4 Page Table.
      *  @param physicalAddress the physical address of the physical page.
      *  @param virtualAddress the virtual address of the virtual page.
      *  @param pageFlags the page flags.
+     *  @param pageSize the page size, the physical and virtual addresses are aligned to it.
+     *  @param tlbGather the gather of the batch.
      * 
      *  @retval STATUS_CODE_SUCCESS
-     *  @retval STATUS_CODE_ALREADY_MAPPED
-     *  @retval ...
+     *  @retval STATUS_CODE_INVALID_PARAMETER misaligned addresses or unsupported page size.
+     *  @retval STATUS_CODE_RESERVED the page is in the temporary mapping.
+     *  @retval STATUS_CODE_FAILURE out of memory for the page tables.
      */
     StatusCode MapPageImpl(PageTable * const pP4Table, const PhysicalAddress &physicalAddress, const VirtualAddress &virtualAddress,
-        const PageFlags pageFlags, const PageSize pageSize);
+        const PageFlags pageFlags, const PageSize pageSize, TlbGather &tlbGather);
 
     /*
      *  @brief Map a temporary page level impl.
@@ -163,12 +539,54 @@ private:
     KernelHeap                      m_kernelHeap;               ///< The kernel heap.
     KernelAddressSpace              m_kernelAddressSpace;       ///< The kernel address space object.
     Interrupt::PageFaultHandler     m_pageFaultHandler;         ///< The page fault handler.
+    MappingCounters                 m_mappingCounters;          ///< The page table mapping counters.
+    PcidCounters                    m_pcidCounters;             ///< The PCID counters.
+    AddressSpace                    *m_pActiveAddressSpace;     ///< The address space CR3 points to, only the bootstrap processor is running.
+    uint64_t                        m_pcidGeneration;           ///< The current PCID generation, starting at 1.
+    uint16_t                        m_nextPcid;                 ///< The next PCID assigned in the generation.
+    bool                            m_isGigabytePageSupported;  ///< Whether the CPU supports 1 GiB pages.
+    bool                            m_isPcidEnabled;            ///< Whether CR4.PCIDE is set.
+    bool                            m_isInvpcidSupported;       ///< Whether the CPU supports INVPCID.
     bool                            m_isInitialized;            ///< Whether the object is initialized.
 
     friend class Interrupt::PageFaultHandler;
+    friend class MemoryPool;
+    friend class MemoryBenchmark;
+    friend class TlbGather;
     friend class Singleton<Vmm>;
 };
 
+// ---------------------------------------------------------------------------------------------------------
+
+inline Vmm::MappingCounters::MappingCounters() :
+    m_nPages1G(0),
+    m_nPages2M(0),
+    m_nPages4K(0),
+    m_nTables(0),
+    m_nFreedTables(0),
+    m_nSplitPages(0),
+    m_nMergedTables(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline Vmm::PcidCounters::PcidCounters() :
+    m_nSwitches(0),
+    m_nNoFlushSwitches(0),
+    m_nAssignedPcids(0),
+    m_nRetiredGenerations(0),
+    m_nDroppedPcids(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline void *Vmm::PhysicalToVirtual(const PhysicalAddress &physicalAddress)
+{
+    return reinterpret_cast<void *>(DIRECT_MAP_ADDR + physicalAddress.Get());
+}
+
 } // namespace MM
 
 } // namespace BartOS
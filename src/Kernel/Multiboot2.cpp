@@ -35,5 +35,7 @@ const TAG *GetMultiboot2Tag(const multiboot_uint32_t type)
 
 template const multiboot_tag_mmap *GetMultiboot2Tag<multiboot_tag_mmap>(const multiboot_uint32_t type);
 template const multiboot_tag_elf_sections *GetMultiboot2Tag<multiboot_tag_elf_sections>(const multiboot_uint32_t type);
+template const multiboot_tag_old_acpi *GetMultiboot2Tag<multiboot_tag_old_acpi>(const multiboot_uint32_t type);
+template const multiboot_tag_new_acpi *GetMultiboot2Tag<multiboot_tag_new_acpi>(const multiboot_uint32_t type);
 
 } // namespace BartOS
\ No newline at end of file
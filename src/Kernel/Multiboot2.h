@@ -144,6 +144,16 @@ struct [[gnu::packed]] multiboot_tag_module : public multiboot_tag
     char cmdline;
 };
 
+struct [[gnu::packed]] multiboot_tag_old_acpi : public multiboot_tag
+{
+    multiboot_uint8_t rsdp;
+};
+
+struct [[gnu::packed]] multiboot_tag_new_acpi : public multiboot_tag
+{
+    multiboot_uint8_t rsdp;
+};
+
 struct [[gnu::packed]] boot_info
 {
     multiboot_uint32_t total_size;
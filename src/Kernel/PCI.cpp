@@ -0,0 +1,104 @@
+#include "PCI.h"
+
+#include "Kernel/Arch/x86_64/CPU.h"
+
+namespace BartOS
+{
+
+namespace PCI
+{
+
+namespace
+{
+
+/*
+ *  @brief Select a dword of the configuration space of a function.
+ *
+ *  @param location the function.
+ *  @param offset the register offset.
+ */
+void SelectConfig(const Location &location, const uint8_t offset)
+{
+    const uint32_t configAddress = (1U << 31) | (static_cast<uint32_t>(location.m_bus) << 16) |
+                                   (static_cast<uint32_t>(location.m_device) << 11) |
+                                   (static_cast<uint32_t>(location.m_function) << 8) | (offset & 0xFC);
+
+    out_long(PCI_CONFIG_ADDRESS, configAddress);
+}
+
+} // namespace
+
+// ---------------------------------------------------------------------------------------------------------
+
+uint32_t ReadConfig32(const Location &location, const uint8_t offset)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    SelectConfig(location, offset);
+
+    return in_long(PCI_CONFIG_DATA);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+uint16_t ReadConfig16(const Location &location, const uint8_t offset)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    SelectConfig(location, offset);
+
+    return in_word(PCI_CONFIG_DATA + (offset & 0x2));
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+void WriteConfig16(const Location &location, const uint8_t offset, const uint16_t value)
+{
+    CPU::InterruptDisabler interruptDisabler;
+
+    SelectConfig(location, offset);
+
+    out_word(PCI_CONFIG_DATA + (offset & 0x2), value);
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+bool FindDevice(const uint16_t vendorId, const uint16_t deviceId, Location &location)
+{
+    for (size_t bus = 0; bus < PCI_MAX_BUSES; ++bus)
+    {
+        for (size_t device = 0; device < PCI_MAX_DEVICES; ++device)
+        {
+            for (size_t function = 0; function < PCI_MAX_FUNCTIONS; ++function)
+            {
+                const Location candidate(bus, device, function);
+                const uint16_t candidateVendorId = ReadConfig16(candidate, PCI_VENDOR_ID);
+
+                //! Function 0 is always present on a present device.
+                if (PCI_VENDOR_NONE == candidateVendorId)
+                {
+                    if (0 == function)
+                        break;
+
+                    continue;
+                }
+
+                if ((vendorId == candidateVendorId) && (deviceId == ReadConfig16(candidate, PCI_DEVICE_ID)))
+                {
+                    location = candidate;
+                    return true;
+                }
+
+                //! Only multi-function devices decode the other functions.
+                if ((0 == function) && (0 == (ReadConfig16(candidate, PCI_HEADER_TYPE) & PCI_HEADER_MULTI_FUNCTION)))
+                    break;
+            }
+        }
+    }
+
+    return false;
+}
+
+} // namespace PCI
+
+} // namespace BartOS
@@ -0,0 +1,130 @@
+#ifndef PCI_H
+#define PCI_H
+
+#include "Kernel/BartOS.h"
+
+namespace BartOS
+{
+
+/*  The configuration mechanism #1 ports. */
+#define PCI_CONFIG_ADDRESS          0xCF8
+#define PCI_CONFIG_DATA             0xCFC
+
+/*  The configuration space registers of a type 0 header. */
+#define PCI_VENDOR_ID               0x00
+#define PCI_DEVICE_ID               0x02
+#define PCI_COMMAND                 0x04
+#define PCI_HEADER_TYPE             0x0E
+#define PCI_BAR0                    0x10
+#define PCI_SUBSYSTEM_ID            0x2E
+
+/*  The command register bits. */
+#define PCI_COMMAND_IO              (1 << 0)
+#define PCI_COMMAND_MEMORY          (1 << 1)
+#define PCI_COMMAND_BUS_MASTER      (1 << 2)
+
+/*  The header type bits. */
+#define PCI_HEADER_MULTI_FUNCTION   (1 << 7)
+
+/*  The base address register bits. */
+#define PCI_BAR_IO                  (1 << 0)
+#define PCI_BAR_IO_MASK             (~0x3U)
+
+#define PCI_VENDOR_NONE             0xFFFF
+#define PCI_MAX_BUSES               256
+#define PCI_MAX_DEVICES             32
+#define PCI_MAX_FUNCTIONS           8
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+namespace PCI
+{
+
+/*
+ *  @brief The location of a PCI function.
+ */
+class Location
+{
+public:
+    //! Constructor
+    Location();
+
+    /*
+     *  @brief Constructor
+     *
+     *  @param bus the bus.
+     *  @param device the device on the bus.
+     *  @param function the function of the device.
+     */
+    Location(const uint8_t bus, const uint8_t device, const uint8_t function);
+
+    uint8_t m_bus;          ///< The bus.
+    uint8_t m_device;       ///< The device on the bus.
+    uint8_t m_function;     ///< The function of the device.
+};
+
+/*
+ *  @brief Read a dword of the configuration space of a function.
+ *
+ *  @param location the function.
+ *  @param offset the register offset, dword aligned.
+ *
+ *  @return the register value.
+ */
+uint32_t ReadConfig32(const Location &location, const uint8_t offset);
+
+/*
+ *  @brief Read a word of the configuration space of a function.
+ *
+ *  @param location the function.
+ *  @param offset the register offset, word aligned.
+ *
+ *  @return the register value.
+ */
+uint16_t ReadConfig16(const Location &location, const uint8_t offset);
+
+/*
+ *  @brief Write a word of the configuration space of a function.
+ *
+ *  @param location the function.
+ *  @param offset the register offset, word aligned.
+ *  @param value the value.
+ */
+void WriteConfig16(const Location &location, const uint8_t offset, const uint16_t value);
+
+/*
+ *  @brief Find the first function with a vendor and device id by a brute force scan of the buses.
+ *
+ *  @param vendorId the vendor id.
+ *  @param deviceId the device id.
+ *  @param location set to the function when it's found.
+ *
+ *  @return whether the function was found.
+ */
+bool FindDevice(const uint16_t vendorId, const uint16_t deviceId, Location &location);
+
+// ---------------------------------------------------------------------------------------------------------
+// ---------------------------------------------------------------------------------------------------------
+
+inline Location::Location() :
+    m_bus(0),
+    m_device(0),
+    m_function(0)
+{
+}
+
+// ---------------------------------------------------------------------------------------------------------
+
+inline Location::Location(const uint8_t bus, const uint8_t device, const uint8_t function) :
+    m_bus(bus),
+    m_device(device),
+    m_function(function)
+{
+}
+
+} // namespace PCI
+
+} // namespace BartOS
+
+#endif // PCI_H
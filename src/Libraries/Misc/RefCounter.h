@@ -57,7 +57,8 @@ protected:
         return *this;
     }
 
-    virtual ~RefCounter() {}
+    //! Destructor, ref counted objects are never destroyed through the base.
+    ~RefCounter() {}
 
     static void OnDie(RefCounter<TYPE> &object)
     {